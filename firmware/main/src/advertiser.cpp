@@ -0,0 +1,76 @@
+#include "advertiser.hpp"
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/uuid.h>
+#include <sys/printk.h>
+#include <sys/util.h>
+
+// The helper macros for advertising data create compound literals, which are
+// not valid C++, so the data is defined explicitly.
+static const uint8_t advertising_flags[] = {
+	BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR,
+};
+static const uint8_t advertising_appearance[] = {
+	CONFIG_BT_DEVICE_APPEARANCE & 0xff,
+	CONFIG_BT_DEVICE_APPEARANCE >> 8,
+};
+static const uint8_t advertising_uuids[] = {
+	BT_UUID_16_ENCODE(BT_UUID_HIDS_VAL),
+	BT_UUID_16_ENCODE(BT_UUID_BAS_VAL),
+};
+static const struct bt_data advertising_data[] = {
+	BT_DATA(BT_DATA_FLAGS, advertising_flags, sizeof(advertising_flags)),
+	BT_DATA(BT_DATA_GAP_APPEARANCE,
+	        advertising_appearance,
+	        sizeof(advertising_appearance)),
+	BT_DATA(BT_DATA_UUID16_ALL, advertising_uuids, sizeof(advertising_uuids)),
+};
+// Advertising is restarted explicitly whenever a profile has no connection.
+static const struct bt_le_adv_param fast_advertising_param =
+	BT_LE_ADV_PARAM_INIT(BT_LE_ADV_OPT_CONNECTABLE |
+	                     BT_LE_ADV_OPT_ONE_TIME |
+	                     BT_LE_ADV_OPT_USE_NAME,
+	                     BT_GAP_ADV_FAST_INT_MIN_2,
+	                     BT_GAP_ADV_FAST_INT_MAX_2,
+	                     NULL);
+static const struct bt_le_adv_param slow_advertising_param =
+	BT_LE_ADV_PARAM_INIT(BT_LE_ADV_OPT_CONNECTABLE |
+	                     BT_LE_ADV_OPT_ONE_TIME |
+	                     BT_LE_ADV_OPT_USE_NAME,
+	                     BT_GAP_ADV_SLOW_INT_MIN,
+	                     BT_GAP_ADV_SLOW_INT_MAX,
+	                     NULL);
+
+int BluetoothAdvertiser::start_directed(const bt_addr_le_t *peer) {
+	// Without BT_LE_ADV_OPT_DIR_MODE_LOW_DUTY, the controller uses high
+	// duty cycle directed advertising, which ignores the interval and the
+	// advertising data.
+	struct bt_le_adv_param param =
+		BT_LE_ADV_PARAM_INIT(BT_LE_ADV_OPT_CONNECTABLE |
+		                     BT_LE_ADV_OPT_ONE_TIME,
+		                     0,
+		                     0,
+		                     peer);
+	int err = bt_le_adv_start(&param, NULL, 0, NULL, 0);
+	if (err != 0) {
+		printk("failed to start directed advertising: %d\n", err);
+	}
+	return err;
+}
+
+int BluetoothAdvertiser::start_undirected(bool fast) {
+	int err = bt_le_adv_start(fast ? &fast_advertising_param
+	                               : &slow_advertising_param,
+	                          advertising_data,
+	                          ARRAY_SIZE(advertising_data),
+	                          NULL,
+	                          0);
+	if (err != 0) {
+		printk("failed to start advertising: %d\n", err);
+	}
+	return err;
+}
+
+void BluetoothAdvertiser::stop() {
+	bt_le_adv_stop();
+}
@@ -0,0 +1,21 @@
+#ifndef ADVERTISER_HPP_INCLUDED
+#define ADVERTISER_HPP_INCLUDED
+
+#include <bluetooth/addr.h>
+
+/// Hardware-specific part of the reconnection code, see `Reconnector`.
+///
+/// All advertising modes are connectable and stop once a host has connected.
+class BluetoothAdvertiser {
+public:
+	/// Starts high duty cycle directed advertising. The controller stops
+	/// advertising after 1.28s and reports `BT_HCI_ERR_ADV_TIMEOUT` via the
+	/// connected callback.
+	int start_directed(const bt_addr_le_t *peer);
+	/// Starts undirected advertising with the fast (100ms) or slow (1s)
+	/// interval.
+	int start_undirected(bool fast);
+	void stop();
+};
+
+#endif
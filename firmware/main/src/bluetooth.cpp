@@ -1,45 +1,253 @@
 #include "bluetooth.hpp"
 
 #include "exception.hpp"
+#include "leds.hpp"
+#include "work_queue.hpp"
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/conn.h>
 #include <bluetooth/gatt.h>
+#include <bluetooth/services/bas.h>
 #include <settings/settings.h>
+#include <string.h>
 
-BluetoothKeyboard::BluetoothKeyboard(Keys<KeyMatrix> *keys, Leds *leds):
-		keys(keys), leds(leds) {
+/// Delay before a notification is retried if the stack is out of buffers.
+#define NOTIFY_RETRY_MS 5
 
-	// Enable bluetooth.
-	if (bt_enable(static_on_bt_ready) != 0) {
-		throw InitializationFailed("bt_enable failed");
+/// Host bonded to a profile.
+struct ProfilePeer {
+	bool valid;
+	bt_addr_le_t addr;
+};
+
+static ProfilePeer profile_peers[BLUETOOTH_PROFILE_COUNT];
+
+static const char *const PROFILE_PEER_SETTING[BLUETOOTH_PROFILE_COUNT] = {
+	"bt_profile/0", "bt_profile/1"
+};
+
+static int bt_profile_settings_set(const char *name,
+                                   size_t len,
+                                   settings_read_cb read_cb,
+                                   void *cb_arg) {
+	static const char *names[BLUETOOTH_PROFILE_COUNT] = { "0", "1" };
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		const char *next;
+		if (!settings_name_steq(name, names[i], &next) || next) {
+			continue;
+		}
+		profile_peers[i].valid = false;
+		if (len != sizeof(profile_peers[i].addr)) {
+			return -EINVAL;
+		}
+		int ret = read_cb(cb_arg,
+		                  &profile_peers[i].addr,
+		                  sizeof(profile_peers[i].addr));
+		if (ret < 0) {
+			return ret;
+		}
+		profile_peers[i].valid = true;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int bt_profile_settings_export(int (*cb)(const char *name,
+                                                const void *value,
+                                                size_t val_len)) {
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		if (profile_peers[i].valid) {
+			(void)cb(PROFILE_PEER_SETTING[i],
+			         &profile_peers[i].addr,
+			         sizeof(profile_peers[i].addr));
+		}
+	}
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(bt_profile,
+                               "bt_profile",
+                               NULL,
+                               bt_profile_settings_set,
+                               NULL,
+                               bt_profile_settings_export);
+
+enum AdvertisingEvent {
+	/// Advertising has to start from the beginning.
+	ADVERTISING_EVENT_RESTART,
+	/// The controller has stopped directed advertising.
+	ADVERTISING_EVENT_DIRECTED_TIMEOUT,
+};
+
+// Connection parameters while typing: 7.5ms interval without peripheral
+// latency.
+static const ConnectionParameters active_conn_params = {
+	.interval_min = 6,
+	.interval_max = 6,
+	.latency = 0,
+	.timeout = ConnectionParameterManager::supervision_timeout(6, 0),
+};
+static const ConnectionParameters idle_conn_params = {
+	.interval_min = CONFIG_GOBOARD_BT_IDLE_INTERVAL,
+	.interval_max = CONFIG_GOBOARD_BT_IDLE_INTERVAL,
+	.latency = CONFIG_GOBOARD_BT_IDLE_LATENCY,
+	.timeout = ConnectionParameterManager::supervision_timeout(
+		CONFIG_GOBOARD_BT_IDLE_INTERVAL,
+		CONFIG_GOBOARD_BT_IDLE_LATENCY),
+};
+
+// The supervision timeout must be longer than two effective connection
+// intervals and cannot exceed 32s.
+static_assert((1 + CONFIG_GOBOARD_BT_IDLE_LATENCY) *
+              CONFIG_GOBOARD_BT_IDLE_INTERVAL * 5 / 4 * 2 < 32000,
+              "idle peripheral latency too high for the idle interval");
+
+BluetoothKeyboard::ProfileSlot::ProfileSlot():
+		conn_params(active_conn_params,
+		            idle_conn_params,
+		            CONFIG_GOBOARD_BT_IDLE_TIMEOUT_MS) {
+	k_work_init_delayable(&conn_param_work, static_on_conn_param_work);
+}
+
+BluetoothKeyboard::BluetoothKeyboard(KeyScanner *scanner,
+                                     Leds *leds,
+                                     KeyboardProfile profile):
+		scanner(scanner),
+		leds(leds),
+		reconnector(&advertiser,
+		            CONFIG_GOBOARD_BT_ADV_FAST_TIMEOUT_S * 1000,
+		            CONFIG_GOBOARD_BT_ADV_SLOW_TIMEOUT_S * 1000),
+		start_time(k_uptime_get_32()) {
+	k_sched_lock();
+	if (instance != NULL) {
+		k_sched_unlock();
+		throw InvalidState("only one bluetooth keyboard can exist");
 	}
+	instance = this;
+	k_sched_unlock();
 
-	bt_conn_cb_register(&conn_callbacks);
-	// TODO
+	atomic_set(&active_profile, profile_index(profile));
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		slots[i].keyboard = this;
+	}
+	k_work_init_delayable(&advertising_work, static_on_advertising_work);
+	k_work_init_delayable(&report_work, static_on_report_work);
+	memset(&report_state, 0, sizeof(report_state));
+	scanner->set_rate(CONFIG_GOBOARD_SCAN_RATE_HZ,
+	                  CONFIG_GOBOARD_SCAN_RATE_HZ);
+	scanner->set_event_callback(static_on_key_events, this);
+	hids_set_callbacks(&service_callbacks);
+
+	// Enable bluetooth. Zephyr does not support disabling the stack again,
+	// so it is only enabled when the first instance is created. Once the
+	// stack is ready, advertising is started.
+	if (!bt_initialized) {
+		if (bt_enable(static_on_bt_ready) != 0) {
+			hids_set_callbacks(NULL);
+			scanner->set_event_callback(NULL, NULL);
+			instance = NULL;
+			throw InitializationFailed("bt_enable failed");
+		}
+		bt_conn_cb_register(&conn_callbacks);
+		if (bt_conn_auth_cb_register(&auth_callbacks) != 0) {
+			printk("failed to register the pairing callbacks\n");
+		}
+		bt_initialized = true;
+	} else {
+		atomic_set_bit(&advertising_events, ADVERTISING_EVENT_RESTART);
+		k_work_reschedule(&advertising_work, K_NO_WAIT);
+	}
 }
 
 BluetoothKeyboard::~BluetoothKeyboard() {
-	// TODO
+	// The callbacks ignore all events once the instance is gone, so the
+	// work items cannot be submitted again after they have been cancelled.
+	k_sched_lock();
+	instance = NULL;
+	k_sched_unlock();
+	hids_set_callbacks(NULL);
+	scanner->set_event_callback(NULL, NULL);
+	struct k_work_sync sync;
+	k_work_cancel_delayable_sync(&advertising_work, &sync);
+	k_work_cancel_delayable_sync(&report_work, &sync);
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		k_work_cancel_delayable_sync(&slots[i].conn_param_work, &sync);
+	}
+
+	// Stop advertising and close all connections so that the hosts notice
+	// that the keyboard is gone.
+	reconnector.stop();
+	if (passkey_conn != NULL) {
+		bt_conn_auth_cancel(passkey_conn);
+		end_passkey_entry(passkey_conn);
+	}
+	bt_conn_foreach(BT_CONN_TYPE_LE, static_disconnect, NULL);
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		if (slots[i].conn != NULL) {
+			bt_conn_unref(slots[i].conn);
+		}
+	}
+	// The LED state belongs to the host.
+	leds->set_keyboard_leds(0);
 }
 
 KeyboardProfile BluetoothKeyboard::get_profile() {
-	// TODO
-	return PROFILE_1;
+	return (KeyboardProfile)atomic_get(&active_profile);
 }
 
 void BluetoothKeyboard::set_profile(KeyboardProfile profile) {
-	// If we are currently advertising, we need to stop.
-	// TODO
+	int index = profile_index(profile);
+	if (atomic_set(&active_profile, index) == index) {
+		return;
+	}
+
+	// Both hosts stay connected, so switching only requires a report with
+	// all keys released for the previous host and a report with the current
+	// state for the new host. The reports are sent at the next connection
+	// event.
+	ProfileSlot *slot = &slots[index];
+	leds->set_keyboard_leds(atomic_get(&slot->leds));
+	k_work_reschedule_for_queue(&keyboard_work_q, &report_work, K_NO_WAIT);
+
+	// The host of the new profile probably uses the idle connection
+	// parameters.
+	atomic_set(&slot->last_activity, k_uptime_get_32());
+	k_work_reschedule(&slot->conn_param_work, K_NO_WAIT);
 
-	// TODO
-	(void)profile;
+	// If the new profile is not connected, its host is probably the one
+	// the user wants to connect, so directed advertising is restarted.
+	atomic_set_bit(&advertising_events, ADVERTISING_EVENT_RESTART);
+	k_work_reschedule(&advertising_work, K_NO_WAIT);
+}
+
+void BluetoothKeyboard::set_battery_level(uint8_t level) {
+	// The battery service rejects the level with -EAGAIN until the stack
+	// is ready, so static_on_bt_ready() applies the stored level.
+	atomic_set(&battery_level, level);
+	if (atomic_get(&bt_ready) == 0) {
+		return;
+	}
+	apply_battery_level(level);
+}
+
+void BluetoothKeyboard::apply_battery_level(uint8_t level) {
+	// The battery service notifies all hosts whenever the level is set,
+	// even if it has not changed.
+	if (bt_bas_get_battery_level() == level) {
+		return;
+	}
+	int err = bt_bas_set_battery_level(level);
+	if (err != 0) {
+		printk("failed to set the battery level: %d\n", err);
+	}
 }
 
 void BluetoothKeyboard::static_on_bt_ready(int err) {
-	// TODO
-	(void)err;
+	if (err != 0) {
+		printk("bluetooth initialization failed: %d\n", err);
+		return;
+	}
 
 	// We only use one identity for the two profiles. Devices for the
 	// inactive profile stay connected. The identity needs to be persistent,
@@ -65,30 +273,672 @@ void BluetoothKeyboard::static_on_bt_ready(int err) {
 	       addr.a.val[4],
 	       addr.a.val[5]);
 
-	// TODO
+	// The flag is set before the level is read, so a level set by the main
+	// thread in the meantime is applied by either of the two threads.
+	atomic_set(&bt_ready, 1);
+	k_sched_lock();
+	if (instance != NULL) {
+		atomic_val_t level = atomic_get(&instance->battery_level);
+		if (level >= 0) {
+			apply_battery_level(level);
+		}
+		atomic_set_bit(&instance->advertising_events,
+		               ADVERTISING_EVENT_RESTART);
+		k_work_reschedule(&instance->advertising_work, K_NO_WAIT);
+	}
+	k_sched_unlock();
+}
+
+void BluetoothKeyboard::static_on_advertising_work(struct k_work *work) {
+	struct k_work_delayable *delayable = k_work_delayable_from_work(work);
+	BluetoothKeyboard *thisptr = CONTAINER_OF(delayable,
+	                                          BluetoothKeyboard,
+	                                          advertising_work);
+	thisptr->on_advertising_work();
+}
+
+void BluetoothKeyboard::on_advertising_work() {
+	uint32_t now = k_uptime_get_32();
+	bool restart = atomic_test_and_clear_bit(&advertising_events,
+	                                         ADVERTISING_EVENT_RESTART);
+	bool directed_timeout = atomic_test_and_clear_bit(
+		&advertising_events, ADVERTISING_EVENT_DIRECTED_TIMEOUT);
+
+	// The hosts reconnect on their own, so advertising is only required
+	// while a profile is not connected.
+	bool all_connected = true;
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		all_connected = all_connected && slots[i].conn != NULL;
+	}
+	if (all_connected) {
+		reconnector.stop();
+	} else if (restart) {
+		reconnector.start(advertising_peer(), now);
+	} else {
+		if (directed_timeout) {
+			reconnector.on_directed_timeout(now);
+		}
+		reconnector.update(now);
+	}
+	bool stopped = reconnector.get_state() == ADVERTISING_OFF;
+	atomic_set(&advertising_stopped, !all_connected && stopped);
+
+	int32_t next = reconnector.next_update(now);
+	if (next >= 0) {
+		k_work_reschedule(&advertising_work, K_MSEC(next));
+	}
+}
+
+const bt_addr_le_t *BluetoothKeyboard::advertising_peer() {
+	// The host of the selected profile is the one the user wants to type
+	// on, so it is preferred over the host of the other profile.
+	int active = atomic_get(&active_profile);
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		int index = (active + i) % BLUETOOTH_PROFILE_COUNT;
+		if (slots[index].conn == NULL && profile_peers[index].valid) {
+			return &profile_peers[index].addr;
+		}
+	}
+	return NULL;
+}
+
+BluetoothKeyboard::ProfileSlot *BluetoothKeyboard::find_slot(
+		struct bt_conn *conn) {
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		if (slots[i].conn == conn) {
+			return &slots[i];
+		}
+	}
+	return NULL;
 }
+
 void BluetoothKeyboard::static_on_connected(struct bt_conn *conn,
                                             uint8_t err) {
-	(void)conn;
-	(void)err;
-	// TODO
+	if (instance == NULL) {
+		return;
+	}
+	// Connectable advertising stops with every connection attempt. If
+	// directed advertising has timed out, the keyboard continues with
+	// undirected advertising, otherwise advertising starts again.
+	if (err == BT_HCI_ERR_ADV_TIMEOUT) {
+		atomic_set_bit(&instance->advertising_events,
+		               ADVERTISING_EVENT_DIRECTED_TIMEOUT);
+	} else {
+		atomic_set_bit(&instance->advertising_events,
+		               ADVERTISING_EVENT_RESTART);
+	}
+	k_work_reschedule(&instance->advertising_work, K_NO_WAIT);
+	if (err != 0) {
+		return;
+	}
+
+	// Bonded hosts use their own profile. Other hosts can pair with the
+	// selected profile if it is not connected.
+	const bt_addr_le_t *dst = bt_conn_get_dst(conn);
+	ProfileSlot *slot = NULL;
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		if (profile_peers[i].valid &&
+				bt_addr_le_cmp(&profile_peers[i].addr, dst) == 0) {
+			slot = &instance->slots[i];
+		}
+	}
+	if (slot == NULL) {
+		slot = &instance->slots[atomic_get(&instance->active_profile)];
+	}
+	if (slot->conn != NULL) {
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		return;
+	}
+	slot->conn = bt_conn_ref(conn);
+	slot->secure = false;
+	hids_reset_connection(conn);
+
+	// The HID service requires an encrypted connection. If the host is
+	// bonded with an authenticated key, the connection is encrypted with
+	// the stored keys, otherwise pairing with passkey entry is started.
+	if (bt_conn_set_security(conn, BT_SECURITY_L4) != 0) {
+		bt_conn_disconnect(conn, BT_HCI_ERR_AUTH_FAIL);
+	}
 }
 
 void BluetoothKeyboard::static_on_disconnected(struct bt_conn *conn,
                                                uint8_t reason) {
-	(void)conn;
 	(void)reason;
-	// TODO
+	if (instance == NULL) {
+		return;
+	}
+	instance->end_passkey_entry(conn);
+	ProfileSlot *slot = instance->find_slot(conn);
+	if (slot == NULL) {
+		return;
+	}
+	bt_conn_unref(slot->conn);
+	slot->conn = NULL;
+	slot->secure = false;
+	printk("bluetooth: report queue max %u/%u, coalesced %u, dropped %u\n",
+	       instance->report_queue.max_size(),
+	       REPORT_QUEUE_SIZE,
+	       instance->report_queue.coalesced_count(),
+	       instance->report_queue.dropped_count());
+	// Pending notifications are discarded with the connection. A
+	// notification to the host of a different profile is still in flight.
+	int index = slot - instance->slots;
+	if (atomic_cas(&instance->report_in_flight, index + 1, 0)) {
+		k_work_reschedule_for_queue(&keyboard_work_q,
+		                            &instance->report_work,
+		                            K_NO_WAIT);
+	}
+	atomic_set(&slot->active_params, 0);
+	k_work_cancel_delayable(&slot->conn_param_work);
+	atomic_set(&slot->leds, 0);
+	if (slot == &instance->slots[atomic_get(&instance->active_profile)]) {
+		instance->leds->set_keyboard_leds(0);
+	}
+	atomic_set_bit(&instance->advertising_events, ADVERTISING_EVENT_RESTART);
+	k_work_reschedule(&instance->advertising_work, K_NO_WAIT);
 }
 
 void BluetoothKeyboard::static_on_security_changed(struct bt_conn *conn,
                                                    bt_security_t level,
                                                    enum bt_security_err err) {
+	if (instance == NULL) {
+		return;
+	}
+	ProfileSlot *slot = instance->find_slot(conn);
+	if (slot == NULL) {
+		return;
+	}
+	if (err != BT_SECURITY_ERR_SUCCESS) {
+		bt_conn_disconnect(conn, BT_HCI_ERR_AUTH_FAIL);
+		return;
+	}
+	if (level < BT_SECURITY_L4 || slot->secure) {
+		return;
+	}
+	instance->bond_slot(slot);
+}
+
+void BluetoothKeyboard::static_on_passkey_entry(struct bt_conn *conn) {
+	// Only one passkey can be typed at a time.
+	k_sched_lock();
+	if (instance == NULL || instance->passkey_conn != NULL) {
+		k_sched_unlock();
+		bt_conn_auth_cancel(conn);
+		return;
+	}
+	instance->passkey_input.reset();
+	instance->passkey_conn = bt_conn_ref(conn);
+	k_sched_unlock();
+	printk("bluetooth: type the passkey shown by the host and press enter\n");
+}
+
+void BluetoothKeyboard::static_on_auth_cancel(struct bt_conn *conn) {
+	k_sched_lock();
+	if (instance != NULL) {
+		instance->end_passkey_entry(conn);
+	}
+	k_sched_unlock();
+}
+
+void BluetoothKeyboard::static_on_pairing_complete(struct bt_conn *conn,
+                                                   bool bonded) {
+	(void)bonded;
+	static_on_auth_cancel(conn);
+}
+
+void BluetoothKeyboard::static_on_pairing_failed(struct bt_conn *conn,
+                                                 enum bt_security_err reason) {
+	printk("bluetooth: pairing failed: %d\n", reason);
+	static_on_auth_cancel(conn);
+}
+
+void BluetoothKeyboard::end_passkey_entry(struct bt_conn *conn) {
+	k_sched_lock();
+	if (passkey_conn == conn) {
+		bt_conn_unref(passkey_conn);
+		passkey_conn = NULL;
+	}
+	k_sched_unlock();
+}
+
+void BluetoothKeyboard::bond_slot(ProfileSlot *slot) {
+	// The identity address of the host is only known once the connection
+	// is encrypted.
+	const bt_addr_le_t *dst = bt_conn_get_dst(slot->conn);
+	for (int i = 0; i < BLUETOOTH_PROFILE_COUNT; i++) {
+		if (!profile_peers[i].valid ||
+				bt_addr_le_cmp(&profile_peers[i].addr, dst) != 0) {
+			continue;
+		}
+		if (&slots[i] == slot) {
+			break;
+		}
+		// The host is bonded to the other profile.
+		if (slots[i].conn != NULL) {
+			bt_conn_disconnect(slot->conn,
+			                   BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+			return;
+		}
+		slots[i].conn = slot->conn;
+		slot->conn = NULL;
+		slot = &slots[i];
+		break;
+	}
+
+	int index = slot - slots;
+	if (!profile_peers[index].valid ||
+			bt_addr_le_cmp(&profile_peers[index].addr, dst) != 0) {
+		// A new host has paired with the profile and replaces the
+		// previous host.
+		if (profile_peers[index].valid) {
+			bt_unpair(BT_ID_DEFAULT, &profile_peers[index].addr);
+		}
+		bt_addr_le_copy(&profile_peers[index].addr, dst);
+		profile_peers[index].valid = true;
+		if (settings_save_one(PROFILE_PEER_SETTING[index],
+		                      &profile_peers[index].addr,
+		                      sizeof(profile_peers[index].addr)) != 0) {
+			printk("failed to save the bluetooth profile\n");
+		}
+	}
+
+	if (!first_report_sent) {
+		printk("bluetooth: profile %d ready after %u ms\n",
+		       index,
+		       k_uptime_get_32() - start_time);
+	}
+
+	// The host assumes that no key is pressed, so the current state has
+	// to be sent if it differs.
+	slot->secure = true;
+	memset(slot->sent_keyboard_report, 0, sizeof(slot->sent_keyboard_report));
+	slot->sent_consumer_report = 0;
+	k_work_reschedule_for_queue(&keyboard_work_q, &report_work, K_NO_WAIT);
+
+	// The user is likely to type right after connecting, so the active
+	// parameters are requested first.
+	slot->conn_params.reset();
+	atomic_set(&slot->last_activity, k_uptime_get_32());
+	k_work_reschedule(&slot->conn_param_work, K_NO_WAIT);
+}
+
+void BluetoothKeyboard::static_on_param_updated(struct bt_conn *conn,
+                                                uint16_t interval,
+                                                uint16_t latency,
+                                                uint16_t timeout) {
+	(void)timeout;
+	if (instance == NULL) {
+		return;
+	}
+	ProfileSlot *slot = instance->find_slot(conn);
+	if (slot == NULL) {
+		return;
+	}
+	// The update is either the response to a request or was initiated by
+	// the host.
+	slot->conn_params.on_params_updated(k_uptime_get_32(),
+	                                    interval,
+	                                    latency);
+	bool active = slot->conn_params.get_mode() == CONNECTION_MODE_ACTIVE;
+	atomic_set(&slot->active_params, active);
+	k_work_reschedule(&slot->conn_param_work, K_NO_WAIT);
+}
+
+void BluetoothKeyboard::static_disconnect(struct bt_conn *conn, void *data) {
+	(void)data;
+	bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+}
+
+void BluetoothKeyboard::static_on_output_report(struct bt_conn *conn,
+                                                uint8_t leds) {
+	if (instance == NULL) {
+		return;
+	}
+	ProfileSlot *slot = instance->find_slot(conn);
+	if (slot == NULL) {
+		return;
+	}
+	// The LEDs of the inactive host are shown once its profile is
+	// selected.
+	atomic_set(&slot->leds, leds);
+	if (slot == &instance->slots[atomic_get(&instance->active_profile)]) {
+		instance->leds->set_keyboard_leds(leds);
+	}
+}
+
+void BluetoothKeyboard::static_on_protocol_mode(struct bt_conn *conn,
+                                                uint8_t mode) {
+	(void)mode;
+	if (instance == NULL) {
+		return;
+	}
+	ProfileSlot *slot = instance->find_slot(conn);
+	if (slot == NULL) {
+		return;
+	}
+	// The reports are now sent via different characteristics, and the
+	// host does not know the current state of those.
+	memset(slot->sent_keyboard_report, 0, sizeof(slot->sent_keyboard_report));
+	slot->sent_consumer_report = 0;
+	k_work_reschedule_for_queue(&keyboard_work_q,
+	                            &instance->report_work,
+	                            K_NO_WAIT);
+}
+
+void BluetoothKeyboard::static_on_conn_param_work(struct k_work *work) {
+	struct k_work_delayable *delayable = k_work_delayable_from_work(work);
+	ProfileSlot *slot = CONTAINER_OF(delayable,
+	                                 ProfileSlot,
+	                                 conn_param_work);
+	slot->keyboard->on_conn_param_work(slot);
+}
+
+void BluetoothKeyboard::on_conn_param_work(ProfileSlot *slot) {
+	if (slot->conn == NULL || !slot->secure) {
+		return;
+	}
+	uint32_t now = k_uptime_get_32();
+	uint32_t activity = atomic_get(&slot->last_activity);
+	ConnectionParameters params;
+	if (slot->conn_params.update(now, activity, &params)) {
+		struct bt_le_conn_param param = {
+			.interval_min = params.interval_min,
+			.interval_max = params.interval_max,
+			.latency = params.latency,
+			.timeout = params.timeout,
+		};
+		int err = bt_conn_le_param_update(slot->conn, &param);
+		if (err == -EALREADY) {
+			// The connection already uses the parameters.
+			struct bt_conn_info info;
+			bt_conn_get_info(slot->conn, &info);
+			slot->conn_params.on_params_updated(now,
+			                                    info.le.interval,
+			                                    info.le.latency);
+		} else if (err != 0) {
+			slot->conn_params.on_request_failed(now);
+		}
+	}
+	int32_t next = slot->conn_params.next_update(now, activity);
+	if (next >= 0) {
+		k_work_reschedule(&slot->conn_param_work, K_MSEC(next));
+	}
+}
+
+void BluetoothKeyboard::static_on_key_events(void *arg) {
+	BluetoothKeyboard *thisptr = (BluetoothKeyboard *)arg;
+	// If a notification is being retried, the retry delay is kept.
+	k_work_schedule_for_queue(&keyboard_work_q,
+	                          &thisptr->report_work,
+	                          K_NO_WAIT);
+}
+
+void BluetoothKeyboard::static_on_report_work(struct k_work *work) {
+	struct k_work_delayable *delayable = k_work_delayable_from_work(work);
+	BluetoothKeyboard *thisptr = CONTAINER_OF(delayable,
+	                                          BluetoothKeyboard,
+	                                          report_work);
+	thisptr->on_report_work();
+}
+
+void BluetoothKeyboard::on_report_work() {
+	// Key events are processed while a notification is in flight, so that
+	// intermediate states can be merged before they are sent.
+	queue_reports();
+
+	// Only one notification is queued in the stack at a time, so that
+	// changes are not delayed by a long queue of outdated reports.
+	// static_on_report_sent() triggers this function again.
+	while (atomic_get(&report_in_flight) == 0) {
+		if (send_reports()) {
+			return;
+		}
+		if (!queue_reports()) {
+			return;
+		}
+	}
+}
+
+bool BluetoothKeyboard::queue_reports() {
+	process_passkey_events();
+	if (passkey_conn != NULL) {
+		return false;
+	}
+
+	bool queued = false;
+	while (true) {
+		// If the queue is full, the key events stay in the key event
+		// queue until the host has caught up.
+		if (has_unqueued_report) {
+			if (!report_queue.push(unqueued_report)) {
+				return queued;
+			}
+			has_unqueued_report = false;
+			queued = true;
+		}
+
+		// The keys are scanned by the key scanner thread, we only fetch
+		// the changes. Events are processed while no host is connected
+		// so that the state is up to date once a host connects.
+		KeyBitmap changed;
+		if (!scanner->get_events()->drain(&key_bitmap, &changed)) {
+			return queued;
+		}
+		apply_changes(changed);
+		record_activity();
+
+		ReportState state;
+		memcpy(state.keyboard, six_keys.data, sizeof(state.keyboard));
+		state.consumer = key_bitmap.consumer_keys();
+		if (memcmp(&state, &report_state, sizeof(state)) != 0) {
+			report_state = state;
+			unqueued_report = state;
+			has_unqueued_report = true;
+		}
+	}
+}
+
+void BluetoothKeyboard::process_passkey_events() {
+	// While the user types the passkey, the keys are not sent to any host.
+	// The events are processed one at a time because the order of the
+	// digits matters. The key state is still updated so that the keys
+	// held after pairing are reported correctly.
+	KeyEventQueue *events = scanner->get_events();
+	KeyEvent event;
+	while (passkey_conn != NULL && events->peek(&event)) {
+		events->pop();
+		KeyBitmap changed;
+		changed.set_bit(event.key);
+		if (event.pressed) {
+			key_bitmap.set_bit(event.key);
+		} else {
+			key_bitmap.clear_bit(event.key);
+		}
+		apply_changes(changed);
+		if (!event.pressed) {
+			continue;
+		}
+		switch (passkey_input.press(event.key)) {
+		case PASSKEY_ENTERED:
+			bt_conn_auth_passkey_entry(passkey_conn,
+			                           passkey_input.get_passkey());
+			end_passkey_entry(passkey_conn);
+			break;
+		case PASSKEY_CANCELLED:
+			bt_conn_auth_cancel(passkey_conn);
+			end_passkey_entry(passkey_conn);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void BluetoothKeyboard::record_activity() {
+	ProfileSlot *slot = &slots[atomic_get(&active_profile)];
+	atomic_set(&slot->last_activity, k_uptime_get_32());
+	// Switch to the active connection parameters right away. Otherwise,
+	// conn_param_work is already scheduled to check for the idle timeout.
+	if (atomic_get(&slot->active_params) == 0) {
+		k_work_reschedule(&slot->conn_param_work, K_NO_WAIT);
+	}
+	// The user probably wants to connect a host if advertising has timed
+	// out.
+	if (atomic_get(&advertising_stopped) != 0) {
+		atomic_set(&advertising_stopped, 0);
+		atomic_set_bit(&advertising_events, ADVERTISING_EVENT_RESTART);
+		k_work_reschedule(&advertising_work, K_NO_WAIT);
+	}
+}
+
+void BluetoothKeyboard::apply_changes(const KeyBitmap &changed) {
+	// The consumer keys are not part of the keyboard report.
+	KeyBitmap keyboard_state = key_bitmap;
+	keyboard_state.clear_consumer_keys();
+	KeyBitmap keyboard_changed = changed;
+	keyboard_changed.clear_consumer_keys();
+	if (!keyboard_changed.is_empty()) {
+		six_keys.update(keyboard_state, keyboard_changed);
+	}
+}
+
+bool BluetoothKeyboard::send_reports() {
+	static const uint8_t released[HIDS_KEYBOARD_REPORT_SIZE] = {0};
+	static_assert(sizeof(ReportState::keyboard) == HIDS_KEYBOARD_REPORT_SIZE,
+	              "wrong keyboard report size");
+	int active = atomic_get(&active_profile);
+
+	while (true) {
+		// The host of the active profile receives the queued states one
+		// after another, so that every single transition is reported.
+		// Once the queue is empty, the host receives the current state.
+		ReportState state;
+		bool queued = report_queue.peek(&state);
+		if (!queued) {
+			state = report_state;
+		}
+
+		// The hosts of the inactive profiles come first, so that a key
+		// is released on the previous host before it is pressed on the
+		// new host after a profile switch.
+		for (int i = 1; i <= BLUETOOTH_PROFILE_COUNT; i++) {
+			int index = (active + i) % BLUETOOTH_PROFILE_COUNT;
+			ProfileSlot *slot = &slots[index];
+			if (slot->conn == NULL || !slot->secure) {
+				continue;
+			}
+			const uint8_t *keyboard = index == active ? state.keyboard
+			                                          : released;
+			uint8_t consumer = index == active ? state.consumer : 0;
+			// If both reports have changed, the consumer report is
+			// sent once the keyboard report has been sent.
+			if (memcmp(keyboard,
+			           slot->sent_keyboard_report,
+			           HIDS_KEYBOARD_REPORT_SIZE) != 0) {
+				return send_report(slot,
+				                   HIDS_INPUT_KEYBOARD,
+				                   keyboard,
+				                   HIDS_KEYBOARD_REPORT_SIZE);
+			}
+			if (consumer != slot->sent_consumer_report) {
+				return send_report(slot,
+				                   HIDS_INPUT_CONSUMER,
+				                   &consumer,
+				                   sizeof(consumer));
+			}
+		}
+		if (!queued) {
+			return false;
+		}
+
+		// The oldest queued state has reached the active host, or is
+		// lost if the host is not connected.
+		ProfileSlot *slot = &slots[active];
+		if (slot->conn != NULL && slot->secure) {
+			report_queue.pop();
+		} else {
+			report_queue.drop();
+		}
+	}
+}
+
+bool BluetoothKeyboard::send_report(ProfileSlot *slot,
+                                    hids_input_report report,
+                                    const uint8_t *data,
+                                    uint16_t length) {
+	uint8_t *sent = report == HIDS_INPUT_CONSUMER
+	              ? &slot->sent_consumer_report
+	              : slot->sent_keyboard_report;
+
+	// The host might not be interested in the report at all, e.g., the
+	// consumer report in boot protocol.
+	if (!hids_is_subscribed(slot->conn, report)) {
+		memcpy(sent, data, length);
+		return false;
+	}
+
+	atomic_set(&report_in_flight, slot - slots + 1);
+	int err = hids_notify(slot->conn,
+	                      report,
+	                      data,
+	                      length,
+	                      static_on_report_sent,
+	                      NULL);
+	if (err == -ENOMEM) {
+		// Retry once the stack has freed some buffers.
+		atomic_set(&report_in_flight, 0);
+		k_work_schedule_for_queue(&keyboard_work_q,
+		                          &report_work,
+		                          K_MSEC(NOTIFY_RETRY_MS));
+		return true;
+	}
+	// On other errors, the connection is being closed, and the state is
+	// sent again once the next connection has been encrypted.
+	memcpy(sent, data, length);
+	if (err != 0) {
+		atomic_set(&report_in_flight, 0);
+		return false;
+	}
+	if (!first_report_sent &&
+			slot == &slots[atomic_get(&active_profile)]) {
+		first_report_sent = true;
+		printk("bluetooth: first report after %u ms (uptime %u ms)\n",
+		       k_uptime_get_32() - start_time,
+		       k_uptime_get_32());
+	}
+	return true;
+}
+
+void BluetoothKeyboard::static_on_report_sent(struct bt_conn *conn,
+                                              void *user_data) {
 	(void)conn;
-	(void)level;
-	(void)err;
-	// TODO
+	(void)user_data;
+	k_sched_lock();
+	if (instance != NULL) {
+		atomic_set(&instance->report_in_flight, 0);
+		k_work_reschedule_for_queue(&keyboard_work_q,
+		                            &instance->report_work,
+		                            K_NO_WAIT);
+	}
+	k_sched_unlock();
 }
 
 BluetoothKeyboard *BluetoothKeyboard::instance = NULL;
-
+bool BluetoothKeyboard::bt_initialized = false;
+atomic_t BluetoothKeyboard::bt_ready = ATOMIC_INIT(0);
+struct bt_conn_cb BluetoothKeyboard::conn_callbacks = {
+	.connected = static_on_connected,
+	.disconnected = static_on_disconnected,
+	.le_param_updated = static_on_param_updated,
+	.security_changed = static_on_security_changed,
+};
+struct bt_conn_auth_cb BluetoothKeyboard::auth_callbacks = {
+	.passkey_entry = static_on_passkey_entry,
+	.cancel = static_on_auth_cancel,
+	.pairing_complete = static_on_pairing_complete,
+	.pairing_failed = static_on_pairing_failed,
+};
+const struct hids_callbacks BluetoothKeyboard::service_callbacks = {
+	.output_report = static_on_output_report,
+	.protocol_mode = static_on_protocol_mode,
+};
@@ -1,25 +1,113 @@
 #ifndef BLUETOOTH_HPP_INCLUDED
 #define BLUETOOTH_HPP_INCLUDED
 
+#include "advertiser.hpp"
+#include "conn_params.hpp"
+#include "hids.h"
 #include "mode_switch.hpp"
-#include "key_matrix.hpp"
+#include "key_scanner.hpp"
 #include "keys.hpp"
+#include "passkey.hpp"
+#include "reconnect.hpp"
+#include "report_queue.hpp"
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/conn.h>
 
+/// Number of profiles, i.e., hosts which can be connected at the same time.
+#define BLUETOOTH_PROFILE_COUNT 2
+
 class Leds;
 
 /// Bluetooth HIDS keyboard implementation.
+///
+/// The keyboard implements HID over GATT with boot and report protocol. Input
+/// reports are only sent when the key scanner publishes a change which affects
+/// the report, and only the characteristic of the affected report in the
+/// current protocol mode is notified. Only one notification is in flight at a
+/// time, further changes are sent once the previous notification has been
+/// passed to the controller. In the meantime, the changes are collected in a
+/// `ReportQueue`, which merges intermediate states if the host is slow, so the
+/// key scanner never has to wait for the host and no key press is lost.
+///
+/// Each profile is bonded to one host, and the hosts of both profiles stay
+/// connected at the same time. Switching the profile only changes which host
+/// receives the input reports - the previous host receives a report with all
+/// keys released, the new host receives the current key state. A host which is
+/// not bonded to any profile can only connect if the selected profile is not
+/// connected, and it replaces the previous host of that profile once pairing
+/// has completed.
+///
+/// Pairing requires LE Secure Connections with MITM protection (security level
+/// 4). The keyboard has no display, so the host displays a passkey which the
+/// user types on the keyboard, see `PasskeyInput`. The keys typed during
+/// pairing are not sent to any host.
+///
+/// While a profile has no connection, the keyboard advertises as described in
+/// `Reconnector`, starting with directed advertising towards the bonded host of
+/// the selected profile. Once advertising has timed out, the next key press
+/// restarts it.
+///
+/// The connection parameters are adapted to the key activity, see
+/// `ConnectionParameterManager`. The host of the inactive profile therefore
+/// moves to the idle parameters.
+///
+/// The keyboard can be destroyed and constructed again at any time, e.g., when
+/// the keyboard mode is switched. The Bluetooth stack itself cannot be disabled
+/// again, so it stays enabled, but all connections are closed and advertising
+/// is stopped when the keyboard is destroyed. Only one instance can exist at a
+/// time.
 class BluetoothKeyboard {
 public:
-	BluetoothKeyboard(Keys<KeyMatrix> *keys, Leds *leds);
+	BluetoothKeyboard(KeyScanner *scanner, Leds *leds, KeyboardProfile profile);
 	~BluetoothKeyboard();
 
 	KeyboardProfile get_profile();
+	/// Redirects the input reports to the host of a different profile.
+	///
+	/// The function does not wait for any Bluetooth operation.
 	void set_profile(KeyboardProfile profile);
+	/// Updates the battery level reported via the battery service. The hosts
+	/// are only notified if the level has changed.
+	///
+	/// Before the Bluetooth stack is ready, the level is stored and reported
+	/// once the stack is ready.
+	void set_battery_level(uint8_t level);
 private:
+	/// Connection to the host of a single profile.
+	struct ProfileSlot {
+		ProfileSlot();
+
+		BluetoothKeyboard *keyboard = NULL;
+		/// Connection to the host, or NULL if the host is not connected.
+		struct bt_conn *conn = NULL;
+		/// True once the connection is encrypted and reports can be
+		/// sent.
+		bool secure = false;
+		/// Last reports sent to the host, so that changes which do not
+		/// affect a report (e.g., a seventh key) do not cause a
+		/// notification.
+		uint8_t sent_keyboard_report[HIDS_KEYBOARD_REPORT_SIZE] = {0};
+		uint8_t sent_consumer_report = 0;
+		/// LED state set by the host.
+		atomic_t leds = ATOMIC_INIT(0);
+
+		/// Only accessed from the Bluetooth RX thread and the system
+		/// workqueue.
+		ConnectionParameterManager conn_params;
+		/// Time of the last key event while the profile was selected
+		/// (`k_uptime_get_32()`).
+		atomic_t last_activity = ATOMIC_INIT(0);
+		/// True if the active connection parameters are in use, in which
+		/// case key events do not need to trigger `conn_param_work`.
+		atomic_t active_params = ATOMIC_INIT(0);
+		/// Requests new connection parameters if necessary, executed on
+		/// the system workqueue as the request might block.
+		struct k_work_delayable conn_param_work;
+	};
+
 	static void static_on_bt_ready(int err);
+	static void apply_battery_level(uint8_t level);
 	static void static_on_connected(struct bt_conn *conn,
 	                                uint8_t err);
 	static void static_on_disconnected(struct bt_conn *conn,
@@ -27,20 +115,116 @@ private:
 	static void static_on_security_changed(struct bt_conn *conn,
 	                                       bt_security_t level,
 	                                       enum bt_security_err err);
+	static void static_on_param_updated(struct bt_conn *conn,
+	                                    uint16_t interval,
+	                                    uint16_t latency,
+	                                    uint16_t timeout);
+	static void static_disconnect(struct bt_conn *conn, void *data);
+	static void static_on_output_report(struct bt_conn *conn, uint8_t leds);
+	static void static_on_protocol_mode(struct bt_conn *conn, uint8_t mode);
+	static void static_on_passkey_entry(struct bt_conn *conn);
+	static void static_on_auth_cancel(struct bt_conn *conn);
+	static void static_on_pairing_complete(struct bt_conn *conn, bool bonded);
+	static void static_on_pairing_failed(struct bt_conn *conn,
+	                                     enum bt_security_err reason);
+	void end_passkey_entry(struct bt_conn *conn);
+
+	ProfileSlot *find_slot(struct bt_conn *conn);
+	void bond_slot(ProfileSlot *slot);
+
+	static void static_on_advertising_work(struct k_work *work);
+	void on_advertising_work();
+	const bt_addr_le_t *advertising_peer();
+	static void static_on_conn_param_work(struct k_work *work);
+	void on_conn_param_work(ProfileSlot *slot);
+
+	static void static_on_key_events(void *arg);
+	static void static_on_report_work(struct k_work *work);
+	void on_report_work();
+	void apply_changes(const KeyBitmap &changed);
+	void record_activity();
+	bool queue_reports();
+	void process_passkey_events();
+	bool send_reports();
+	bool send_report(ProfileSlot *slot,
+	                 hids_input_report report,
+	                 const uint8_t *data,
+	                 uint16_t length);
+	static void static_on_report_sent(struct bt_conn *conn, void *user_data);
 
-	Keys<KeyMatrix> *keys;
+	KeyScanner *scanner;
 	Leds *leds;
 
+	/// Restarts advertising after a connection has been established or
+	/// closed and switches to the next advertising state after a timeout,
+	/// executed on the system workqueue. The connection object is only
+	/// released after the disconnect callback, so advertising cannot be
+	/// started directly from the callback.
+	struct k_work_delayable advertising_work;
+	/// Events for `advertising_work` (`ADVERTISING_EVENT_*` bits).
+	atomic_t advertising_events = ATOMIC_INIT(0);
+	/// True if advertising has timed out while a profile is not connected.
+	atomic_t advertising_stopped = ATOMIC_INIT(0);
+	/// Only accessed from the system workqueue.
+	BluetoothAdvertiser advertiser;
+	Reconnector<BluetoothAdvertiser> reconnector;
+	/// Sends the reports, executed on the keyboard workqueue. Delayable so
+	/// that a notification can be retried if the stack is out of buffers.
+	struct k_work_delayable report_work;
+
+	// The connection callbacks are called from the cooperative Bluetooth
+	// RX thread and the reports are sent from the cooperative keyboard
+	// workqueue, so the slots can be accessed without locking.
+	ProfileSlot slots[BLUETOOTH_PROFILE_COUNT];
+	/// Index of the profile which receives the input reports. Written by
+	/// the main thread.
+	atomic_t active_profile = ATOMIC_INIT(0);
+	/// Index of the profile plus one whose notification has not been passed
+	/// to the controller yet, or 0 if no notification is in flight.
+	atomic_t report_in_flight = ATOMIC_INIT(0);
+
+	/// Key state as seen by the host.
+	KeyBitmap key_bitmap;
+	/// 6KRO report, used both in boot and in report protocol.
+	SixKeySet six_keys;
+	/// Reports matching `key_bitmap`.
+	ReportState report_state;
+	/// Reports which are waiting for the host of the active profile.
+	ReportQueue report_queue;
+	/// State which did not fit into the full report queue. No further key
+	/// events are processed until it has been queued.
+	ReportState unqueued_report;
+	bool has_unqueued_report = false;
+
+	/// Connection which waits for the user to type the passkey, or NULL.
+	/// Written by the Bluetooth RX thread and the keyboard workqueue.
+	struct bt_conn *passkey_conn = NULL;
+	PasskeyInput passkey_input;
+
+	/// Time at which the keyboard was created, used to measure how long it
+	/// takes until the first key press reaches the host after a wakeup.
+	uint32_t start_time;
+	bool first_report_sent = false;
+
+	/// Battery level set by the main thread, or -1 if none has been set.
+	atomic_t battery_level = ATOMIC_INIT(-1);
+
 	// There can only be one instance of the BT keyboard, and the BT
 	// callbacks need a pointer to it.
 	static BluetoothKeyboard *instance;
+	/// True once the Bluetooth stack has been enabled.
+	static bool bt_initialized;
+	/// True once the Bluetooth stack is ready and the services can be used.
+	static atomic_t bt_ready;
 
-	struct bt_conn_cb conn_callbacks = {
-		.connected = static_on_connected,
-		.disconnected = static_on_disconnected,
-		.security_changed = static_on_security_changed,
-	};
+	/// Connection callbacks. The callbacks cannot be unregistered, so they
+	/// are registered once and ignore all events while no instance exists.
+	static struct bt_conn_cb conn_callbacks;
+	/// Pairing callbacks. Only passkey entry is supported, so the stack
+	/// uses the "keyboard only" IO capability.
+	static struct bt_conn_auth_cb auth_callbacks;
+	/// Callbacks for writes to the HID service by the host.
+	static const struct hids_callbacks service_callbacks;
 };
 
 #endif
-
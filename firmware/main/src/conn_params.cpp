@@ -0,0 +1,273 @@
+#include "conn_params.hpp"
+
+#include <sys/util.h>
+
+/// Time after which an unanswered request is considered as rejected.
+#define RESPONSE_TIMEOUT_MS 5000
+/// Backoff period after the first rejection, doubled with every further
+/// rejection.
+#define INITIAL_BACKOFF_MS 10000
+#define MAX_BACKOFF_MS 160000
+
+/// Minimum supervision timeout (4s), in units of 10ms.
+#define MIN_SUPERVISION_TIMEOUT 400
+/// Maximum supervision timeout allowed by the specification (32s).
+#define MAX_SUPERVISION_TIMEOUT 3200
+
+static bool time_reached(uint32_t now, uint32_t time) {
+	return (int32_t)(now - time) >= 0;
+}
+
+ConnectionParameterManager::ConnectionParameterManager(
+		const ConnectionParameters &active,
+		const ConnectionParameters &idle,
+		uint32_t idle_timeout_ms): idle_timeout_ms(idle_timeout_ms) {
+	params[CONNECTION_MODE_UNKNOWN] = ConnectionParameters();
+	params[CONNECTION_MODE_ACTIVE] = active;
+	params[CONNECTION_MODE_IDLE] = idle;
+	reset();
+}
+
+void ConnectionParameterManager::reset() {
+	mode = CONNECTION_MODE_UNKNOWN;
+	requested = CONNECTION_MODE_UNKNOWN;
+	// A different host might accept the parameters, so the backoff starts
+	// again.
+	for (size_t i = 0; i < CONNECTION_MODE_COUNT; i++) {
+		backing_off[i] = false;
+		backoff_ms[i] = INITIAL_BACKOFF_MS;
+	}
+}
+
+bool ConnectionParameterManager::update(uint32_t now,
+                                        uint32_t last_activity,
+                                        ConnectionParameters *params) {
+	if (requested != CONNECTION_MODE_UNKNOWN) {
+		if (!time_reached(now, response_deadline)) {
+			return false;
+		}
+		// The host did not answer.
+		reject(requested, now);
+	}
+
+	ConnectionMode wanted = wanted_mode(now, last_activity);
+	if (wanted == mode) {
+		return false;
+	}
+	if (backing_off[wanted]) {
+		if (!time_reached(now, retry_time[wanted])) {
+			return false;
+		}
+		backing_off[wanted] = false;
+	}
+	requested = wanted;
+	response_deadline = now + RESPONSE_TIMEOUT_MS;
+	*params = this->params[wanted];
+	return true;
+}
+
+int32_t ConnectionParameterManager::next_update(uint32_t now,
+                                                uint32_t last_activity) {
+	if (requested != CONNECTION_MODE_UNKNOWN) {
+		return MAX((int32_t)(response_deadline - now), 0);
+	}
+	ConnectionMode wanted = wanted_mode(now, last_activity);
+	if (wanted != mode) {
+		if (!backing_off[wanted]) {
+			return 0;
+		}
+		return MAX((int32_t)(retry_time[wanted] - now), 0);
+	}
+	if (wanted == CONNECTION_MODE_ACTIVE) {
+		// Switch to the idle parameters once the idle timeout has
+		// passed.
+		uint32_t idle_time = last_activity + idle_timeout_ms;
+		return MAX((int32_t)(idle_time - now), 0);
+	}
+	return -1;
+}
+
+void ConnectionParameterManager::on_params_updated(uint32_t now,
+                                                   uint16_t interval,
+                                                   uint16_t latency) {
+	ConnectionMode actual = CONNECTION_MODE_UNKNOWN;
+	if (matches(CONNECTION_MODE_ACTIVE, interval, latency)) {
+		actual = CONNECTION_MODE_ACTIVE;
+	} else if (matches(CONNECTION_MODE_IDLE, interval, latency)) {
+		actual = CONNECTION_MODE_IDLE;
+	}
+
+	if (requested != CONNECTION_MODE_UNKNOWN) {
+		if (actual == requested) {
+			backoff_ms[requested] = INITIAL_BACKOFF_MS;
+		} else {
+			// The host chose different parameters.
+			reject(requested, now);
+		}
+		requested = CONNECTION_MODE_UNKNOWN;
+	}
+	mode = actual;
+}
+
+void ConnectionParameterManager::on_request_failed(uint32_t now) {
+	if (requested != CONNECTION_MODE_UNKNOWN) {
+		reject(requested, now);
+		requested = CONNECTION_MODE_UNKNOWN;
+	}
+}
+
+uint16_t ConnectionParameterManager::supervision_timeout(uint16_t interval,
+                                                         uint16_t latency) {
+	// The timeout has to be longer than two effective intervals, we allow
+	// for three to tolerate some interference.
+	uint32_t effective_ms = (1 + (uint32_t)latency) * interval * 5 / 4;
+	uint32_t timeout = effective_ms * 3 / 10;
+	return MIN(MAX(timeout, MIN_SUPERVISION_TIMEOUT),
+	           MAX_SUPERVISION_TIMEOUT);
+}
+
+ConnectionMode ConnectionParameterManager::wanted_mode(uint32_t now,
+                                                       uint32_t last_activity) {
+	if (time_reached(now, last_activity + idle_timeout_ms)) {
+		return CONNECTION_MODE_IDLE;
+	} else {
+		return CONNECTION_MODE_ACTIVE;
+	}
+}
+
+void ConnectionParameterManager::reject(ConnectionMode rejected,
+                                        uint32_t now) {
+	backing_off[rejected] = true;
+	retry_time[rejected] = now + backoff_ms[rejected];
+	backoff_ms[rejected] = MIN(backoff_ms[rejected] * 2, MAX_BACKOFF_MS);
+	requested = CONNECTION_MODE_UNKNOWN;
+}
+
+bool ConnectionParameterManager::matches(ConnectionMode mode,
+                                         uint16_t interval,
+                                         uint16_t latency) {
+	return interval >= params[mode].interval_min &&
+	       interval <= params[mode].interval_max &&
+	       latency == params[mode].latency;
+}
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	static const ConnectionParameters test_active = {6, 6, 0, 400};
+	static const ConnectionParameters test_idle = {40, 40, 30, 465};
+	static const uint32_t test_idle_timeout = 5000;
+
+	static void conn_params_idle_test(void) {
+		ConnectionParameterManager manager(test_active,
+		                                   test_idle,
+		                                   test_idle_timeout);
+		ConnectionParameters params;
+
+		// A new connection requests the active parameters right away.
+		zassert_true(manager.update(0, 0, &params),
+		             "no request after connecting");
+		zassert_equal(params.interval_max, 6, "wrong parameters");
+		zassert_equal(params.latency, 0, "wrong parameters");
+		zassert_false(manager.update(10, 0, &params),
+		              "duplicate request");
+		manager.on_params_updated(20, 6, 0);
+		zassert_equal(manager.get_mode(), CONNECTION_MODE_ACTIVE,
+		              "request not accepted");
+
+		// Typing keeps the active parameters.
+		zassert_false(manager.update(4000, 3000, &params),
+		              "idle before the timeout");
+		zassert_equal(manager.next_update(4000, 3000), 4000,
+		              "wrong idle deadline");
+
+		// Idle parameters after the timeout.
+		zassert_true(manager.update(8000, 3000, &params),
+		             "no request after the idle timeout");
+		zassert_equal(params.interval_min, 40, "wrong parameters");
+		zassert_equal(params.latency, 30, "wrong parameters");
+		manager.on_params_updated(8100, 40, 30);
+		zassert_equal(manager.get_mode(), CONNECTION_MODE_IDLE,
+		              "request not accepted");
+		zassert_equal(manager.next_update(9000, 3000), -1,
+		              "update required while idle");
+
+		// A key press immediately switches back.
+		zassert_equal(manager.next_update(9000, 9000), 0,
+		              "activity ignored");
+		zassert_true(manager.update(9000, 9000, &params),
+		             "no request after activity");
+		zassert_equal(params.interval_min, 6, "wrong parameters");
+	}
+
+	static void conn_params_reject_test(void) {
+		ConnectionParameterManager manager(test_active,
+		                                   test_idle,
+		                                   test_idle_timeout);
+		ConnectionParameters params;
+
+		// The host chooses a different interval.
+		zassert_true(manager.update(0, 0, &params), "no request");
+		manager.on_params_updated(100, 12, 0);
+		zassert_equal(manager.get_mode(), CONNECTION_MODE_UNKNOWN,
+		              "wrong mode");
+		zassert_false(manager.update(200, 200, &params),
+		              "request repeated without backoff");
+		zassert_equal(manager.next_update(200, 200), 9900,
+		              "wrong backoff");
+		zassert_true(manager.update(10100, 10100, &params),
+		             "no request after the backoff");
+
+		// The host does not answer, the backoff is doubled.
+		zassert_false(manager.update(15000, 15000, &params),
+		              "request repeated before the response timeout");
+		zassert_false(manager.update(15100, 15100, &params),
+		              "request repeated without backoff");
+		zassert_equal(manager.next_update(15100, 15100), 20000,
+		              "backoff not doubled");
+
+		// The idle parameters are not affected by the backoff.
+		zassert_true(manager.update(20100, 15100, &params),
+		             "idle parameters not requested");
+		zassert_equal(params.interval_min, 40, "wrong parameters");
+
+		// Local errors count as rejection as well.
+		manager.on_request_failed(20100);
+		zassert_false(manager.update(20200, 15100, &params),
+		              "request repeated without backoff");
+
+		// A new connection resets the backoff.
+		manager.reset();
+		zassert_true(manager.update(20200, 20200, &params),
+		             "backoff not reset");
+	}
+
+	static void conn_params_timeout_test(void) {
+		// The supervision timeout has to be longer than two effective
+		// connection intervals.
+		uint16_t timeout =
+			ConnectionParameterManager::supervision_timeout(40, 30);
+		zassert_true(timeout * 10 > 31 * 40 * 5 / 4 * 2,
+		             "supervision timeout too short");
+		zassert_equal(ConnectionParameterManager::supervision_timeout(6,
+		                                                              0),
+		              400,
+		              "minimum supervision timeout not applied");
+		zassert_equal(ConnectionParameterManager::supervision_timeout(
+		                      3200, 499),
+		              3200,
+		              "maximum supervision timeout not applied");
+	}
+
+	static void conn_params_tests() {
+		ztest_test_suite(conn_params,
+			ztest_unit_test(conn_params_idle_test),
+			ztest_unit_test(conn_params_reject_test),
+			ztest_unit_test(conn_params_timeout_test)
+		);
+		ztest_run_test_suite(conn_params);
+	}
+	RegisterTests conn_params_tests_(conn_params_tests);
+}
+#endif
@@ -0,0 +1,106 @@
+#ifndef CONN_PARAMS_HPP_INCLUDED
+#define CONN_PARAMS_HPP_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Connection parameters in the units used by the Bluetooth specification.
+struct ConnectionParameters {
+	/// Minimum connection interval in units of 1.25ms.
+	uint16_t interval_min;
+	/// Maximum connection interval in units of 1.25ms.
+	uint16_t interval_max;
+	/// Number of connection events the peripheral may skip.
+	uint16_t latency;
+	/// Supervision timeout in units of 10ms.
+	uint16_t timeout;
+};
+
+enum ConnectionMode {
+	/// The parameters were chosen by the host.
+	CONNECTION_MODE_UNKNOWN,
+	/// Short interval without peripheral latency, used while typing.
+	CONNECTION_MODE_ACTIVE,
+	/// Long interval with high peripheral latency, used while idle.
+	CONNECTION_MODE_IDLE,
+	CONNECTION_MODE_COUNT
+};
+
+/// Decides which connection parameters to request from the host.
+///
+/// While keys are pressed, the keyboard requests a short connection interval to
+/// minimize the latency. Once no key has been pressed for the idle timeout, it
+/// requests a long interval and a high peripheral latency to save power.
+///
+/// The host can reject a request or choose different parameters, in which case
+/// the same parameters are only requested again after an exponential backoff
+/// period so that the keyboard does not waste power fighting the host. If the
+/// host does not answer at all, the request is treated as rejected.
+///
+/// The class only implements the policy, the caller has to send the requests
+/// and report the parameters chosen by the host. All times are in milliseconds
+/// as returned by `k_uptime_get_32()`. The class is not thread-safe.
+class ConnectionParameterManager {
+public:
+	ConnectionParameterManager(const ConnectionParameters &active,
+	                           const ConnectionParameters &idle,
+	                           uint32_t idle_timeout_ms);
+
+	/// Resets the state for a new connection, whose parameters are unknown.
+	void reset();
+
+	/// Checks whether new parameters have to be requested.
+	///
+	/// @param now Current time.
+	/// @param last_activity Time of the last key press or release.
+	/// @param params Receives the parameters to request.
+	/// @return True if the parameters in `params` shall be requested.
+	bool update(uint32_t now,
+	            uint32_t last_activity,
+	            ConnectionParameters *params);
+
+	/// Returns the time until `update()` has to be called again, or -1 if
+	/// it only has to be called after the next key activity.
+	int32_t next_update(uint32_t now, uint32_t last_activity);
+
+	/// Notifies the manager that the connection parameters have changed.
+	///
+	/// @param interval Connection interval in units of 1.25ms.
+	/// @param latency Peripheral latency.
+	void on_params_updated(uint32_t now, uint16_t interval, uint16_t latency);
+
+	/// Notifies the manager that the last request could not be sent.
+	void on_request_failed(uint32_t now);
+
+	/// Returns the mode matching the current connection parameters.
+	ConnectionMode get_mode() {
+		return mode;
+	}
+
+	/// Calculates a supervision timeout (in units of 10ms) which allows
+	/// the peripheral to use the full latency.
+	static uint16_t supervision_timeout(uint16_t interval, uint16_t latency);
+private:
+	ConnectionMode wanted_mode(uint32_t now, uint32_t last_activity);
+	void reject(ConnectionMode rejected, uint32_t now);
+	bool matches(ConnectionMode mode, uint16_t interval, uint16_t latency);
+
+	ConnectionParameters params[CONNECTION_MODE_COUNT];
+	uint32_t idle_timeout_ms;
+
+	/// Mode of the current parameters.
+	ConnectionMode mode = CONNECTION_MODE_UNKNOWN;
+	/// Mode which has been requested, or `CONNECTION_MODE_UNKNOWN` if no
+	/// request is pending.
+	ConnectionMode requested = CONNECTION_MODE_UNKNOWN;
+	/// Time at which a pending request is considered as rejected.
+	uint32_t response_deadline = 0;
+	/// True if a mode has been rejected and must not be requested before
+	/// `retry_time`.
+	bool backing_off[CONNECTION_MODE_COUNT] = {false};
+	uint32_t retry_time[CONNECTION_MODE_COUNT] = {0};
+	/// Current backoff period for each mode.
+	uint32_t backoff_ms[CONNECTION_MODE_COUNT] = {0};
+};
+
+#endif
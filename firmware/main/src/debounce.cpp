@@ -0,0 +1,152 @@
+
+#include "debounce.hpp"
+
+#include <sys/util.h>
+
+#define SYMMETRIC_DEBOUNCE_MS 5
+
+// The lock time has to fit into the 3-bit counters.
+static_assert(SYMMETRIC_DEBOUNCE_MS <= 7, "debounce window too long");
+
+void SymmetricDebouncer::update(const uint32_t raw[KEY_WORDS],
+                                uint32_t debounced[KEY_WORDS],
+                                uint32_t changed[KEY_WORDS],
+                                int interval_ms) {
+	// The counters saturate at 0, so any interval longer than the maximum
+	// counter value has the same effect.
+	unsigned int elapsed = MIN(MAX(interval_ms, 0), 7);
+	uint32_t elapsed0 = (elapsed & 0x1) ? 0xffffffff : 0;
+	uint32_t elapsed1 = (elapsed & 0x2) ? 0xffffffff : 0;
+	uint32_t elapsed2 = (elapsed & 0x4) ? 0xffffffff : 0;
+	uint32_t reset0 = (SYMMETRIC_DEBOUNCE_MS & 0x1) ? 0xffffffff : 0;
+	uint32_t reset1 = (SYMMETRIC_DEBOUNCE_MS & 0x2) ? 0xffffffff : 0;
+	uint32_t reset2 = (SYMMETRIC_DEBOUNCE_MS & 0x4) ? 0xffffffff : 0;
+
+	for (uint8_t i = 0; i < KEY_WORDS; i++) {
+		// Subtract the elapsed time from all counters of this word
+		// with a ripple-borrow subtractor.
+		uint32_t c0 = count[0][i];
+		uint32_t c1 = count[1][i];
+		uint32_t c2 = count[2][i];
+		uint32_t borrow = ~c0 & elapsed0;
+		c0 ^= elapsed0;
+		uint32_t borrow1 = (~c1 & (elapsed1 | borrow)) |
+		                   (elapsed1 & borrow);
+		c1 ^= elapsed1 ^ borrow;
+		uint32_t borrow2 = (~c2 & (elapsed2 | borrow1)) |
+		                   (elapsed2 & borrow1);
+		c2 ^= elapsed2 ^ borrow1;
+		// Counters which would become negative saturate at 0.
+		c0 &= ~borrow2;
+		c1 &= ~borrow2;
+		c2 &= ~borrow2;
+
+		// Keys which have changed within the debouncing window keep
+		// their state, all other keys take the raw state.
+		uint32_t locked = c0 | c1 | c2;
+		uint32_t old = debounced[i];
+		debounced[i] = (locked & old) | (~locked & raw[i]);
+		changed[i] = debounced[i] ^ old;
+
+		// Restart the window for all changed keys.
+		count[0][i] = (c0 & ~changed[i]) | (reset0 & changed[i]);
+		count[1][i] = (c1 & ~changed[i]) | (reset1 & changed[i]);
+		count[2][i] = (c2 & ~changed[i]) | (reset2 & changed[i]);
+	}
+}
+
+bool SymmetricDebouncer::is_idle() {
+	uint32_t active = 0;
+	for (uint8_t i = 0; i < KEY_WORDS; i++) {
+		active |= count[0][i] | count[1][i] | count[2][i];
+	}
+	return active == 0;
+}
+
+EagerDebouncer::EagerDebouncer() {
+	set_timing(CONFIG_GOBOARD_DEBOUNCE_PRESS_MS,
+	           CONFIG_GOBOARD_DEBOUNCE_RELEASE_MS);
+}
+
+void EagerDebouncer::update(const uint32_t raw[KEY_WORDS],
+                            uint32_t debounced[KEY_WORDS],
+                            uint32_t changed[KEY_WORDS],
+                            int interval_ms) {
+	unsigned int elapsed = MIN(MAX(interval_ms, 0), 255);
+
+	for (uint8_t i = 0; i < KEY_WORDS; i++) {
+		uint32_t old = debounced[i];
+		uint32_t state = old;
+		// Only keys which have changed or which have a running timer
+		// need to be looked at.
+		uint32_t candidates = active[i] | (raw[i] ^ old);
+		while (candidates != 0) {
+			unsigned int bit = __builtin_ctz(candidates);
+			candidates &= candidates - 1;
+			uint32_t mask = 1u << bit;
+			uint8_t *remaining = &remaining_ms[i * 32 + bit];
+			bool pressed = (raw[i] & mask) != 0;
+
+			if ((active[i] & mask) != 0) {
+				*remaining = *remaining > elapsed ?
+				             *remaining - elapsed : 0;
+			}
+
+			if ((releasing[i] & mask) != 0) {
+				if (pressed) {
+					// The key was pressed again before the
+					// release was reported.
+					releasing[i] &= ~mask;
+					active[i] &= ~mask;
+					*remaining = 0;
+				} else if (*remaining == 0) {
+					state &= ~mask;
+					releasing[i] &= ~mask;
+					active[i] &= ~mask;
+				}
+				continue;
+			}
+
+			if ((active[i] & mask) != 0) {
+				if (*remaining != 0) {
+					// The key was pressed recently, ignore
+					// any chatter.
+					continue;
+				}
+				active[i] &= ~mask;
+			}
+
+			if (pressed && (state & mask) == 0) {
+				state |= mask;
+				if (press_ms != 0) {
+					active[i] |= mask;
+					*remaining = press_ms;
+				}
+			} else if (!pressed && (state & mask) != 0) {
+				if (release_ms == 0) {
+					state &= ~mask;
+				} else {
+					releasing[i] |= mask;
+					active[i] |= mask;
+					*remaining = release_ms;
+				}
+			}
+		}
+		changed[i] = state ^ old;
+		debounced[i] = state;
+	}
+}
+
+bool EagerDebouncer::is_idle() {
+	uint32_t any_active = 0;
+	for (uint8_t i = 0; i < KEY_WORDS; i++) {
+		any_active |= active[i];
+	}
+	return any_active == 0;
+}
+
+void EagerDebouncer::set_timing(int press_ms, int release_ms) {
+	this->press_ms = MIN(MAX(press_ms, 0), 255);
+	this->release_ms = MIN(MAX(release_ms, 0), 255);
+}
+
@@ -0,0 +1,85 @@
+#ifndef DEBOUNCE_HPP_INCLUDED
+#define DEBOUNCE_HPP_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Number of 32-bit words required to store the state of all keys.
+#define KEY_WORDS 8
+
+/// Symmetric debouncing with a fixed 5ms window.
+///
+/// Any change of a key is reported immediately, but all further changes of
+/// the same key are ignored for the following 5ms. Presses and releases are
+/// treated identically.
+///
+/// The remaining lock time of every key is stored in a bit-sliced 3-bit
+/// counter, i.e., bit n of the counters of 32 keys is stored in one word of
+/// `count[n]`. All counters are therefore advanced with a few word-wide logic
+/// operations, independent of the time since the last call.
+class SymmetricDebouncer {
+public:
+	SymmetricDebouncer() {}
+
+	/// Applies debouncing to the raw key state.
+	///
+	/// @param raw Raw key state as read from the key matrix.
+	/// @param debounced Debounced key state, updated by the function.
+	/// @param changed Receives the keys whose debounced state has changed.
+	/// @param interval_ms Milliseconds since the last call to `update()`.
+	void update(const uint32_t raw[KEY_WORDS],
+	            uint32_t debounced[KEY_WORDS],
+	            uint32_t changed[KEY_WORDS],
+	            int interval_ms);
+
+	/// Returns true if no change is currently being debounced.
+	bool is_idle();
+private:
+	/// Bit planes of the per-key counters containing the remaining time in
+	/// milliseconds during which changes are ignored.
+	uint32_t count[3][KEY_WORDS] = {{0}};
+};
+
+/// Asymmetric "eager press, deferred release" debouncing.
+///
+/// A key press is reported on the first sample, after which the key is locked
+/// for `press_ms` to suppress chatter. A release is only reported once the key
+/// has been released for `release_ms`. Compared to `SymmetricDebouncer`, this
+/// removes any debouncing latency from key presses. `release_ms` should be at
+/// least the bounce time of the switches, as otherwise chatter during the
+/// release can be reported as a new key press.
+class EagerDebouncer {
+public:
+	EagerDebouncer();
+
+	/// Applies debouncing to the raw key state.
+	///
+	/// See `SymmetricDebouncer::update()`.
+	void update(const uint32_t raw[KEY_WORDS],
+	            uint32_t debounced[KEY_WORDS],
+	            uint32_t changed[KEY_WORDS],
+	            int interval_ms);
+
+	/// Returns true if no change is currently being debounced.
+	bool is_idle();
+
+	/// Changes the debouncing windows.
+	///
+	/// Both values are clamped to 0...255ms. Keys which are currently
+	/// being debounced keep their current timing.
+	void set_timing(int press_ms, int release_ms);
+private:
+	uint8_t press_ms;
+	uint8_t release_ms;
+
+	/// Keys which currently have a running timer.
+	uint32_t active[KEY_WORDS] = {0};
+	/// Keys for which the timer measures the release time. For all other
+	/// active keys, the timer measures the lock time after a press.
+	uint32_t releasing[KEY_WORDS] = {0};
+	/// Remaining time of the timer of each key.
+	uint8_t remaining_ms[KEY_WORDS * 32] = {0};
+};
+
+#endif
+
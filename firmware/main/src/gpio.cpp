@@ -0,0 +1,18 @@
+#include "gpio.hpp"
+
+#include "exception.hpp"
+
+const struct device *init_output_gpio(const char *label,
+                                      gpio_pin_t pin,
+                                      gpio_flags_t flags) {
+	const struct device *gpio = device_get_binding(label);
+	if (gpio == NULL) {
+		throw InitializationFailed("GPIO not found");
+	}
+	if (gpio_pin_configure(gpio, pin,
+	                       GPIO_OUTPUT_INACTIVE | flags) != 0) {
+		throw InitializationFailed("gpio_pin_configure failed");
+	}
+
+	return gpio;
+}
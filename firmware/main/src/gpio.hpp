@@ -0,0 +1,14 @@
+#ifndef GPIO_HPP_INCLUDED
+#define GPIO_HPP_INCLUDED
+
+#include <drivers/gpio.h>
+
+/// Configures a pin as an inactive output and returns its GPIO device.
+///
+/// Throws `InitializationFailed` if the device does not exist or if the pin
+/// cannot be configured.
+const struct device *init_output_gpio(const char *label,
+                                      gpio_pin_t pin,
+                                      gpio_flags_t flags);
+
+#endif
@@ -0,0 +1,406 @@
+#include "hids.h"
+
+#include <bluetooth/uuid.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/byteorder.h>
+#include <sys/util.h>
+
+// The Bluetooth HID service is defined in C as the GATT macros rely on compound
+// literals which are not valid C++.
+
+#define REPORT_ID_KEYBOARD 1
+#define REPORT_ID_CONSUMER 2
+
+#define REPORT_TYPE_INPUT 1
+#define REPORT_TYPE_OUTPUT 2
+
+#define HID_INFO_REMOTE_WAKE 0x01
+#define HID_INFO_NORMALLY_CONNECTABLE 0x02
+
+#define CONTROL_POINT_SUSPEND 0x00
+#define CONTROL_POINT_EXIT_SUSPEND 0x01
+
+// Not all HIDS UUIDs are defined by Zephyr.
+#define UUID_BOOT_KEYBOARD_INPUT BT_UUID_DECLARE_16(0x2a22)
+#define UUID_BOOT_KEYBOARD_OUTPUT BT_UUID_DECLARE_16(0x2a32)
+#define UUID_PROTOCOL_MODE BT_UUID_DECLARE_16(0x2a4e)
+
+// Unlike the USB keyboard, the Bluetooth keyboard uses 6KRO reports in report
+// protocol as well, so that every report fits into a single packet with the
+// default ATT MTU. The keyboard report has the same layout as the boot protocol
+// report, so the host does not have to parse different reports.
+static const uint8_t report_map[] = {
+	0x05, 0x01, // Usage Page (Generic Desktop)
+	0x09, 0x06, // Usage (Keyboard)
+	0xa1, 0x01, // Collection (Application)
+		0x85, REPORT_ID_KEYBOARD, // Report ID
+		0x05, 0x07, // Usage Page (Keyboard/Keypad)
+		0x19, 0xe0, // Usage Minimum (Left Control)
+		0x29, 0xe7, // Usage Maximum (Right GUI)
+		0x15, 0x00, // Logical Minimum (0)
+		0x25, 0x01, // Logical Maximum (1)
+		0x75, 0x01, // Report Size (1)
+		0x95, 0x08, // Report Count (8)
+		0x81, 0x02, // Input (Data, Variable, Absolute)
+		0x75, 0x08, // Report Size (8)
+		0x95, 0x01, // Report Count (1)
+		0x81, 0x01, // Input (Constant) - reserved byte
+		0x19, 0x00, // Usage Minimum (0)
+		0x29, 0xff, // Usage Maximum (255)
+		0x15, 0x00, // Logical Minimum (0)
+		0x26, 0xff, 0x00, // Logical Maximum (255)
+		0x75, 0x08, // Report Size (8)
+		0x95, 0x06, // Report Count (6)
+		0x81, 0x00, // Input (Data, Array, Absolute)
+		0x05, 0x08, // Usage Page (LEDs)
+		0x19, 0x01, // Usage Minimum (Num Lock)
+		0x29, 0x05, // Usage Maximum (Kana)
+		0x75, 0x01, // Report Size (1)
+		0x95, 0x05, // Report Count (5)
+		0x91, 0x02, // Output (Data, Variable, Absolute)
+		0x75, 0x03, // Report Size (3)
+		0x95, 0x01, // Report Count (1)
+		0x91, 0x01, // Output (Constant) - padding
+	0xc0, // End Collection
+
+	0x05, 0x0c, // Usage Page (Consumer)
+	0x09, 0x01, // Usage (Consumer Control)
+	0xa1, 0x01, // Collection (Application)
+		0x85, REPORT_ID_CONSUMER, // Report ID
+		0x15, 0x00, // Logical Minimum (0)
+		0x25, 0x01, // Logical Maximum (1)
+		0x75, 0x01, // Report Size (1)
+		0x95, 0x03, // Report Count (3)
+		// The order has to match ConsumerKey.
+		0x09, 0xe2, // Usage (Mute)
+		0x09, 0xe9, // Usage (Volume Increment)
+		0x09, 0xea, // Usage (Volume Decrement)
+		0x81, 0x02, // Input (Data, Variable, Absolute)
+		0x75, 0x05, // Report Size (5)
+		0x95, 0x01, // Report Count (1)
+		0x81, 0x01, // Input (Constant) - padding
+	0xc0, // End Collection
+};
+
+struct hid_info {
+	uint16_t bcd_hid;
+	uint8_t country_code;
+	uint8_t flags;
+} __packed;
+
+static const struct hid_info hid_info = {
+	.bcd_hid = sys_cpu_to_le16(0x0111),
+	.country_code = 0,
+	.flags = HID_INFO_REMOTE_WAKE | HID_INFO_NORMALLY_CONNECTABLE,
+};
+
+struct report_reference {
+	uint8_t id;
+	uint8_t type;
+};
+
+static const struct report_reference keyboard_input_ref = {
+	.id = REPORT_ID_KEYBOARD,
+	.type = REPORT_TYPE_INPUT,
+};
+static const struct report_reference consumer_input_ref = {
+	.id = REPORT_ID_CONSUMER,
+	.type = REPORT_TYPE_INPUT,
+};
+static const struct report_reference keyboard_output_ref = {
+	.id = REPORT_ID_KEYBOARD,
+	.type = REPORT_TYPE_OUTPUT,
+};
+
+/// State of the service for a single connection.
+struct hids_connection {
+	uint8_t protocol_mode;
+	// Last input reports, returned when the host reads the
+	// characteristics.
+	uint8_t keyboard_report[HIDS_KEYBOARD_REPORT_SIZE];
+	uint8_t consumer_report;
+	uint8_t led_report;
+};
+
+static const struct hids_callbacks *callbacks;
+static struct hids_connection connections[CONFIG_BT_MAX_CONN];
+
+static struct hids_connection *get_connection(struct bt_conn *conn) {
+	return &connections[bt_conn_index(conn)];
+}
+
+static ssize_t read_report_reference(struct bt_conn *conn,
+                                     const struct bt_gatt_attr *attr,
+                                     void *buf,
+                                     uint16_t len,
+                                     uint16_t offset) {
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, attr->user_data,
+	                         sizeof(struct report_reference));
+}
+
+static ssize_t read_info(struct bt_conn *conn,
+                         const struct bt_gatt_attr *attr,
+                         void *buf,
+                         uint16_t len,
+                         uint16_t offset) {
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, &hid_info,
+	                         sizeof(hid_info));
+}
+
+static ssize_t read_report_map(struct bt_conn *conn,
+                               const struct bt_gatt_attr *attr,
+                               void *buf,
+                               uint16_t len,
+                               uint16_t offset) {
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, report_map,
+	                         sizeof(report_map));
+}
+
+static ssize_t read_keyboard_report(struct bt_conn *conn,
+                                    const struct bt_gatt_attr *attr,
+                                    void *buf,
+                                    uint16_t len,
+                                    uint16_t offset) {
+	struct hids_connection *state = get_connection(conn);
+	return bt_gatt_attr_read(conn, attr, buf, len, offset,
+	                         state->keyboard_report,
+	                         sizeof(state->keyboard_report));
+}
+
+static ssize_t read_consumer_report(struct bt_conn *conn,
+                                    const struct bt_gatt_attr *attr,
+                                    void *buf,
+                                    uint16_t len,
+                                    uint16_t offset) {
+	struct hids_connection *state = get_connection(conn);
+	return bt_gatt_attr_read(conn, attr, buf, len, offset,
+	                         &state->consumer_report,
+	                         sizeof(state->consumer_report));
+}
+
+static ssize_t read_led_report(struct bt_conn *conn,
+                               const struct bt_gatt_attr *attr,
+                               void *buf,
+                               uint16_t len,
+                               uint16_t offset) {
+	struct hids_connection *state = get_connection(conn);
+	return bt_gatt_attr_read(conn, attr, buf, len, offset,
+	                         &state->led_report,
+	                         sizeof(state->led_report));
+}
+
+static ssize_t write_led_report(struct bt_conn *conn,
+                                const struct bt_gatt_attr *attr,
+                                const void *buf,
+                                uint16_t len,
+                                uint16_t offset,
+                                uint8_t flags) {
+	ARG_UNUSED(attr);
+	ARG_UNUSED(flags);
+
+	struct hids_connection *state = get_connection(conn);
+	if (offset != 0 || len != sizeof(state->led_report)) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+	state->led_report = *(const uint8_t *)buf;
+	if (callbacks != NULL && callbacks->output_report != NULL) {
+		callbacks->output_report(conn, state->led_report);
+	}
+	return len;
+}
+
+static ssize_t read_protocol_mode(struct bt_conn *conn,
+                                  const struct bt_gatt_attr *attr,
+                                  void *buf,
+                                  uint16_t len,
+                                  uint16_t offset) {
+	struct hids_connection *state = get_connection(conn);
+	return bt_gatt_attr_read(conn, attr, buf, len, offset,
+	                         &state->protocol_mode,
+	                         sizeof(state->protocol_mode));
+}
+
+static ssize_t write_protocol_mode(struct bt_conn *conn,
+                                   const struct bt_gatt_attr *attr,
+                                   const void *buf,
+                                   uint16_t len,
+                                   uint16_t offset,
+                                   uint8_t flags) {
+	ARG_UNUSED(attr);
+	ARG_UNUSED(flags);
+
+	struct hids_connection *state = get_connection(conn);
+	if (offset != 0 || len != sizeof(state->protocol_mode)) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+	uint8_t mode = *(const uint8_t *)buf;
+	if (mode != HIDS_PROTOCOL_BOOT && mode != HIDS_PROTOCOL_REPORT) {
+		return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+	}
+	if (mode != state->protocol_mode) {
+		state->protocol_mode = mode;
+		if (callbacks != NULL && callbacks->protocol_mode != NULL) {
+			callbacks->protocol_mode(conn, mode);
+		}
+	}
+	return len;
+}
+
+static ssize_t write_control_point(struct bt_conn *conn,
+                                   const struct bt_gatt_attr *attr,
+                                   const void *buf,
+                                   uint16_t len,
+                                   uint16_t offset,
+                                   uint8_t flags) {
+	ARG_UNUSED(conn);
+	ARG_UNUSED(attr);
+	ARG_UNUSED(buf);
+	ARG_UNUSED(flags);
+
+	// The keyboard does not do anything different while the host is
+	// suspended, as it only sends reports when keys are pressed anyway.
+	if (offset != 0 || len != 1) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+	return len;
+}
+
+// Both the input reports and the boot input report are only sent via
+// notifications, the host can read them but usually does not.
+#define PERM_READ BT_GATT_PERM_READ_ENCRYPT
+#define PERM_READ_WRITE (BT_GATT_PERM_READ_ENCRYPT | BT_GATT_PERM_WRITE_ENCRYPT)
+#define PERM_CCC (BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT)
+
+BT_GATT_SERVICE_DEFINE(hids_svc,
+	BT_GATT_PRIMARY_SERVICE(BT_UUID_HIDS),
+	BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_INFO,
+	                       BT_GATT_CHRC_READ,
+	                       PERM_READ,
+	                       read_info, NULL, NULL),
+	BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_REPORT_MAP,
+	                       BT_GATT_CHRC_READ,
+	                       PERM_READ,
+	                       read_report_map, NULL, NULL),
+	// Keyboard input report.
+	BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_REPORT,
+	                       BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+	                       PERM_READ,
+	                       read_keyboard_report, NULL, NULL),
+	BT_GATT_CCC(NULL, PERM_CCC),
+	BT_GATT_DESCRIPTOR(BT_UUID_HIDS_REPORT_REF,
+	                   PERM_READ,
+	                   read_report_reference, NULL, (void *)&keyboard_input_ref),
+	// Consumer control input report.
+	BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_REPORT,
+	                       BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+	                       PERM_READ,
+	                       read_consumer_report, NULL, NULL),
+	BT_GATT_CCC(NULL, PERM_CCC),
+	BT_GATT_DESCRIPTOR(BT_UUID_HIDS_REPORT_REF,
+	                   PERM_READ,
+	                   read_report_reference, NULL, (void *)&consumer_input_ref),
+	// LED output report.
+	BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_REPORT,
+	                       BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE |
+	                       BT_GATT_CHRC_WRITE_WITHOUT_RESP,
+	                       PERM_READ_WRITE,
+	                       read_led_report, write_led_report, NULL),
+	BT_GATT_DESCRIPTOR(BT_UUID_HIDS_REPORT_REF,
+	                   PERM_READ,
+	                   read_report_reference, NULL, (void *)&keyboard_output_ref),
+	BT_GATT_CHARACTERISTIC(UUID_PROTOCOL_MODE,
+	                       BT_GATT_CHRC_READ |
+	                       BT_GATT_CHRC_WRITE_WITHOUT_RESP,
+	                       PERM_READ_WRITE,
+	                       read_protocol_mode, write_protocol_mode, NULL),
+	BT_GATT_CHARACTERISTIC(UUID_BOOT_KEYBOARD_INPUT,
+	                       BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+	                       PERM_READ,
+	                       read_keyboard_report, NULL, NULL),
+	BT_GATT_CCC(NULL, PERM_CCC),
+	BT_GATT_CHARACTERISTIC(UUID_BOOT_KEYBOARD_OUTPUT,
+	                       BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE |
+	                       BT_GATT_CHRC_WRITE_WITHOUT_RESP,
+	                       PERM_READ_WRITE,
+	                       read_led_report, write_led_report, NULL),
+	BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_CTRL_POINT,
+	                       BT_GATT_CHRC_WRITE_WITHOUT_RESP,
+	                       BT_GATT_PERM_WRITE_ENCRYPT,
+	                       NULL, write_control_point, NULL),
+);
+
+// Indices of the value attributes of the input reports in hids_svc.
+#define ATTR_KEYBOARD_INPUT 6
+#define ATTR_CONSUMER_INPUT 10
+#define ATTR_BOOT_KEYBOARD_INPUT 19
+
+void hids_set_callbacks(const struct hids_callbacks *new_callbacks) {
+	callbacks = new_callbacks;
+}
+
+void hids_reset_connection(struct bt_conn *conn) {
+	struct hids_connection *state = get_connection(conn);
+	memset(state, 0, sizeof(*state));
+	state->protocol_mode = HIDS_PROTOCOL_REPORT;
+}
+
+uint8_t hids_get_protocol_mode(struct bt_conn *conn) {
+	return get_connection(conn)->protocol_mode;
+}
+
+static const struct bt_gatt_attr *input_attr(struct bt_conn *conn,
+                                             enum hids_input_report report) {
+	uint8_t protocol_mode = get_connection(conn)->protocol_mode;
+	if (report == HIDS_INPUT_CONSUMER) {
+		if (protocol_mode == HIDS_PROTOCOL_BOOT) {
+			return NULL;
+		}
+		return &hids_svc.attrs[ATTR_CONSUMER_INPUT];
+	}
+	if (protocol_mode == HIDS_PROTOCOL_BOOT) {
+		return &hids_svc.attrs[ATTR_BOOT_KEYBOARD_INPUT];
+	}
+	return &hids_svc.attrs[ATTR_KEYBOARD_INPUT];
+}
+
+bool hids_is_subscribed(struct bt_conn *conn, enum hids_input_report report) {
+	const struct bt_gatt_attr *attr = input_attr(conn, report);
+	if (attr == NULL) {
+		return false;
+	}
+	return bt_gatt_is_subscribed(conn, attr, BT_GATT_CCC_NOTIFY);
+}
+
+int hids_notify(struct bt_conn *conn,
+                enum hids_input_report report,
+                const uint8_t *data,
+                uint16_t len,
+                bt_gatt_complete_func_t sent,
+                void *user_data) {
+	const struct bt_gatt_attr *attr = input_attr(conn, report);
+	if (attr == NULL) {
+		return -EINVAL;
+	}
+	struct hids_connection *state = get_connection(conn);
+	if (report == HIDS_INPUT_CONSUMER) {
+		if (len != sizeof(state->consumer_report)) {
+			return -EINVAL;
+		}
+		state->consumer_report = data[0];
+	} else {
+		if (len != sizeof(state->keyboard_report)) {
+			return -EINVAL;
+		}
+		memcpy(state->keyboard_report, data, len);
+	}
+
+	struct bt_gatt_notify_params params = {
+		.attr = attr,
+		.data = data,
+		.len = len,
+		.func = sent,
+		.user_data = user_data,
+	};
+	return bt_gatt_notify_cb(conn, &params);
+}
@@ -0,0 +1,77 @@
+#ifndef HIDS_H_INCLUDED
+#define HIDS_H_INCLUDED
+
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Size of the keyboard input report - a modifier byte, a reserved byte and
+/// six scan codes. The report is identical in boot and in report protocol.
+#define HIDS_KEYBOARD_REPORT_SIZE 8
+
+enum hids_protocol_mode {
+	HIDS_PROTOCOL_BOOT = 0,
+	HIDS_PROTOCOL_REPORT = 1,
+};
+
+/// Input reports of the HID service.
+enum hids_input_report {
+	HIDS_INPUT_KEYBOARD,
+	HIDS_INPUT_CONSUMER,
+};
+
+/// Callbacks for writes by the host. The callbacks are called from the
+/// Bluetooth RX thread.
+struct hids_callbacks {
+	/// The host has written the LED output report.
+	void (*output_report)(struct bt_conn *conn, uint8_t leds);
+	/// The host has switched between boot and report protocol.
+	void (*protocol_mode)(struct bt_conn *conn, uint8_t mode);
+};
+
+/// Sets the callbacks for writes by the host.
+///
+/// The GATT service is defined statically and exists as long as Bluetooth is
+/// enabled. If no callbacks are set, writes are accepted but ignored.
+void hids_set_callbacks(const struct hids_callbacks *callbacks);
+
+/// Resets the state of a connection, e.g., the protocol mode to report
+/// protocol, which is required whenever a new host connects.
+///
+/// The protocol mode and the report values are stored for each connection, so
+/// that multiple hosts can be connected at the same time.
+void hids_reset_connection(struct bt_conn *conn);
+
+/// Returns the current protocol mode of a connection as a
+/// `hids_protocol_mode` value.
+uint8_t hids_get_protocol_mode(struct bt_conn *conn);
+
+/// Returns true if the host has enabled notifications for the characteristic
+/// which carries the report in the current protocol mode.
+bool hids_is_subscribed(struct bt_conn *conn, enum hids_input_report report);
+
+/// Sends an input report as a notification.
+///
+/// Only the characteristic for the current protocol mode of the connection is
+/// notified. The consumer report does not exist in boot protocol.
+///
+/// @param sent Called once the notification has been sent.
+/// @return 0 on success, a negative error code otherwise.
+int hids_notify(struct bt_conn *conn,
+                enum hids_input_report report,
+                const uint8_t *data,
+                uint16_t len,
+                bt_gatt_complete_func_t sent,
+                void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,235 @@
+#include "key_events.hpp"
+
+static_assert((KEY_EVENT_QUEUE_SIZE & (KEY_EVENT_QUEUE_SIZE - 1)) == 0,
+              "the key event queue size must be a power of two");
+
+bool KeyEventQueue::publish(const KeyBitmap &state, uint32_t time) {
+	bool added = false;
+	unpublished = false;
+	for (size_t i = 0; i < ARRAY_SIZE(state.keys); i++) {
+		uint32_t changed = state.keys[i] ^ published.keys[i];
+		while (changed != 0) {
+			unsigned int bit = __builtin_ctz(changed);
+			uint32_t mask = 1u << bit;
+			KeyEvent event;
+			event.time = time;
+			event.key = i * 32 + bit;
+			event.pressed = (state.keys[i] & mask) != 0;
+			if (!push(event)) {
+				// The remaining changes are published once the
+				// consumer has made room.
+				unpublished = true;
+				overflows++;
+				return added;
+			}
+			published.keys[i] ^= mask;
+			changed &= changed - 1;
+			added = true;
+		}
+	}
+	return added;
+}
+
+bool KeyEventQueue::peek(KeyEvent *event) {
+	uint32_t read = (uint32_t)atomic_get(&tail);
+	if (read == (uint32_t)atomic_get(&head)) {
+		return false;
+	}
+	*event = events[read & (KEY_EVENT_QUEUE_SIZE - 1)];
+	return true;
+}
+
+void KeyEventQueue::pop() {
+	uint32_t read = (uint32_t)atomic_get(&tail);
+	if (read == (uint32_t)atomic_get(&head)) {
+		return;
+	}
+	// The producer may overwrite the entry once the index is incremented.
+	atomic_set(&tail, (atomic_val_t)(read + 1));
+}
+
+bool KeyEventQueue::drain(KeyBitmap *state,
+                          KeyBitmap *changed,
+                          uint32_t *time) {
+	*changed = KeyBitmap();
+	bool any_changed = false;
+	KeyEvent event;
+	while (peek(&event)) {
+		if (changed->bit_is_set(event.key)) {
+			break;
+		}
+		pop();
+		if (!any_changed && time != NULL) {
+			*time = event.time;
+		}
+		if (event.pressed) {
+			state->set_bit(event.key);
+		} else {
+			state->clear_bit(event.key);
+		}
+		changed->set_bit(event.key);
+		any_changed = true;
+	}
+	return any_changed;
+}
+
+bool KeyEventQueue::push(const KeyEvent &event) {
+	uint32_t write = (uint32_t)atomic_get(&head);
+	if (write - (uint32_t)atomic_get(&tail) == KEY_EVENT_QUEUE_SIZE) {
+		return false;
+	}
+	events[write & (KEY_EVENT_QUEUE_SIZE - 1)] = event;
+	// The atomic store orders the entry before the index, the consumer
+	// does not see the entry before it has been completely written.
+	atomic_set(&head, (atomic_val_t)(write + 1));
+	return true;
+}
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	static void key_event_order_test(void) {
+		KeyEventQueue queue;
+		KeyEvent event = {0, 0, false};
+		zassert_false(queue.peek(&event), "empty queue returned event");
+
+		KeyBitmap state;
+		state.set_bit(KEY_A);
+		state.set_bit(KEY_LSHIFT);
+		zassert_true(queue.publish(state, 10), "press not published");
+		zassert_false(queue.publish(state, 11),
+		              "unchanged state published");
+		state.clear_bit(KEY_A);
+		zassert_true(queue.publish(state, 12), "release not published");
+
+		static const KeyEvent expected[] = {
+			{10, KEY_A, true},
+			{10, KEY_LSHIFT, true},
+			{12, KEY_A, false},
+		};
+		for (size_t i = 0; i < ARRAY_SIZE(expected); i++) {
+			zassert_true(queue.peek(&event), "missing event");
+			zassert_equal(event.time, expected[i].time, "wrong time");
+			zassert_equal(event.key, expected[i].key, "wrong key");
+			zassert_equal(event.pressed, expected[i].pressed,
+			              "wrong direction");
+			queue.pop();
+		}
+		zassert_false(queue.peek(&event), "unexpected event");
+	}
+
+	static void key_event_drain_test(void) {
+		KeyEventQueue queue;
+		KeyBitmap state;
+		KeyBitmap consumer_state;
+		KeyBitmap changed;
+
+		// A quick key press must not be merged into no change.
+		state.set_bit(KEY_A);
+		state.set_bit(KEY_B);
+		queue.publish(state, 0);
+		state.clear_bit(KEY_A);
+		queue.publish(state, 1);
+		uint32_t time = 0;
+		zassert_true(queue.drain(&consumer_state, &changed, &time),
+		             "no change");
+		zassert_equal(time, 0, "wrong time");
+		zassert_true(changed.bit_is_set(KEY_A), "A not changed");
+		zassert_true(changed.bit_is_set(KEY_B), "B not changed");
+		zassert_true(consumer_state.bit_is_set(KEY_A), "A not pressed");
+		zassert_true(queue.drain(&consumer_state, &changed, &time),
+		             "release was merged");
+		zassert_equal(time, 1, "wrong time");
+		zassert_true(changed.bit_is_set(KEY_A), "A not changed");
+		zassert_false(changed.bit_is_set(KEY_B), "B changed");
+		zassert_true(consumer_state == state, "wrong state");
+		zassert_false(queue.drain(&consumer_state, &changed),
+		              "unexpected change");
+	}
+
+	static void key_event_overflow_test(void) {
+		KeyEventQueue queue;
+		KeyBitmap state;
+		KeyBitmap consumer_state;
+		KeyBitmap changed;
+
+		// Fill the queue with more presses than it can hold. Repeat
+		// the test to make sure that the indices wrap around correctly.
+		for (int round = 0; round < 3; round++) {
+			for (size_t i = 0; i < KEY_EVENT_QUEUE_SIZE + 10; i++) {
+				state.set_bit(i);
+				queue.publish(state, i);
+			}
+			zassert_true(queue.has_unpublished_changes(),
+			             "overflow not detected");
+
+			// Once the consumer has made room, the remaining
+			// changes are published.
+			zassert_true(queue.drain(&consumer_state, &changed),
+			             "no change");
+			zassert_true(queue.publish(state, 0), "nothing published");
+			zassert_false(queue.has_unpublished_changes(),
+			              "changes not published");
+			zassert_true(queue.drain(&consumer_state, &changed),
+			             "no change");
+			zassert_true(consumer_state == state, "state lost");
+
+			// Release all keys, which again overflows the queue.
+			state = KeyBitmap();
+			queue.publish(state, 0);
+			while (queue.drain(&consumer_state, &changed)) {
+				queue.publish(state, 0);
+			}
+			zassert_false(queue.has_unpublished_changes(),
+			              "changes not published");
+			zassert_true(consumer_state.is_empty(), "keys not released");
+		}
+		zassert_equal(queue.overflow_count(), 33, "wrong overflow count");
+	}
+
+	static void key_event_tap_test(void) {
+		KeyEventQueue queue;
+		KeyBitmap state;
+		KeyBitmap consumer_state;
+		KeyBitmap changed;
+
+		// Fill the queue so that the press of the last key is kept
+		// back.
+		for (size_t i = 0; i < KEY_EVENT_QUEUE_SIZE + 1; i++) {
+			state.set_bit(i);
+		}
+		queue.publish(state, 0);
+		zassert_true(queue.has_unpublished_changes(),
+		             "overflow not detected");
+
+		// The producer publishes the same state until the consumer has
+		// made room, and only then the release of the key.
+		zassert_true(queue.drain(&consumer_state, &changed), "no change");
+		zassert_true(queue.publish(state, 1), "press not published");
+		state.clear_bit(KEY_EVENT_QUEUE_SIZE);
+		zassert_true(queue.publish(state, 2), "release not published");
+
+		zassert_true(queue.drain(&consumer_state, &changed), "no change");
+		zassert_true(changed.bit_is_set(KEY_EVENT_QUEUE_SIZE),
+		             "press was merged");
+		zassert_true(consumer_state.bit_is_set(KEY_EVENT_QUEUE_SIZE),
+		             "key not pressed");
+		zassert_true(queue.drain(&consumer_state, &changed), "no change");
+		zassert_true(changed.bit_is_set(KEY_EVENT_QUEUE_SIZE),
+		             "release was merged");
+		zassert_true(consumer_state == state, "wrong state");
+	}
+
+	static void key_events_tests() {
+		ztest_test_suite(key_events,
+			ztest_unit_test(key_event_order_test),
+			ztest_unit_test(key_event_drain_test),
+			ztest_unit_test(key_event_overflow_test),
+			ztest_unit_test(key_event_tap_test)
+		);
+		ztest_run_test_suite(key_events);
+	}
+	RegisterTests key_events_tests_(key_events_tests);
+}
+#endif
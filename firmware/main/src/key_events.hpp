@@ -0,0 +1,104 @@
+#ifndef KEY_EVENTS_HPP_INCLUDED
+#define KEY_EVENTS_HPP_INCLUDED
+
+#include "keys.hpp"
+
+#include <sys/atomic.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KEY_EVENT_QUEUE_SIZE CONFIG_GOBOARD_KEY_EVENT_QUEUE_SIZE
+
+/// Single key press or release.
+struct KeyEvent {
+	/// Cycle counter (`k_cycle_get_32()`) at the time of the scan which
+	/// first saw the change, before debouncing.
+	uint32_t time;
+	/// Scan code of the key.
+	uint8_t key;
+	/// True if the key was pressed, false if it was released.
+	bool pressed;
+};
+
+/// Lock-free queue of key events between the key scanner and a keyboard
+/// transport.
+///
+/// The queue is a ring buffer with exactly one producer (the key scanner) and
+/// one consumer (the active keyboard implementation). No locks are required as
+/// each index is only ever written by one side.
+///
+/// The producer does not push individual changes but rather publishes the
+/// complete key state, and the queue generates events for all keys which differ
+/// from the last published state. If the queue is full, the remaining changes
+/// are kept back and published once the consumer has made room again, so the
+/// consumer always ends up with the correct key state even if it stalls for a
+/// long time. Until then, the producer has to keep publishing the same state,
+/// so that no transition is ever merged with the following one. The key
+/// scanner therefore stops scanning while the queue is full.
+class KeyEventQueue {
+public:
+	KeyEventQueue() {}
+
+	/// Publishes the current key state (producer only).
+	///
+	/// @param state Current state of all keys.
+	/// @param time Time of the scan which first saw the changes.
+	/// @return True if any event was added to the queue.
+	bool publish(const KeyBitmap &state, uint32_t time);
+
+	/// Returns true if the last call to `publish()` could not add all
+	/// changes to the queue (producer only).
+	///
+	/// `publish()` has to be called again with the same state once the
+	/// consumer has removed events from the queue. Publishing a different
+	/// state instead would merge a press and a release of a key whose
+	/// change was kept back.
+	bool has_unpublished_changes() {
+		return unpublished;
+	}
+
+	/// Returns the oldest event without removing it from the queue
+	/// (consumer only).
+	///
+	/// @return False if the queue is empty.
+	bool peek(KeyEvent *event);
+
+	/// Removes the oldest event from the queue (consumer only).
+	void pop();
+
+	/// Applies all pending events to a key state (consumer only).
+	///
+	/// Processing stops before the second event for the same key, so that
+	/// the consumer can report every single transition - a quick key press
+	/// would otherwise be merged into no change at all. The remaining
+	/// events are returned by the next call.
+	///
+	/// @param state Key state of the consumer which is updated.
+	/// @param changed Receives the keys which changed.
+	/// @param time If not NULL, receives the time of the oldest event.
+	/// @return True if any key changed.
+	bool drain(KeyBitmap *state, KeyBitmap *changed, uint32_t *time = NULL);
+
+	/// Number of calls to `publish()` which found the queue full.
+	uint32_t overflow_count() {
+		return overflows;
+	}
+private:
+	bool push(const KeyEvent &event);
+
+	KeyEvent events[KEY_EVENT_QUEUE_SIZE];
+	/// Index of the next event to be written, only written by the
+	/// producer.
+	atomic_t head = ATOMIC_INIT(0);
+	/// Index of the next event to be read, only written by the consumer.
+	atomic_t tail = ATOMIC_INIT(0);
+
+	/// Key state represented by all events added so far (producer only).
+	KeyBitmap published;
+	bool unpublished = false;
+	uint32_t overflows = 0;
+};
+
+#endif
+
@@ -1,6 +1,7 @@
 #include "key_matrix.hpp"
 
 #include "exception.hpp"
+#include "gpio.hpp"
 
 #define KEY_MATRIX DT_PATH(keymatrix)
 
@@ -19,6 +20,15 @@
 #define STORE_PIN DT_GPIO_PIN(KEY_MATRIX, store_gpios)
 #define STORE_FLAGS DT_GPIO_FLAGS(KEY_MATRIX, store_gpios)
 
+// The sense line is optional and is only present on boards where the columns
+// are additionally connected to a wired-OR input.
+#if DT_NODE_HAS_PROP(KEY_MATRIX, sense_gpios)
+#define HAS_SENSE_GPIO 1
+#define SENSE_LABEL DT_GPIO_LABEL(KEY_MATRIX, sense_gpios)
+#define SENSE_PIN DT_GPIO_PIN(KEY_MATRIX, sense_gpios)
+#define SENSE_FLAGS (GPIO_INPUT | DT_GPIO_FLAGS(KEY_MATRIX, sense_gpios))
+#endif
+
 KeyMatrix::KeyMatrix() {
 	// Initialize the GPIOs.
 	power_gpio = init_output_gpio(POWER_LABEL,
@@ -33,15 +43,40 @@ KeyMatrix::KeyMatrix() {
 	                             STORE_PIN,
 	                             STORE_FLAGS);
 	gpio_pin_set(store_gpio, STORE_PIN, false);
+#ifdef HAS_SENSE_GPIO
+	sense_gpio = device_get_binding(SENSE_LABEL);
+	if (sense_gpio == NULL) {
+		throw InitializationFailed("sense GPIO not found");
+	}
+	if (gpio_pin_configure(sense_gpio, SENSE_PIN, SENSE_FLAGS) != 0) {
+		throw InitializationFailed("sense gpio_pin_configure failed");
+	}
+	gpio_init_callback(&sense_cb_data,
+	                   KeyMatrix::sense_gpio_callback,
+	                   BIT(SENSE_PIN));
+	gpio_add_callback(sense_gpio, &sense_cb_data);
+#endif
 
 	// Initialize SPI.
 	spi_dev = device_get_binding(SPI_LABEL);
 	if (spi_dev == NULL) {
 		throw InitializationFailed("SPI not found");
 	}
+	rx_buf.buf = &rx_data;
+	rx_buf.len = sizeof(rx_data);
+	rx_buf_set.buffers = &rx_buf;
+	rx_buf_set.count = 1;
+	tx_buf.buf = &tx_data;
+	tx_buf.len = sizeof(tx_data);
+	tx_buf_set.buffers = &tx_buf;
+	tx_buf_set.count = 1;
 }
 
 KeyMatrix::~KeyMatrix() {
+	disable_any_key_interrupt();
+#ifdef HAS_SENSE_GPIO
+	gpio_remove_callback(sense_gpio, &sense_cb_data);
+#endif
 	gpio_pin_set(load_gpio, LOAD_PIN, false);
 	gpio_pin_set(store_gpio, STORE_PIN, false);
 }
@@ -60,59 +95,136 @@ void KeyMatrix::disable() {
 }
 
 void KeyMatrix::select_row() {
-	gpio_pin_set(store_gpio, STORE_PIN, true);
-	k_sleep(K_USEC(1));
-	gpio_pin_set(store_gpio, STORE_PIN, false);
-	k_sleep(K_USEC(1));
+	pulse(store_gpio, STORE_PIN);
 }
 
 void KeyMatrix::load_input() {
-	gpio_pin_set(load_gpio, LOAD_PIN, true);
-	k_sleep(K_USEC(1));
-	gpio_pin_set(load_gpio, LOAD_PIN, false);
-	k_sleep(K_USEC(1));
+	pulse(load_gpio, LOAD_PIN);
 }
 
 uint16_t KeyMatrix::transfer(uint8_t out) {
-	uint16_t in = 0;
-	struct spi_buf buf = {
-		.buf = &in,
-		.len = sizeof(in),
-	};
-	struct spi_buf_set buf_set = {
-		.buffers = &buf,
-		.count = 1,
-	};
-	if (spi_read(spi_dev, &READ_SPI_CFG, &buf_set) != 0) {
+	return transfer_prepared(out);
+}
+
+void KeyMatrix::scan_all(uint16_t rows[KEY_MATRIX_ROWS]) {
+	// The row for each iteration has already been shifted into the row
+	// selection register by the previous transfer, so we only have to
+	// latch it, read the columns, and shift the next row.
+	uint8_t row_pattern = 0x1;
+	for (int i = 0; i < KEY_MATRIX_ROWS; i++) {
+		if (i == KEY_MATRIX_ROWS - 1) {
+			row_pattern = 0x1;
+		} else {
+			row_pattern <<= 1;
+		}
+		pulse(store_gpio, STORE_PIN);
+		pulse(load_gpio, LOAD_PIN);
+		rows[i] = transfer_prepared(row_pattern);
+	}
+}
+
+void KeyMatrix::pulse(const struct device *gpio, gpio_pin_t pin) {
+	// The shift registers only require pulses in the order of tens of
+	// nanoseconds. k_sleep() would yield to the scheduler and sleep for at
+	// least one system tick, so we wait actively instead.
+	gpio_pin_set(gpio, pin, true);
+	k_busy_wait(1);
+	gpio_pin_set(gpio, pin, false);
+	k_busy_wait(1);
+}
+
+uint16_t KeyMatrix::transfer_prepared(uint8_t out) {
+	if (spi_read(spi_dev, &READ_SPI_CFG, &rx_buf_set) != 0) {
 		throw HardwareError("spi_read failed");
 	}
 	// The row selection lines are active-low.
-	out = ~out << 1;
-	buf.buf = &out;
-	buf.len = sizeof(out);
-	if (spi_write(spi_dev, &WRITE_SPI_CFG, &buf_set) != 0) {
+	tx_data = ~out << 1;
+	if (spi_write(spi_dev, &WRITE_SPI_CFG, &tx_buf_set) != 0) {
 		throw HardwareError("spi_write failed");
 	}
 	// The keys are active-low.
-	in = ~in;
+	uint16_t in = ~rx_data;
 	return (in >> 8) | (in << 8);
 }
 
-// TODO: This code should be deduplicated, a copy can be found in
-// power_supply_pins.cpp.
-const struct device *KeyMatrix::init_output_gpio(const char *label,
-                                                 gpio_pin_t pin,
-                                                 gpio_flags_t flags) {
-	const struct device *gpio = device_get_binding(label);
-	if (gpio == NULL) {
-		throw InitializationFailed("GPIO not found");
+#ifdef CONFIG_GOBOARD_KEY_MATRIX_BENCHMARK
+void KeyMatrix::benchmark() {
+	static const int ITERATIONS = 1000;
+	uint16_t rows[KEY_MATRIX_ROWS];
+
+	// Previous implementation: Every latch pulse sleeps, which causes a
+	// context switch and rounds the pulse length up to a system tick.
+	uint32_t start = k_cycle_get_32();
+	for (int i = 0; i < ITERATIONS; i++) {
+		uint8_t row_pattern = 0x1;
+		for (int j = 0; j < KEY_MATRIX_ROWS; j++) {
+			row_pattern = j == KEY_MATRIX_ROWS - 1 ? 0x1 : row_pattern << 1;
+			gpio_pin_set(store_gpio, STORE_PIN, true);
+			k_sleep(K_USEC(1));
+			gpio_pin_set(store_gpio, STORE_PIN, false);
+			k_sleep(K_USEC(1));
+			gpio_pin_set(load_gpio, LOAD_PIN, true);
+			k_sleep(K_USEC(1));
+			gpio_pin_set(load_gpio, LOAD_PIN, false);
+			k_sleep(K_USEC(1));
+			rows[j] = transfer_prepared(row_pattern);
+		}
 	}
-	if (gpio_pin_configure(gpio, pin,
-	                       GPIO_OUTPUT_INACTIVE | flags) != 0) {
-		throw InitializationFailed("gpio_pin_configure failed");
+	uint32_t row_by_row = k_cycle_get_32() - start;
+
+	start = k_cycle_get_32();
+	for (int i = 0; i < ITERATIONS; i++) {
+		scan_all(rows);
+	}
+	uint32_t batched = k_cycle_get_32() - start;
+
+	printk("key matrix scan: row-by-row %uus, scan_all() %uus\n",
+	       k_cyc_to_us_floor32(row_by_row / ITERATIONS),
+	       k_cyc_to_us_floor32(batched / ITERATIONS));
+}
+#endif
+
+bool KeyMatrix::has_any_key_interrupt() {
+	return sense_gpio != NULL;
+}
+
+void KeyMatrix::enable_any_key_interrupt(void (*callback)(void *arg),
+                                         void *arg) {
+#ifdef HAS_SENSE_GPIO
+	any_key_callback = callback;
+	any_key_arg = arg;
+	if (gpio_pin_interrupt_configure(sense_gpio,
+	                                 SENSE_PIN,
+	                                 GPIO_INT_EDGE_TO_ACTIVE) != 0) {
+		throw HardwareError("failed to configure sense interrupt");
+	}
+	// The edge has been missed if the key was pressed before the interrupt
+	// was enabled.
+	if (gpio_pin_get(sense_gpio, SENSE_PIN) > 0 && callback != NULL) {
+		callback(arg);
 	}
+#else
+	(void)callback;
+	(void)arg;
+#endif
+}
 
-	return gpio;
+void KeyMatrix::disable_any_key_interrupt() {
+#ifdef HAS_SENSE_GPIO
+	gpio_pin_interrupt_configure(sense_gpio, SENSE_PIN, GPIO_INT_DISABLE);
+	any_key_callback = NULL;
+#endif
+}
+
+void KeyMatrix::sense_gpio_callback(const struct device *port,
+                                    struct gpio_callback *cb,
+                                    uint32_t pins) {
+	(void)port;
+	(void)pins;
+	KeyMatrix *matrix = CONTAINER_OF(cb, KeyMatrix, sense_cb_data);
+	if (matrix->any_key_callback != NULL) {
+		matrix->any_key_callback(matrix->any_key_arg);
+	}
 }
 
 const struct spi_config KeyMatrix::READ_SPI_CFG = {
@@ -6,6 +6,8 @@
 #include <drivers/gpio.h>
 #include <drivers/spi.h>
 
+#define KEY_MATRIX_ROWS 6
+
 /// Class which reads the key matrix via shift registers.
 class KeyMatrix {
 public:
@@ -32,16 +34,64 @@ public:
 	/// SPI operation which writes the specified data into the row selection
 	/// shift register and returns the data from the input shift registers.
 	uint16_t transfer(uint8_t out);
+
+	/// Reads the state of all rows.
+	///
+	/// The function expects the first row to have been written into the
+	/// row selection shift register via `transfer(0x1)`, and it leaves the
+	/// shift register in the same state, so that consecutive calls do not
+	/// require any additional transfers.
+	void scan_all(uint16_t rows[KEY_MATRIX_ROWS]);
+
+#ifdef CONFIG_GOBOARD_KEY_MATRIX_BENCHMARK
+	/// Measures the time required to scan the key matrix and prints the
+	/// result.
+	///
+	/// The benchmark compares `scan_all()` with the previous row-by-row
+	/// implementation which slept for each latch pulse.
+	void benchmark();
+#endif
+
+	/// Returns whether the board has a sense line which signals whether any
+	/// key in the selected rows is pressed.
+	bool has_any_key_interrupt();
+
+	/// Enables an interrupt on the sense line.
+	///
+	/// The callback is called from the interrupt handler once any key in
+	/// the currently selected rows is pressed. If a key is already pressed
+	/// when the function is called, the callback is called immediately.
+	/// Only works if `has_any_key_interrupt()` returns true.
+	void enable_any_key_interrupt(void (*callback)(void *arg), void *arg);
+
+	/// Disables the interrupt enabled by `enable_any_key_interrupt()`.
+	void disable_any_key_interrupt();
 private:
-	static const struct device *init_output_gpio(const char *label,
-	                                             gpio_pin_t pin,
-	                                             gpio_flags_t flags);
+	void pulse(const struct device *gpio, gpio_pin_t pin);
+	uint16_t transfer_prepared(uint8_t out);
+
+	static void sense_gpio_callback(const struct device *port,
+	                                struct gpio_callback *cb,
+	                                uint32_t pins);
 
 	const struct device *power_gpio;
 	const struct device *load_gpio;
 	const struct device *store_gpio;
+	const struct device *sense_gpio = NULL;
+
+	struct gpio_callback sense_cb_data;
+	void (*any_key_callback)(void *arg) = NULL;
+	void *any_key_arg = NULL;
 
 	const struct device *spi_dev;
+	// The SPI buffers are prepared once so that no descriptors need to be
+	// built during a scan.
+	uint16_t rx_data;
+	uint8_t tx_data;
+	struct spi_buf rx_buf;
+	struct spi_buf tx_buf;
+	struct spi_buf_set rx_buf_set;
+	struct spi_buf_set tx_buf_set;
 	static const struct spi_config READ_SPI_CFG;
 	static const struct spi_config WRITE_SPI_CFG;
 };
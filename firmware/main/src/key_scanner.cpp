@@ -0,0 +1,368 @@
+#include "key_scanner.hpp"
+
+#include "exception.hpp"
+
+#include <settings/settings.h>
+
+#define STACK_SIZE 1024
+// The scan thread is cooperative (negative priority), so a scan is never
+// interrupted by the keyboard implementations. Cooperative threads cannot be
+// preempted, so the thread still has to wait for a running work item to yield,
+// but its priority is above the keyboard workqueue so that a pending scan runs
+// before any pending report work.
+#define PRIORITY -3
+
+BUILD_ASSERT(PRIORITY < CONFIG_GOBOARD_KEYBOARD_WORKQUEUE_PRIORITY,
+             "the scan thread must have a higher priority than the keyboard "
+             "workqueue");
+
+#define JITTER_LOG_INTERVAL_MS 10000
+
+// Without a sense line, the key matrix is powered for a few milliseconds at
+// this rate while suspended to check for key presses.
+#define SENSE_SUSPENDED_RATE_HZ 50
+
+K_THREAD_STACK_DEFINE(key_scanner_stack, STACK_SIZE);
+
+#ifdef CONFIG_GOBOARD_DEBOUNCE_EAGER
+struct DebounceTiming {
+	uint8_t press_ms;
+	uint8_t release_ms;
+};
+
+static const char *const DEBOUNCE_SETTING = "keys/debounce";
+
+/// Debouncing windows selectable via FN+F6. Longer release delays help with
+/// worn switches which chatter when released.
+static const DebounceTiming DEBOUNCE_PRESETS[] = {
+	{5, 5},
+	{5, 10},
+	{5, 20},
+	{0, 5},
+};
+
+/// Debouncing windows, written by the main thread and read by the scan thread
+/// once `debounce_timing_changed` is set.
+static DebounceTiming debounce_timing = {
+	CONFIG_GOBOARD_DEBOUNCE_PRESS_MS,
+	CONFIG_GOBOARD_DEBOUNCE_RELEASE_MS,
+};
+
+static int keys_settings_set(const char *name,
+                             size_t len,
+                             settings_read_cb read_cb,
+                             void *cb_arg) {
+	const char *next;
+	if (!settings_name_steq(name, "debounce", &next) || next) {
+		return -ENOENT;
+	}
+	if (len != sizeof(debounce_timing)) {
+		return -EINVAL;
+	}
+	int ret = read_cb(cb_arg, &debounce_timing, sizeof(debounce_timing));
+	if (ret < 0) {
+		return ret;
+	}
+	return 0;
+}
+
+static int keys_settings_export(int (*cb)(const char *name,
+                                          const void *value,
+                                          size_t val_len)) {
+	return cb(DEBOUNCE_SETTING, &debounce_timing, sizeof(debounce_timing));
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(keys_settings,
+                               "keys",
+                               NULL,
+                               keys_settings_set,
+                               NULL,
+                               keys_settings_export);
+#endif
+
+KeyScanner::KeyScanner(Keys<KeyMatrix> *keys): keys(keys) {
+#ifdef CONFIG_GOBOARD_DEBOUNCE_EAGER
+	// The settings have been loaded before the scanner is created, and the
+	// thread is not running yet.
+	keys->get_debouncer()->set_timing(debounce_timing.press_ms,
+	                                  debounce_timing.release_ms);
+#endif
+	atomic_set(&active_rate_hz, CONFIG_GOBOARD_SCAN_RATE_HZ);
+	atomic_set(&idle_rate_hz, CONFIG_GOBOARD_SCAN_RATE_HZ);
+	k_sem_init(&wakeup, 0, 1);
+	keys->set_any_key_callback(static_on_any_key, this);
+	k_thread_create(&thread, key_scanner_stack,
+	                K_THREAD_STACK_SIZEOF(key_scanner_stack),
+	                static_thread_entry,
+	                this, NULL, NULL,
+	                PRIORITY, 0, K_NO_WAIT);
+}
+
+KeyScanner::~KeyScanner() {
+	stop = true;
+	k_sem_give(&wakeup);
+	k_thread_join(&thread, K_FOREVER);
+	keys->set_any_key_callback(NULL, NULL);
+}
+
+void KeyScanner::set_rate(unsigned int active_hz, unsigned int idle_hz) {
+	if (active_hz == 0 || active_hz > SCAN_RATE_MAX_HZ ||
+	    idle_hz == 0 || idle_hz > SCAN_RATE_MAX_HZ) {
+		throw InvalidState("invalid scan rate");
+	}
+	atomic_set(&active_rate_hz, active_hz);
+	atomic_set(&idle_rate_hz, idle_hz);
+	k_sem_give(&wakeup);
+}
+
+#ifdef CONFIG_GOBOARD_DEBOUNCE_EAGER
+void KeyScanner::set_debounce_timing(int press_ms, int release_ms) {
+	DebounceTiming timing = {
+		(uint8_t)CLAMP(press_ms, 0, 255),
+		(uint8_t)CLAMP(release_ms, 0, 255),
+	};
+	k_sched_lock();
+	debounce_timing = timing;
+	k_sched_unlock();
+	if (settings_save_one(DEBOUNCE_SETTING,
+	                      &timing,
+	                      sizeof(timing)) != 0) {
+		throw HardwareError("cannot save debouncing timing");
+	}
+	atomic_set(&debounce_timing_changed, 1);
+	k_sem_give(&wakeup);
+}
+
+bool KeyScanner::take_debounce_request() {
+	return atomic_cas(&debounce_requested, 1, 0);
+}
+
+void KeyScanner::select_next_debounce_timing() {
+	k_sched_lock();
+	DebounceTiming current = debounce_timing;
+	k_sched_unlock();
+	// If the current windows are not in the list (e.g., the defaults from
+	// the build configuration), the first entry is selected.
+	size_t next = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(DEBOUNCE_PRESETS); i++) {
+		if (DEBOUNCE_PRESETS[i].press_ms == current.press_ms &&
+		    DEBOUNCE_PRESETS[i].release_ms == current.release_ms) {
+			next = (i + 1) % ARRAY_SIZE(DEBOUNCE_PRESETS);
+			break;
+		}
+	}
+	printk("debouncing: %ums after press, %ums before release\n",
+	       DEBOUNCE_PRESETS[next].press_ms,
+	       DEBOUNCE_PRESETS[next].release_ms);
+	set_debounce_timing(DEBOUNCE_PRESETS[next].press_ms,
+	                    DEBOUNCE_PRESETS[next].release_ms);
+}
+#endif
+
+void KeyScanner::set_request_callback(void (*callback)()) {
+	k_sched_lock();
+	request_callback = callback;
+	k_sched_unlock();
+}
+
+void KeyScanner::set_event_callback(void (*callback)(void *arg), void *arg) {
+	// The thread must never see the new callback with the old argument.
+	k_sched_lock();
+	event_callback = callback;
+	event_arg = arg;
+	k_sched_unlock();
+}
+
+void KeyScanner::suspend(void (*wakeup_callback)(void *arg), void *arg) {
+	k_sched_lock();
+	this->wakeup_callback = wakeup_callback;
+	wakeup_arg = arg;
+	k_sched_unlock();
+	atomic_set(&suspend_requested, 1);
+	k_sem_give(&wakeup);
+}
+
+void KeyScanner::resume() {
+	atomic_set(&suspend_requested, 0);
+	k_sem_give(&wakeup);
+}
+
+void KeyScanner::static_on_any_key(void *arg) {
+	KeyScanner *thisptr = (KeyScanner *)arg;
+	k_sem_give(&thisptr->wakeup);
+}
+
+void KeyScanner::static_on_tick(void *arg) {
+	KeyScanner *thisptr = (KeyScanner *)arg;
+	k_sem_give(&thisptr->wakeup);
+}
+
+void KeyScanner::static_thread_entry(void *arg1, void *arg2, void *arg3) {
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+	((KeyScanner *)arg1)->thread_entry();
+}
+
+void KeyScanner::thread_entry() {
+	// Currently active scan rate, 0 if the scheduler is stopped.
+	unsigned int rate_hz = 0;
+	// Debouncing works with milliseconds, so the remainder is carried over
+	// to the next scan.
+	uint32_t elapsed_us = 0;
+	// Cycle counter value at the last scan. The interval passed to the
+	// debouncer is measured, because the thread is also woken up by key
+	// presses and rate changes, and because multiple ticks are coalesced
+	// if the thread is delayed.
+	uint32_t last_scan_time = k_cycle_get_32();
+	bool suspended = false;
+	// True if a key was pressed during the last check while suspended, so
+	// that a held key only causes a single wakeup.
+	bool key_was_pressed = false;
+#ifdef CONFIG_GOBOARD_SCAN_JITTER_LOG
+	int64_t next_log = k_uptime_get() + JITTER_LOG_INTERVAL_MS;
+#endif
+	while (!stop) {
+		bool want_suspended = atomic_get(&suspend_requested) != 0;
+		if (want_suspended != suspended) {
+			if (want_suspended) {
+				keys->suspend();
+				key_was_pressed = false;
+				// Report the released keys.
+				publish_state(k_cycle_get_32());
+			} else {
+				keys->resume();
+				elapsed_us = 0;
+				last_scan_time = k_cycle_get_32();
+			}
+			suspended = want_suspended;
+		}
+
+		unsigned int wanted_rate_hz;
+		if (keys->can_wait_for_key() && !events.has_unpublished_changes()) {
+			// The any-key callback wakes the thread.
+			wanted_rate_hz = 0;
+		} else if (suspended) {
+			wanted_rate_hz = SENSE_SUSPENDED_RATE_HZ;
+		} else if (keys->is_idle()) {
+			wanted_rate_hz = atomic_get(&idle_rate_hz);
+		} else {
+			wanted_rate_hz = atomic_get(&active_rate_hz);
+		}
+		if (wanted_rate_hz != rate_hz) {
+			if (wanted_rate_hz == 0) {
+				scheduler.stop();
+			} else {
+				scheduler.start(wanted_rate_hz, static_on_tick, this);
+			}
+			rate_hz = wanted_rate_hz;
+		}
+
+		// The semaphore is given on every tick, when a key is pressed,
+		// when the rate is changed, or when the thread shall stop.
+		k_sem_take(&wakeup, K_FOREVER);
+		if (stop) {
+			break;
+		}
+
+		if (suspended) {
+			if (rate_hz == 0) {
+				// Every interrupt signals a new key press.
+				key_was_pressed = false;
+			}
+			bool pressed = keys->sense_any_key();
+			if (pressed && !key_was_pressed) {
+				k_sched_lock();
+				if (wakeup_callback != NULL) {
+					wakeup_callback(wakeup_arg);
+				}
+				k_sched_unlock();
+			}
+			key_was_pressed = pressed;
+			if (events.has_unpublished_changes()) {
+				publish_state(k_cycle_get_32());
+			}
+			continue;
+		}
+
+		if (events.has_unpublished_changes()) {
+			// The consumer has to see every transition, so the key
+			// state must not change until all changes of the last
+			// scan have been published. The time spent waiting is
+			// passed to the debouncer once scanning resumes.
+			publish_state(keys->get_change_time());
+			continue;
+		}
+
+		uint32_t scan_time = k_cycle_get_32();
+		// While the scheduler is stopped, no key has been pressed, so the
+		// time spent waiting for the any-key callback is not passed to the
+		// debouncer.
+		if (rate_hz != 0) {
+			elapsed_us += k_cyc_to_us_floor32(scan_time - last_scan_time);
+		}
+		last_scan_time = scan_time;
+		int interval_ms = elapsed_us / 1000;
+		elapsed_us %= 1000;
+#ifdef CONFIG_GOBOARD_DEBOUNCE_EAGER
+		if (atomic_cas(&debounce_timing_changed, 1, 0)) {
+			k_sched_lock();
+			DebounceTiming timing = debounce_timing;
+			k_sched_unlock();
+			keys->get_debouncer()->set_timing(timing.press_ms,
+			                                  timing.release_ms);
+		}
+#endif
+		bool changed = keys->poll(interval_ms);
+
+#ifdef CONFIG_GOBOARD_SCAN_JITTER_LOG
+		if (k_uptime_get() >= next_log) {
+			LatencySummary jitter;
+			scheduler.get_jitter(&jitter);
+			printk("scan jitter: %u ticks at %u Hz, latency %u-%uns, "
+			       "mean %uns\n",
+			       jitter.count,
+			       rate_hz,
+			       jitter.min_ns,
+			       jitter.max_ns,
+			       jitter.mean_ns);
+			next_log += JITTER_LOG_INTERVAL_MS;
+		}
+#endif
+
+		if (changed) {
+			// The latency is measured from the scan which first saw
+			// the change, including the time spent in the debouncer.
+			publish_state(keys->get_change_time());
+		}
+	}
+	scheduler.stop();
+}
+
+void KeyScanner::publish_state(uint32_t time) {
+	KeyBitmap state;
+	keys->get_state(&state);
+	// The keyboard implementations only see the translated keys, e.g.,
+	// FN+F10 is published as a press of the mute key.
+	translate_fn_keys(&state);
+#ifdef CONFIG_GOBOARD_DEBOUNCE_EAGER
+	// The new timing is stored in flash, so the main thread has to apply
+	// it.
+	bool debounce_key = state.bit_is_set(FN_KEY_DEBOUNCE);
+	if (debounce_key && !debounce_key_pressed) {
+		atomic_set(&debounce_requested, 1);
+		k_sched_lock();
+		if (request_callback != NULL) {
+			request_callback();
+		}
+		k_sched_unlock();
+	}
+	debounce_key_pressed = debounce_key;
+#endif
+	if (events.publish(state, time)) {
+		k_sched_lock();
+		if (event_callback != NULL) {
+			event_callback(event_arg);
+		}
+		k_sched_unlock();
+	}
+}
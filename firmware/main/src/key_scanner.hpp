@@ -0,0 +1,135 @@
+#ifndef KEY_SCANNER_HPP_INCLUDED
+#define KEY_SCANNER_HPP_INCLUDED
+
+#include "key_events.hpp"
+#include "key_matrix.hpp"
+#include "keys.hpp"
+#include "scan_scheduler.hpp"
+
+#include <kernel.h>
+
+/// High-priority thread which periodically scans the keys and publishes all
+/// changes as `KeyEvent`s. FN key combinations are translated before the
+/// changes are published (see `translate_fn_keys()`).
+///
+/// The scans are triggered by a `ScanScheduler`, so the scan rate is the same
+/// for all keyboard implementations and does not depend on USB SOFs or on the
+/// system tick.
+///
+/// Scanning is decoupled from the keyboard implementations, so a slow radio
+/// transfer or a busy workqueue never delays the scan. Each keyboard
+/// implementation drains the event queue at its own pace. If it stalls until
+/// the queue is full, scanning pauses until it has made room again, so that
+/// every transition reaches the keyboard implementation instead of being merged
+/// with the next one. Only one keyboard implementation must read the event
+/// queue at any time.
+///
+/// While no key is pressed, the thread sleeps until the key matrix signals a
+/// key press if the key matrix supports this.
+///
+/// While suspended (e.g., during USB suspend), the key matrix is kept in a
+/// low-power mode and the thread only checks whether any key is pressed, either
+/// via the sense line or by briefly powering the key matrix at a low rate.
+class KeyScanner {
+public:
+	KeyScanner(Keys<KeyMatrix> *keys);
+	~KeyScanner();
+
+	/// Sets the scan rate while keys are pressed and while no key is
+	/// pressed.
+	///
+	/// The idle rate is only used if the key matrix is unable to signal key
+	/// presses. Both rates must not exceed `SCAN_RATE_MAX_HZ`.
+	void set_rate(unsigned int active_hz, unsigned int idle_hz);
+
+	/// Sets a callback which is called from the scan thread whenever new
+	/// events have been added to the queue.
+	///
+	/// The callback must not block.
+	void set_event_callback(void (*callback)(void *arg), void *arg);
+
+	/// Switches the key matrix into low-power mode.
+	///
+	/// All keys are reported as released. Afterwards, no key events are
+	/// generated, and instead the wakeup callback is called from the scan
+	/// thread whenever a key is pressed. The callback must not block.
+	void suspend(void (*wakeup_callback)(void *arg), void *arg);
+
+	/// Leaves the low-power mode and resumes scanning.
+	void resume();
+
+	/// Sets a callback which is called from the scan thread whenever the
+	/// user requests a change which has to be applied by the main thread
+	/// (see `take_debounce_request()`).
+	///
+	/// The callback must not block.
+	void set_request_callback(void (*callback)());
+
+#ifdef CONFIG_GOBOARD_DEBOUNCE_EAGER
+	/// Changes the debouncing windows and stores them in the settings.
+	///
+	/// The stored windows replace the defaults from the build configuration
+	/// after the next reboot. See `EagerDebouncer::set_timing()`.
+	void set_debounce_timing(int press_ms, int release_ms);
+
+	/// Returns true once after FN+F6 has been pressed.
+	///
+	/// The caller is expected to call `select_next_debounce_timing()` in
+	/// response, which writes to flash and therefore cannot be called by
+	/// the scan thread itself.
+	bool take_debounce_request();
+
+	/// Switches to the next entry of a fixed list of debouncing windows and
+	/// stores it in the settings.
+	void select_next_debounce_timing();
+#endif
+
+	/// Returns the queue containing all key changes.
+	KeyEventQueue *get_events() {
+		return &events;
+	}
+
+	/// Returns the jitter of the scan ticks since the last change of the
+	/// scan rate.
+	void get_jitter(LatencySummary *jitter) {
+		scheduler.get_jitter(jitter);
+	}
+private:
+	static void static_on_any_key(void *arg);
+	static void static_on_tick(void *arg);
+	static void static_thread_entry(void *arg1, void *arg2, void *arg3);
+	void thread_entry();
+	/// Publishes the current key state.
+	///
+	/// @param time Cycle counter value when the changes were first seen.
+	void publish_state(uint32_t time);
+
+	Keys<KeyMatrix> *keys;
+	KeyEventQueue events;
+
+	ScanScheduler scheduler;
+	atomic_t active_rate_hz;
+	atomic_t idle_rate_hz;
+	void (*event_callback)(void *arg) = NULL;
+	void *event_arg = NULL;
+	void (*request_callback)() = NULL;
+	atomic_t suspend_requested = ATOMIC_INIT(0);
+	/// True if the thread has to apply new debouncing windows before the
+	/// next call to `poll()`.
+	atomic_t debounce_timing_changed = ATOMIC_INIT(0);
+	/// True if FN+F6 has been pressed and `take_debounce_request()` has not
+	/// been called since.
+	atomic_t debounce_requested = ATOMIC_INIT(0);
+	/// True if FN+F6 was pressed in the last published state. Only used by
+	/// the scan thread.
+	bool debounce_key_pressed = false;
+	void (*wakeup_callback)(void *arg) = NULL;
+	void *wakeup_arg = NULL;
+
+	volatile bool stop = false;
+	/// Semaphore to interrupt sleeping in the thread.
+	k_sem wakeup;
+	struct k_thread thread;
+};
+
+#endif
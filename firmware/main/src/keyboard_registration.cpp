@@ -0,0 +1,173 @@
+#include "keyboard_registration.hpp"
+
+#include "exception.hpp"
+#include "work_queue.hpp"
+
+template<class KeyboardType, class ScannerType>
+KeyboardRegistration<KeyboardType, ScannerType>::KeyboardRegistration(
+		KeyboardType *keyboard,
+		ScannerType *scanner,
+		k_work_handler_t handler):
+		keyboard(keyboard),
+		scanner(scanner) {
+	k_sched_lock();
+	if (instance != NULL) {
+		k_sched_unlock();
+		throw InvalidState("only one instance of a keyboard can exist");
+	}
+	instance = keyboard;
+	k_sched_unlock();
+
+	k_work_init(&event_work, handler);
+	scanner->set_event_callback(static_on_key_events, this);
+}
+
+template<class KeyboardType, class ScannerType>
+KeyboardRegistration<KeyboardType, ScannerType>::~KeyboardRegistration() {
+	// Once the callback has been unregistered, the scanner cannot submit
+	// the work item again.
+	scanner->set_event_callback(NULL, NULL);
+	cancel();
+	k_sched_lock();
+	instance = NULL;
+	k_sched_unlock();
+}
+
+template<class KeyboardType, class ScannerType>
+void KeyboardRegistration<KeyboardType, ScannerType>::submit() {
+	k_work_submit_to_queue(&keyboard_work_q, &event_work);
+}
+
+template<class KeyboardType, class ScannerType>
+void KeyboardRegistration<KeyboardType, ScannerType>::cancel() {
+	struct k_work_sync sync;
+	k_work_cancel_sync(&event_work, &sync);
+}
+
+template<class KeyboardType, class ScannerType>
+KeyboardType *KeyboardRegistration<KeyboardType, ScannerType>::from_work(
+		struct k_work *work) {
+	return CONTAINER_OF(work, KeyboardRegistration, event_work)->keyboard;
+}
+
+template<class KeyboardType, class ScannerType>
+void KeyboardRegistration<KeyboardType, ScannerType>::static_on_key_events(
+		void *arg) {
+	((KeyboardRegistration *)arg)->submit();
+}
+
+template<class KeyboardType, class ScannerType>
+KeyboardType *KeyboardRegistration<KeyboardType, ScannerType>::instance = NULL;
+
+#ifdef CONFIG_BOARD_GOBOARD_NRF52840
+#include "key_scanner.hpp"
+#include "usb.hpp"
+template class KeyboardRegistration<UsbKeyboard, KeyScanner>;
+#endif
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	class MockScanner {
+	public:
+		void set_event_callback(void (*callback)(void *arg),
+		                        void *arg) {
+			event_callback = callback;
+			event_arg = arg;
+		}
+
+		/// Simulates new key events.
+		void publish() {
+			if (event_callback != NULL) {
+				event_callback(event_arg);
+			}
+		}
+
+		void (*event_callback)(void *arg) = NULL;
+		void *event_arg = NULL;
+	};
+
+	static unsigned int handled_events = 0;
+
+	class MockKeyboard {
+	public:
+		MockKeyboard(MockScanner *scanner):
+				registration(this, scanner, static_on_events) {
+		}
+
+		static void static_on_events(struct k_work *work) {
+			MockKeyboard *thisptr = Registration::from_work(work);
+			zassert_equal(Registration::get(), thisptr,
+			              "work item of a different keyboard");
+			handled_events++;
+		}
+
+		typedef KeyboardRegistration<MockKeyboard, MockScanner>
+				Registration;
+		Registration registration;
+	};
+
+	static void keyboard_restart_test(void) {
+		MockScanner scanner;
+		handled_events = 0;
+
+		// The keyboard can be constructed again after it has been
+		// destroyed.
+		for (int round = 0; round < 3; round++) {
+			zassert_is_null(MockKeyboard::Registration::get(),
+			                "instance not released");
+			{
+				MockKeyboard keyboard(&scanner);
+				zassert_equal(MockKeyboard::Registration::get(),
+				              &keyboard,
+				              "instance not set");
+				zassert_not_null(scanner.event_callback,
+				                 "callback not registered");
+				scanner.publish();
+				k_sleep(K_MSEC(1));
+				zassert_equal(handled_events, round + 1,
+				              "events not handled");
+
+				// Events which have not been handled yet are
+				// dropped when the keyboard is destroyed.
+				k_sched_lock();
+				scanner.publish();
+			}
+			k_sched_unlock();
+			zassert_is_null(scanner.event_callback,
+			                "callback not unregistered");
+			k_sleep(K_MSEC(1));
+			zassert_equal(handled_events, round + 1,
+			              "work item not cancelled");
+		}
+	}
+
+	static void keyboard_single_instance_test(void) {
+		MockScanner scanner;
+		MockKeyboard keyboard(&scanner);
+		bool thrown = false;
+		try {
+			MockKeyboard second(&scanner);
+		} catch (InvalidState &) {
+			thrown = true;
+		}
+		zassert_true(thrown, "second instance created");
+		zassert_equal(MockKeyboard::Registration::get(),
+		              &keyboard,
+		              "instance replaced");
+		zassert_equal(scanner.event_arg,
+		              &keyboard.registration,
+		              "callback replaced");
+	}
+
+	static void keyboard_registration_tests() {
+		ztest_test_suite(keyboard_registration,
+			ztest_unit_test(keyboard_restart_test),
+			ztest_unit_test(keyboard_single_instance_test)
+		);
+		ztest_run_test_suite(keyboard_registration);
+	}
+	RegisterTests keyboard_registration_tests_(keyboard_registration_tests);
+}
+#endif
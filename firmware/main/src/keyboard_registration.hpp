@@ -0,0 +1,61 @@
+#ifndef KEYBOARD_REGISTRATION_HPP_INCLUDED
+#define KEYBOARD_REGISTRATION_HPP_INCLUDED
+
+#include <kernel.h>
+
+/// Registration of a keyboard implementation with the key scanner.
+///
+/// Only one instance of a keyboard implementation can exist at a time, because
+/// the callbacks of the USB stack need a pointer to it. The constructor claims
+/// the instance and lets the key scanner submit the event work item to the
+/// keyboard workqueue whenever new key events are available. The destructor
+/// unregisters the callback, cancels the work item and releases the instance,
+/// so that the keyboard can be constructed again, e.g., after a mode switch.
+///
+/// The scanner type has to provide the function `set_event_callback()` of
+/// `KeyScanner`.
+template<class KeyboardType, class ScannerType>
+class KeyboardRegistration {
+public:
+	/// Claims the instance and registers the event callback.
+	///
+	/// Throws `InvalidState` if another instance of the keyboard exists.
+	///
+	/// @param handler Handler of the event work item, which can use
+	///                `from_work()` to get the keyboard.
+	KeyboardRegistration(KeyboardType *keyboard,
+	                     ScannerType *scanner,
+	                     k_work_handler_t handler);
+	/// Releases the instance. Once the destructor returns, the event work
+	/// item is neither pending nor running.
+	~KeyboardRegistration();
+
+	/// Submits the event work item to the keyboard workqueue.
+	void submit();
+	/// Cancels the event work item and waits until it has finished.
+	void cancel();
+
+	/// Returns the keyboard whose event work item is passed to the
+	/// handler.
+	static KeyboardType *from_work(struct k_work *work);
+	/// Returns the current instance of the keyboard, or NULL.
+	static KeyboardType *get() {
+		return instance;
+	}
+private:
+	static void static_on_key_events(void *arg);
+
+	KeyboardType *keyboard;
+	ScannerType *scanner;
+	struct k_work event_work;
+
+	static KeyboardType *instance;
+};
+
+#ifdef CONFIG_BOARD_GOBOARD_NRF52840
+class KeyScanner;
+class UsbKeyboard;
+extern template class KeyboardRegistration<UsbKeyboard, KeyScanner>;
+#endif
+
+#endif
@@ -1,12 +1,15 @@
 #include "keys.hpp"
 
+#include "latency_trace.hpp"
+
 #include "kernel.h"
 #include "string.h"
 
 #define ROWS 6
 #define COLUMNS 16
+#define ALL_ROWS 0x3f
 
-static const ScanCode key_matrix_locations[ROWS][COLUMNS] = {
+static constexpr ScanCode key_matrix_locations[ROWS][COLUMNS] = {
 	{
 		KEY_INSERT,
 		KEY_DELETE,
@@ -117,14 +120,72 @@ static const ScanCode key_matrix_locations[ROWS][COLUMNS] = {
 	},
 };
 
+/// Position of a single key within `KeyBitmap::keys`.
+struct BitmapLocation {
+	uint8_t word;
+	uint32_t mask;
+};
+
+/// Table which maps every key matrix position to its position within
+/// `KeyBitmap::keys`.
+struct BitmapLocationTable {
+	BitmapLocation keys[ROWS][COLUMNS];
+};
+
+static constexpr BitmapLocationTable generate_bitmap_locations() {
+	BitmapLocationTable table = {};
+	for (int i = 0; i < ROWS; i++) {
+		for (int j = 0; j < COLUMNS; j++) {
+			unsigned int scan_code = key_matrix_locations[i][j];
+			table.keys[i][j].word = scan_code >> 5;
+			table.keys[i][j].mask = 1u << (scan_code & 0x1f);
+		}
+	}
+	return table;
+}
+
+/// Precomputed locations of all keys in the bitmap, generated from
+/// `key_matrix_locations` at compile time.
+static constexpr BitmapLocationTable bitmap_locations =
+		generate_bitmap_locations();
+
+static constexpr bool bitmap_locations_valid() {
+	for (int i = 0; i < ROWS; i++) {
+		for (int j = 0; j < COLUMNS; j++) {
+			if (bitmap_locations.keys[i][j].word >=
+					ARRAY_SIZE(KeyBitmap().keys)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+static_assert(bitmap_locations_valid(), "scan code outside of KeyBitmap");
+
+/// Converts the column state of all rows into a bitmap.
+///
+/// Only pressed keys are visited, so no work is done for released keys.
+static inline void map_rows(const uint16_t rows[ROWS], KeyBitmap *bitmap) {
+	for (uint8_t i = 0; i < ROWS; i++) {
+		uint32_t columns = rows[i];
+		while (columns != 0) {
+			unsigned int column = __builtin_ctz(columns);
+			columns &= columns - 1;
+			const BitmapLocation *location =
+					&bitmap_locations.keys[i][column];
+			bitmap->keys[location->word] |= location->mask;
+		}
+	}
+}
+
 static const ScanCode f_fn_mapping[12] = {
 	FN_KEY_PAIR,
 	FN_KEY_BLUETOOTH,
 	FN_KEY_UNIFYING,
 	FN_KEY_UNPAIR_ALL,
 	KEY_F4,
-	KEY_F5,
-	KEY_F6,
+	FN_KEY_DEBOUNCE,
+	FN_KEY_USB_POLL_INTERVAL,
 	KEY_F7,
 	FN_KEY_TOGGLE_GAME_MODE,
 	KEY_MUTE,
@@ -132,88 +193,277 @@ static const ScanCode f_fn_mapping[12] = {
 	KEY_VOLUME_DOWN,
 };
 
-template<class KeyMatrixType>
-Keys<KeyMatrixType>::Keys(KeyMatrixType *key_matrix): key_matrix(key_matrix) {
+void SixKeySet::update(const KeyBitmap &state, const KeyBitmap &changed) {
+	// The modifier byte is found at position 0xe0 (KEY_LCTRL) in the
+	// bitmap and can just be copied.
+	data[0] = (state.keys[KEY_LCTRL >> 5] >> (KEY_LCTRL & 0x1f)) & 0xff;
+
+	// Only the changed keys need to be looked at. Modifier keys and all
+	// following internal keys are not part of the list.
+	bool slot_freed = false;
+	for (size_t word = 0; word < (KEY_LCTRL >> 5); word++) {
+		uint32_t changed_bits = changed.keys[word];
+		while (changed_bits != 0) {
+			unsigned int bit = __builtin_ctz(changed_bits);
+			changed_bits &= changed_bits - 1;
+			uint8_t key = (word << 5) + bit;
+			if ((state.keys[word] & (1u << bit)) != 0) {
+				if (!add_key(key)) {
+					overflow = true;
+				}
+			} else {
+				for (size_t i = 2; i < 8; i++) {
+					if (data[i] == key) {
+						data[i] = 0;
+						slot_freed = true;
+					}
+				}
+			}
+		}
+	}
+
+	// If keys were pressed which did not fit into the set, the freed
+	// slots are filled with those keys.
+	if (slot_freed && overflow) {
+		overflow = false;
+		unsigned int start = 0;
+		while (true) {
+			int key = state.next_set_bit(start);
+			if (key == -1 || key >= KEY_LCTRL) {
+				break;
+			}
+			if (!contains(key) && !add_key(key)) {
+				overflow = true;
+				break;
+			}
+			start = key + 1;
+		}
+	}
+}
+
+bool SixKeySet::add_key(uint8_t key) {
+	for (size_t i = 2; i < 8; i++) {
+		if (data[i] == 0) {
+			data[i] = key;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool SixKeySet::contains(uint8_t key) {
+	for (size_t i = 2; i < 8; i++) {
+		if (data[i] == key) {
+			return true;
+		}
+	}
+	return false;
+}
+
+template<class KeyMatrixType, class DebouncerType>
+Keys<KeyMatrixType, DebouncerType>::Keys(KeyMatrixType *key_matrix): key_matrix(key_matrix) {
 	// TODO
 	key_matrix->enable();
 	// Pre-select the first row for the next poll() call.
 	key_matrix->transfer(0x1);
 }
 
-template<class KeyMatrixType>
-Keys<KeyMatrixType>::~Keys() {
+template<class KeyMatrixType, class DebouncerType>
+Keys<KeyMatrixType, DebouncerType>::~Keys() {
 	// TODO
+	if (any_key_interrupt) {
+		key_matrix->disable_any_key_interrupt();
+	}
 	key_matrix->disable();
 }
 
-template<class KeyMatrixType>
-void Keys<KeyMatrixType>::get_state(KeyBitmap *state) {
+template<class KeyMatrixType, class DebouncerType>
+void Keys<KeyMatrixType, DebouncerType>::get_state(KeyBitmap *state) {
 	// TODO
 	for (uint8_t i = 0; i < 8; i++) {
 		state->keys[i] = bitmap_debounced.keys[i];
 	}
 }
 
-template<class KeyMatrixType>
-void Keys<KeyMatrixType>::poll(int interval_ms) {
-	// TODO: Should poll() return a bool to signal whether any keys have
-	// changed?
-	static uint16_t row_pattern = 0x1;
+template<class KeyMatrixType, class DebouncerType>
+bool Keys<KeyMatrixType, DebouncerType>::poll(int interval_ms,
+                                              KeyBitmap *changed) {
 	KeyBitmap bitmap_temp;
 
-	// Read the matrix:
-	for (uint8_t i = 0; i < ROWS; i++) {
-		// Set row_pattern to set the next row in the transfer:
-		if (row_pattern != 0x20) {
-			row_pattern = row_pattern << 1;
-		} else {
-			row_pattern = 0x1;
-		}
-
-		key_matrix->select_row();
+	if (idle) {
+		// All rows are selected, so a single transfer is sufficient to
+		// check whether any key is pressed. The transfer keeps all rows
+		// selected.
 		key_matrix->load_input();
-		uint16_t temp = key_matrix->transfer(row_pattern);
-
-		// Map keys.
-		for (uint16_t j = 0; j < 16; j++) {
-			if ((temp & (1 << j)) != 0) {
-				bitmap_temp.set_bit(key_matrix_locations[i][j]);
+		if (key_matrix->transfer(ALL_ROWS) == 0) {
+			if (changed != NULL) {
+				*changed = KeyBitmap();
 			}
+			return false;
 		}
-
+		leave_idle_mode();
 	}
 
-	uint8_t times_to_shift;
+	// Read the matrix:
+	uint32_t scan_time = k_cycle_get_32();
+	uint16_t rows[ROWS];
+	key_matrix->scan_all(rows);
+	map_rows(rows, &bitmap_temp);
 
-	for (uint8_t i = 0; i < 5; i++) {
+	// Remember when the raw state first deviated from the debounced state,
+	// so that the latency measurements include the debouncing delay.
+	if (!edge_pending && !(bitmap_temp == bitmap_debounced)) {
+		edge_pending = true;
+		edge_time = scan_time;
 	}
+
 	// Perform debouncing:
-	memcpy(bitmap_debounced_old.keys, bitmap_debounced.keys, 8*4);
-	// Shift the changes.
-	if (interval_ms >= 5) {
-		times_to_shift = 5;
-	} else {
-		times_to_shift = interval_ms;
+	KeyBitmap changed_temp;
+	debouncer.update(bitmap_temp.keys,
+	                 bitmap_debounced.keys,
+	                 changed_temp.keys,
+	                 interval_ms);
+	if (changed != NULL) {
+		*changed = changed_temp;
 	}
-	for (uint8_t i = times_to_shift; i > 0; i--) {
-		for (uint8_t j = 4; j > 0; j--) {
-			memcpy(keys_changes[j], keys_changes[j-1], 8*4);
+	if (!changed_temp.is_empty()) {
+		change_time = edge_time;
+#ifdef CONFIG_GOBOARD_LATENCY_TRACE
+		latency_trace_record(TRACE_STAGE_DEBOUNCE,
+		                     change_time,
+		                     k_cycle_get_32());
+#endif
+	}
+	// Changes which are still being debounced keep the time of the oldest
+	// edge. Chatter which is suppressed completely is forgotten.
+	if (bitmap_temp == bitmap_debounced) {
+		edge_pending = false;
+	}
+
+	// If no key is pressed and no change is being debounced, we can stop
+	// scanning the rows individually.
+	if (is_idle()) {
+		enter_idle_mode();
+	}
+
+	return !changed_temp.is_empty();
+}
+
+template<class KeyMatrixType, class DebouncerType>
+bool Keys<KeyMatrixType, DebouncerType>::is_idle() {
+	if (idle) {
+		return true;
+	}
+	uint32_t pressed = 0;
+	for (uint8_t i = 0; i < 8; i++) {
+		pressed |= bitmap_debounced.keys[i];
+	}
+	return pressed == 0 && debouncer.is_idle();
+}
+
+template<class KeyMatrixType, class DebouncerType>
+bool Keys<KeyMatrixType, DebouncerType>::can_wait_for_key() {
+	return idle && any_key_interrupt;
+}
+
+template<class KeyMatrixType, class DebouncerType>
+void Keys<KeyMatrixType, DebouncerType>::set_any_key_callback(
+		void (*callback)(void *arg), void *arg) {
+	if (any_key_interrupt) {
+		key_matrix->disable_any_key_interrupt();
+		any_key_interrupt = false;
+	}
+	any_key_callback = callback;
+	any_key_arg = arg;
+	if (idle && callback != NULL && key_matrix->has_any_key_interrupt()) {
+		key_matrix->enable_any_key_interrupt(callback, arg);
+		any_key_interrupt = true;
+	}
+}
+
+template<class KeyMatrixType, class DebouncerType>
+void Keys<KeyMatrixType, DebouncerType>::suspend(KeyBitmap *changed) {
+	// Release all keys. The debouncer does not report releases right away,
+	// so we feed it with released keys until it has settled.
+	KeyBitmap released;
+	KeyBitmap changed_temp;
+	KeyBitmap changed_total;
+	do {
+		debouncer.update(released.keys,
+		                 bitmap_debounced.keys,
+		                 changed_temp.keys,
+		                 255);
+		for (uint8_t i = 0; i < 8; i++) {
+			changed_total.keys[i] |= changed_temp.keys[i];
 		}
-		memset(keys_change0, 0, 8*4);
+	} while (!changed_temp.is_empty() || !debouncer.is_idle());
+	if (changed != NULL) {
+		*changed = changed_total;
 	}
+	edge_pending = false;
 
-	uint32_t temp[8];
+	if (!idle) {
+		enter_idle_mode();
+	}
+	// The sense line only works while the rows are driven.
+	if (!key_matrix->has_any_key_interrupt()) {
+		key_matrix->disable();
+		powered_down = true;
+	}
+}
 
+template<class KeyMatrixType, class DebouncerType>
+bool Keys<KeyMatrixType, DebouncerType>::sense_any_key() {
+	if (powered_down) {
+		// The shift registers lost their content.
+		key_matrix->enable();
+		key_matrix->transfer(ALL_ROWS);
+		key_matrix->select_row();
+	}
+	key_matrix->load_input();
+	bool pressed = key_matrix->transfer(ALL_ROWS) != 0;
+	if (powered_down) {
+		key_matrix->disable();
+	}
+	return pressed;
+}
 
-	for (uint8_t i = 0; i < 8; i ++){
-		temp[i] = keys_change1[i] | keys_change2[i] | keys_change3[i] | keys_change4[i];
+template<class KeyMatrixType, class DebouncerType>
+void Keys<KeyMatrixType, DebouncerType>::resume() {
+	if (powered_down) {
+		key_matrix->enable();
+		powered_down = false;
+		// The shift registers lost their content.
+		enter_idle_mode();
+	}
+}
 
-		bitmap_debounced.keys[i] = (temp[i] & bitmap_debounced_old.keys[i]) | (~temp[i] & bitmap_temp.keys[i]);
+template<class KeyMatrixType, class DebouncerType>
+void Keys<KeyMatrixType, DebouncerType>::enter_idle_mode() {
+	// Select all rows at once.
+	key_matrix->transfer(ALL_ROWS);
+	key_matrix->select_row();
+	idle = true;
 
-		keys_change0[i] = bitmap_debounced.keys[i] ^ bitmap_debounced_old.keys[i];
+	if (any_key_callback != NULL && key_matrix->has_any_key_interrupt()) {
+		key_matrix->enable_any_key_interrupt(any_key_callback,
+		                                     any_key_arg);
+		any_key_interrupt = true;
 	}
 }
 
+template<class KeyMatrixType, class DebouncerType>
+void Keys<KeyMatrixType, DebouncerType>::leave_idle_mode() {
+	if (any_key_interrupt) {
+		key_matrix->disable_any_key_interrupt();
+		any_key_interrupt = false;
+	}
+	idle = false;
+
+	// Pre-select the first row for the following scan.
+	key_matrix->transfer(0x1);
+}
+
 template<class KeyMatrixType>
 FunctionKeys<KeyMatrixType>::FunctionKeys(KeyMatrixType *key_matrix):
 		keys(key_matrix) {
@@ -221,13 +471,41 @@ FunctionKeys<KeyMatrixType>::FunctionKeys(KeyMatrixType *key_matrix):
 
 template<class KeyMatrixType>
 void FunctionKeys<KeyMatrixType>::get_state(KeyBitmap *state) {
-	keys.get_state(state);
+	*state = this->state;
+}
+
+template<class KeyMatrixType>
+bool FunctionKeys<KeyMatrixType>::poll(int interval_ms, KeyBitmap *changed) {
+	if (!keys.poll(interval_ms)) {
+		if (changed != NULL) {
+			*changed = KeyBitmap();
+		}
+		return false;
+	}
+
+	// The FN key changes the meaning of other keys, so the changes have to
+	// be calculated from the translated state.
+	KeyBitmap new_state;
+	keys.get_state(&new_state);
+	translate_fn_keys(&new_state);
+	KeyBitmap changed_temp;
+	for (size_t i = 0; i < ARRAY_SIZE(changed_temp.keys); i++) {
+		changed_temp.keys[i] = new_state.keys[i] ^ state.keys[i];
+	}
+	state = new_state;
+	if (changed != NULL) {
+		*changed = changed_temp;
+	}
+	return !changed_temp.is_empty();
+}
+
+void translate_fn_keys(KeyBitmap *state) {
 	if (!state->bit_is_set(FN_KEY)) {
 		return;
 	}
 
 	// Translate the F keys.
-	for (int i = 0; i < ARRAY_SIZE(f_fn_mapping); i++) {
+	for (size_t i = 0; i < ARRAY_SIZE(f_fn_mapping); i++) {
 		if (state->bit_is_set(KEY_F1 + i)) {
 			state->clear_bit(KEY_F1 + i);
 			state->set_bit(f_fn_mapping[i]);
@@ -238,17 +516,13 @@ void FunctionKeys<KeyMatrixType>::get_state(KeyBitmap *state) {
 	state->clear_bit(FN_KEY);
 }
 
-template<class KeyMatrixType>
-void FunctionKeys<KeyMatrixType>::poll(int interval_ms) {
-	keys.poll(interval_ms);
-}
-
 #ifdef CONFIG_BOARD_GOBOARD_NRF52840
 #include "key_matrix.hpp"
 template class Keys<KeyMatrix>;
 #endif
 
 #ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "key_events.hpp"
 #include "tests.hpp"
 #include <ztest.h>
 namespace tests {
@@ -296,7 +570,11 @@ namespace tests {
 		}
 
 		void disable() {
-			enabled = true;
+			enabled = false;
+		}
+
+		bool is_enabled() {
+			return enabled;
 		}
 
 		void select_row() {
@@ -304,6 +582,11 @@ namespace tests {
 				zassert_true(false,
 				             "select_row() on inactive matrix");
 			}
+			if (output_reg_state == ALL_ROWS) {
+				// "Any key" mode.
+				selected_row = ROWS;
+				return;
+			}
 			if (__builtin_popcount(output_reg_state) != 1) {
 				zassert_true(false,
 				             "not exactly one row selected");
@@ -320,7 +603,14 @@ namespace tests {
 				zassert_true(false,
 				             "load_input(), but no row selected");
 			}
-			input_reg_state = matrix_state[selected_row];
+			if (selected_row == ROWS) {
+				input_reg_state = 0;
+				for (int i = 0; i < ROWS; i++) {
+					input_reg_state |= matrix_state[i];
+				}
+			} else {
+				input_reg_state = matrix_state[selected_row];
+			}
 		}
 
 		uint16_t transfer(uint16_t out) {
@@ -333,9 +623,46 @@ namespace tests {
 			output_reg_state = out & 0x3f;
 			uint16_t result = input_reg_state;
 			input_reg_state = 0xdead;
+			transfer_count++;
 			return result;
 		}
-	private:
+
+		void scan_all(uint16_t rows[ROWS]) {
+			uint8_t row_pattern = 0x1;
+			for (int i = 0; i < ROWS; i++) {
+				if (i == ROWS - 1) {
+					row_pattern = 0x1;
+				} else {
+					row_pattern <<= 1;
+				}
+				select_row();
+				load_input();
+				rows[i] = transfer(row_pattern);
+			}
+		}
+
+		bool has_any_key_interrupt() {
+			return false;
+		}
+
+		void enable_any_key_interrupt(void (*callback)(void *arg),
+		                              void *arg) {
+			(void)callback;
+			(void)arg;
+			zassert_true(false, "mock matrix has no interrupt");
+		}
+
+		void disable_any_key_interrupt() {
+		}
+
+		/// Returns true if all rows are selected.
+		bool all_rows_selected() {
+			return selected_row == ROWS;
+		}
+
+		/// Number of calls to `transfer()`.
+		int transfer_count = 0;
+	protected:
 		bool enabled = false;
 
 		uint16_t matrix_state[6] = {0};
@@ -344,6 +671,41 @@ namespace tests {
 		int selected_row = -1;
 	};
 
+	/// Variant of `MockKeyMatrix` with a sense line which triggers an
+	/// interrupt when a key is pressed while all rows are selected.
+	class InterruptMockKeyMatrix: public MockKeyMatrix {
+	public:
+		void set_key(int row, int column) {
+			MockKeyMatrix::set_key(row, column);
+			if (callback != NULL && all_rows_selected()) {
+				callback(callback_arg);
+			}
+		}
+
+		bool has_any_key_interrupt() {
+			return true;
+		}
+
+		void enable_any_key_interrupt(void (*callback)(void *arg),
+		                              void *arg) {
+			zassert_true(all_rows_selected(),
+			             "interrupt enabled without selecting all rows");
+			this->callback = callback;
+			callback_arg = arg;
+		}
+
+		void disable_any_key_interrupt() {
+			callback = NULL;
+		}
+
+		bool interrupt_enabled() {
+			return callback != NULL;
+		}
+	private:
+		void (*callback)(void *arg) = NULL;
+		void *callback_arg = NULL;
+	};
+
 	static void key_bitmap_test(void) {
 		// Test the initial state.
 		KeyBitmap bitmap;
@@ -411,6 +773,34 @@ namespace tests {
 		zassert_true(bitmap.keys[0] == 0x80000001,
 		             "correct bit was cleared");
 		bitmap.clear_bit(100000);
+
+		// Test removal of internal scan codes.
+		bitmap.set_bit(KEY_RMETA);
+		bitmap.set_bit(FN_KEY);
+		bitmap.set_bit(FN_KEY_PAIR);
+		bitmap.set_bit(FN_KEY_TOGGLE_GAME_MODE);
+		bitmap.clear_internal_keys();
+		zassert_true(bitmap.bit_is_set(KEY_RMETA),
+		             "modifier was removed");
+		zassert_true(bitmap.bit_is_set(0), "key was removed");
+		zassert_false(bitmap.bit_is_set(FN_KEY), "FN key not removed");
+		zassert_false(bitmap.bit_is_set(FN_KEY_PAIR),
+		              "FN combination not removed");
+		zassert_false(bitmap.bit_is_set(FN_KEY_TOGGLE_GAME_MODE),
+		              "FN combination not removed");
+
+		// Consumer keys are located in two different words.
+		bitmap = KeyBitmap();
+		bitmap.set_bit(KEY_MUTE);
+		bitmap.set_bit(KEY_VOLUME_DOWN);
+		bitmap.set_bit(KEY_F12);
+		zassert_equal(bitmap.consumer_keys(),
+		              CONSUMER_KEY_MUTE | CONSUMER_KEY_VOLUME_DOWN,
+		              "wrong consumer keys");
+		bitmap.clear_consumer_keys();
+		zassert_equal(bitmap.consumer_keys(), 0,
+		              "consumer keys not removed");
+		zassert_true(bitmap.bit_is_set(KEY_F12), "key was removed");
 	}
 
 	struct SixKeyTest {
@@ -499,6 +889,75 @@ namespace tests {
 		              "empty bitmap produced wrong SixKeySet");
 	}
 
+	static void six_key_set_update_test(void) {
+		static const SixKeyTest tests[] = {
+			// Keys are added in press order.
+			{ KEY_A, 0, { 0, 0, KEY_A, 0, 0, 0, 0, 0 } },
+			{ KEY_C, 0, { 0, 0, KEY_A, KEY_C, 0, 0, 0, 0 } },
+			{ KEY_B, 0, { 0, 0, KEY_A, KEY_C, KEY_B, 0, 0, 0 } },
+			// Released keys leave a gap instead of shifting the
+			// remaining keys.
+			{ 0, KEY_A, { 0, 0, 0, KEY_C, KEY_B, 0, 0, 0 } },
+			{ KEY_D, 0, { 0, 0, KEY_D, KEY_C, KEY_B, 0, 0, 0 } },
+			{ KEY_E, 0, { 0, 0, KEY_D, KEY_C, KEY_B, KEY_E, 0, 0 } },
+			{ KEY_F, 0, { 0, 0, KEY_D, KEY_C, KEY_B, KEY_E, KEY_F, 0 } },
+			{ KEY_G, 0, { 0, 0, KEY_D, KEY_C, KEY_B, KEY_E, KEY_F, KEY_G } },
+			// Rollover: the set stays stable while more than six
+			// keys are pressed.
+			{ KEY_X, 0, { 0, 0, KEY_D, KEY_C, KEY_B, KEY_E, KEY_F, KEY_G } },
+			{ KEY_H, 0, { 0, 0, KEY_D, KEY_C, KEY_B, KEY_E, KEY_F, KEY_G } },
+			// Freed slots are filled with the waiting keys, lowest
+			// scan code first.
+			{ 0, KEY_C, { 0, 0, KEY_D, KEY_H, KEY_B, KEY_E, KEY_F, KEY_G } },
+			{ 0, KEY_D, { 0, 0, KEY_X, KEY_H, KEY_B, KEY_E, KEY_F, KEY_G } },
+			{ 0, KEY_E, { 0, 0, KEY_X, KEY_H, KEY_B, 0, KEY_F, KEY_G } },
+			// Modifiers are only reported in the modifier byte.
+			{ KEY_LCTRL, 0, { 0x01, 0, KEY_X, KEY_H, KEY_B, 0, KEY_F, KEY_G } },
+			{ KEY_RALT, 0, { 0x41, 0, KEY_X, KEY_H, KEY_B, 0, KEY_F, KEY_G } },
+			{ KEY_ESCAPE, 0, { 0x41, 0, KEY_X, KEY_H, KEY_B, KEY_ESCAPE, KEY_F, KEY_G } },
+			{ 0, KEY_LCTRL, { 0x40, 0, KEY_X, KEY_H, KEY_B, KEY_ESCAPE, KEY_F, KEY_G } },
+			// Internal keys are never reported.
+			{ FN_KEY, 0, { 0x40, 0, KEY_X, KEY_H, KEY_B, KEY_ESCAPE, KEY_F, KEY_G } },
+			{ 0, FN_KEY, { 0x40, 0, KEY_X, KEY_H, KEY_B, KEY_ESCAPE, KEY_F, KEY_G } },
+			{ 0, KEY_RALT, { 0, 0, KEY_X, KEY_H, KEY_B, KEY_ESCAPE, KEY_F, KEY_G } },
+			{ 0, KEY_X, { 0, 0, 0, KEY_H, KEY_B, KEY_ESCAPE, KEY_F, KEY_G } },
+			{ 0, KEY_H, { 0, 0, 0, 0, KEY_B, KEY_ESCAPE, KEY_F, KEY_G } },
+			{ 0, KEY_B, { 0, 0, 0, 0, 0, KEY_ESCAPE, KEY_F, KEY_G } },
+			{ 0, KEY_ESCAPE, { 0, 0, 0, 0, 0, 0, KEY_F, KEY_G } },
+			{ 0, KEY_F, { 0, 0, 0, 0, 0, 0, 0, KEY_G } },
+			{ 0, KEY_G, { 0, 0, 0, 0, 0, 0, 0, 0 } },
+		};
+
+		KeyBitmap bitmap;
+		SixKeySet six_keys;
+		for (size_t i = 0; i < ARRAY_SIZE(tests); i++) {
+			KeyBitmap changed;
+			if (tests[i].pressed != 0) {
+				bitmap.set_bit(tests[i].pressed);
+				changed.set_bit(tests[i].pressed);
+			}
+			if (tests[i].released != 0) {
+				bitmap.clear_bit(tests[i].released);
+				changed.set_bit(tests[i].released);
+			}
+			six_keys.update(bitmap, changed);
+			zassert_equal(memcmp(six_keys.data, tests[i].expected, 8),
+			              0,
+			              "wrong SixKeySet in step %d",
+			              i);
+		}
+
+		// Keys which are pressed at the same time are added in
+		// scan code order.
+		SixKeySet simultaneous;
+		bitmap.set_bit(KEY_Z);
+		bitmap.set_bit(KEY_A);
+		simultaneous.update(bitmap, bitmap);
+		uint8_t good[8] = { 0, 0, KEY_A, KEY_Z, 0, 0, 0, 0 };
+		zassert_equal(memcmp(simultaneous.data, good, 8), 0,
+		              "simultaneous keys added in wrong order");
+	}
+
 	static void assert_single_key_pressed(KeyBitmap *bitmap,
 	                                      ScanCode scan_code) {
 		for (size_t key = 0; key < sizeof(bitmap->keys) * 8; key++) {
@@ -556,6 +1015,136 @@ namespace tests {
 		}
 	}
 
+	struct DebounceStep {
+		bool raw_pressed;
+		int interval_ms;
+		bool expect_pressed;
+	};
+
+	template<class DebouncerType>
+	static void run_debounce_steps(Keys<MockKeyMatrix, DebouncerType> *keys,
+	                               MockKeyMatrix *key_matrix,
+	                               const DebounceStep *steps,
+	                               size_t step_count) {
+		int row = 2;
+		int column = 5;
+		ScanCode scan_code = key_matrix_locations[row][column];
+		for (size_t i = 0; i < step_count; i++) {
+			if (steps[i].raw_pressed) {
+				key_matrix->set_single_key(row, column);
+			} else {
+				key_matrix->clear();
+			}
+			keys->poll(steps[i].interval_ms);
+			KeyBitmap pressed;
+			keys->get_state(&pressed);
+			if (steps[i].expect_pressed) {
+				zassert_true(pressed.bit_is_set(scan_code),
+				             "key not pressed in step %d", i);
+			} else {
+				assert_no_key_pressed(&pressed);
+			}
+		}
+	}
+
+	static void eager_debouncing_test(void) {
+		MockKeyMatrix key_matrix;
+		Keys<MockKeyMatrix, EagerDebouncer> keys(&key_matrix);
+		keys.get_debouncer()->set_timing(5, 5);
+
+		static const DebounceStep eager_steps[] = {
+			// The press is reported on the first sample, and
+			// chatter is suppressed for 5ms.
+			{ true, 1, true },
+			{ false, 1, true },
+			{ false, 1, true },
+			{ false, 1, true },
+			{ false, 1, true },
+			// The release is only reported once the key has been
+			// released for 5ms.
+			{ false, 1, true },
+			{ false, 1, true },
+			{ false, 1, true },
+			{ false, 1, true },
+			{ false, 1, true },
+			{ false, 1, false },
+			// There is no lock after a release, the next press is
+			// reported immediately.
+			{ true, 1, true },
+			{ true, 10, true },
+			// Chatter during the release restarts the release
+			// window.
+			{ false, 1, true },
+			{ false, 2, true },
+			{ true, 1, true },
+			{ false, 1, true },
+			{ false, 4, true },
+			{ false, 1, false },
+			// Long intervals.
+			{ true, 50, true },
+			{ false, 50, true },
+			{ false, 50, false },
+		};
+		run_debounce_steps(&keys,
+		                   &key_matrix,
+		                   eager_steps,
+		                   ARRAY_SIZE(eager_steps));
+		zassert_true(keys.is_idle(), "eager debouncer not idle");
+
+		// The windows can be changed at runtime.
+		keys.get_debouncer()->set_timing(2, 0);
+		static const DebounceStep fast_steps[] = {
+			{ true, 1, true },
+			{ false, 1, true },
+			{ false, 1, false },
+			{ true, 1, true },
+			{ true, 1, true },
+			{ false, 1, false },
+		};
+		run_debounce_steps(&keys,
+		                   &key_matrix,
+		                   fast_steps,
+		                   ARRAY_SIZE(fast_steps));
+	}
+
+	static void change_time_test(void) {
+		MockKeyMatrix key_matrix;
+		Keys<MockKeyMatrix, EagerDebouncer> keys(&key_matrix);
+		keys.get_debouncer()->set_timing(5, 5);
+
+		// Chatter after the press is suppressed and must not be taken
+		// as the start of the next change.
+		key_matrix.set_single_key(2, 5);
+		zassert_true(keys.poll(1), "press not reported");
+		key_matrix.clear();
+		k_busy_wait(1000);
+		zassert_false(keys.poll(1), "chatter reported");
+		key_matrix.set_single_key(2, 5);
+		for (int i = 0; i < 5; i++) {
+			k_busy_wait(1000);
+			zassert_false(keys.poll(1), "unexpected change");
+		}
+
+		// The deferred release is reported with the time of the first
+		// scan which saw it.
+		key_matrix.clear();
+		uint32_t release_time = k_cycle_get_32();
+		zassert_false(keys.poll(1), "release not deferred");
+		for (int i = 0; i < 4; i++) {
+			k_busy_wait(1000);
+			zassert_false(keys.poll(1), "release not deferred");
+		}
+		k_busy_wait(1000);
+		uint32_t report_time = k_cycle_get_32();
+		zassert_true(keys.poll(1), "release not reported");
+		uint32_t change_time = keys.get_change_time();
+		zassert_true((int32_t)(change_time - release_time) >= 0,
+		             "change time before the release");
+		zassert_true(report_time - change_time >=
+		             k_us_to_cyc_floor32(5000),
+		             "debouncing delay not included");
+	}
+
 	static void key_debouncing_test(void) {
 		int row = 2;
 		int column = 5;
@@ -655,6 +1244,298 @@ namespace tests {
 		assert_no_key_pressed(&pressed);
 	}
 
+	static void key_changes_test(void) {
+		int row = 2;
+		int column = 5;
+		ScanCode scan_code = key_matrix_locations[row][column];
+		int row2 = 3;
+		int column2 = 7;
+		ScanCode scan_code2 = key_matrix_locations[row2][column2];
+
+		MockKeyMatrix key_matrix;
+		Keys<MockKeyMatrix> keys(&key_matrix);
+		KeyBitmap changed;
+		zassert_false(keys.poll(1, &changed), "change without keys");
+		assert_no_key_pressed(&changed);
+
+		// Pressed keys.
+		key_matrix.set_two_keys(row, column, row2, column2);
+		zassert_true(keys.poll(1, &changed), "press not reported");
+		assert_two_keys_pressed(&changed, scan_code, scan_code2);
+		zassert_false(keys.poll(1, &changed), "unexpected change");
+		assert_no_key_pressed(&changed);
+
+		// Released keys. Bouncing within the debouncing window is not
+		// reported as a change.
+		keys.poll(5, &changed);
+		key_matrix.set_single_key(row2, column2);
+		zassert_true(keys.poll(1, &changed), "release not reported");
+		assert_single_key_pressed(&changed, scan_code);
+		key_matrix.set_two_keys(row, column, row2, column2);
+		zassert_false(keys.poll(1, &changed), "bounce reported");
+		assert_no_key_pressed(&changed);
+		key_matrix.set_single_key(row2, column2);
+		zassert_false(keys.poll(1, &changed), "bounce reported");
+		KeyBitmap state;
+		keys.get_state(&state);
+		assert_single_key_pressed(&state, scan_code2);
+
+		// FunctionKeys reports changes of the translated keys.
+		static const size_t F1_ROW = 1;
+		static const size_t F1_COLUMN = 15;
+		static const size_t FN_ROW = 5;
+		static const size_t FN_COLUMN = 15;
+		MockKeyMatrix fn_matrix;
+		FunctionKeys<MockKeyMatrix> fn_keys(&fn_matrix);
+		fn_matrix.set_key(F1_ROW, F1_COLUMN);
+		zassert_true(fn_keys.poll(1, &changed), "press not reported");
+		assert_single_key_pressed(&changed, KEY_F1);
+		fn_keys.poll(5, &changed);
+		fn_matrix.set_key(FN_ROW, FN_COLUMN);
+		zassert_true(fn_keys.poll(1, &changed), "FN not reported");
+		assert_two_keys_pressed(&changed, KEY_F1, f_fn_mapping[0]);
+	}
+
+	static void count_any_key_callback(void *arg) {
+		(*(int *)arg)++;
+	}
+
+	static void any_key_test(void) {
+		int row = 2;
+		int column = 5;
+		ScanCode scan_code = key_matrix_locations[row][column];
+		KeyBitmap pressed;
+
+		// Without a sense line, the key matrix is still switched into
+		// "any key" mode, but the caller has to keep polling.
+		{
+			MockKeyMatrix key_matrix;
+			Keys<MockKeyMatrix> keys(&key_matrix);
+			int callback_count = 0;
+			keys.set_any_key_callback(count_any_key_callback,
+			                          &callback_count);
+			keys.poll(1);
+			zassert_true(keys.is_idle(), "keys not idle");
+			zassert_false(keys.can_wait_for_key(),
+			              "waiting possible without interrupt");
+			zassert_true(key_matrix.all_rows_selected(),
+			             "not all rows selected while idle");
+			int transfers = key_matrix.transfer_count;
+			keys.poll(1);
+			zassert_equal(key_matrix.transfer_count, transfers + 1,
+			              "idle poll() did not use a single transfer");
+			key_matrix.set_key(row, column);
+			keys.poll(1);
+			keys.get_state(&pressed);
+			assert_single_key_pressed(&pressed, scan_code);
+			zassert_false(keys.is_idle(), "keys idle while pressed");
+		}
+
+		// With a sense line, the callback is called when a key is
+		// pressed.
+		InterruptMockKeyMatrix key_matrix;
+		Keys<InterruptMockKeyMatrix> keys(&key_matrix);
+		int callback_count = 0;
+		keys.set_any_key_callback(count_any_key_callback,
+		                          &callback_count);
+		zassert_false(keys.can_wait_for_key(),
+		              "can wait for key before first poll");
+		keys.poll(1);
+		keys.get_state(&pressed);
+		assert_no_key_pressed(&pressed);
+		zassert_true(keys.can_wait_for_key(), "cannot wait for key");
+		zassert_true(key_matrix.interrupt_enabled(),
+		             "interrupt not enabled");
+		zassert_equal(callback_count, 0, "unexpected callback");
+
+		// The key press is detected by the first poll() after the
+		// interrupt.
+		key_matrix.set_key(row, column);
+		zassert_equal(callback_count, 1, "callback was not called");
+		keys.poll(1);
+		keys.get_state(&pressed);
+		assert_single_key_pressed(&pressed, scan_code);
+		zassert_false(keys.can_wait_for_key(),
+		              "can wait while key is pressed");
+		zassert_false(key_matrix.interrupt_enabled(),
+		              "interrupt enabled while key is pressed");
+
+		// The matrix only becomes idle again once the key has been
+		// released and the change has been debounced.
+		key_matrix.clear();
+		for (int i = 0; i < 4; i++) {
+			keys.poll(1);
+			keys.get_state(&pressed);
+			assert_single_key_pressed(&pressed, scan_code);
+			zassert_false(keys.is_idle(), "idle while debouncing");
+		}
+		keys.poll(1);
+		keys.get_state(&pressed);
+		assert_no_key_pressed(&pressed);
+		zassert_false(keys.is_idle(), "idle while debouncing");
+		for (int i = 0; i < 4; i++) {
+			keys.poll(1);
+			zassert_false(keys.is_idle(), "idle while debouncing");
+		}
+		keys.poll(1);
+		zassert_true(keys.can_wait_for_key(), "cannot wait for key");
+		zassert_true(key_matrix.interrupt_enabled(),
+		             "interrupt not enabled");
+
+		// Bouncing during the press is still filtered.
+		key_matrix.set_key(row, column);
+		zassert_equal(callback_count, 2, "callback was not called");
+		keys.poll(1);
+		key_matrix.clear();
+		keys.poll(1);
+		keys.get_state(&pressed);
+		assert_single_key_pressed(&pressed, scan_code);
+	}
+
+	static void suspend_test(void) {
+		int row = 2;
+		int column = 5;
+		ScanCode scan_code = key_matrix_locations[row][column];
+		KeyBitmap pressed;
+		KeyBitmap changed;
+
+		// Without a sense line, the key matrix is switched off and only
+		// powered while checking for key presses.
+		{
+			MockKeyMatrix key_matrix;
+			Keys<MockKeyMatrix> keys(&key_matrix);
+			key_matrix.set_single_key(row, column);
+			keys.poll(1);
+			keys.get_state(&pressed);
+			assert_single_key_pressed(&pressed, scan_code);
+
+			// Held keys are released.
+			keys.suspend(&changed);
+			assert_single_key_pressed(&changed, scan_code);
+			keys.get_state(&pressed);
+			assert_no_key_pressed(&pressed);
+			zassert_false(key_matrix.is_enabled(),
+			              "key matrix powered while suspended");
+
+			zassert_true(keys.sense_any_key(), "key not sensed");
+			zassert_false(key_matrix.is_enabled(),
+			              "key matrix powered after sensing");
+			key_matrix.clear();
+			zassert_false(keys.sense_any_key(), "unexpected key");
+
+			// After resuming, key presses are detected again.
+			keys.resume();
+			zassert_true(key_matrix.is_enabled(),
+			             "key matrix not powered after resume");
+			key_matrix.set_single_key(row, column);
+			keys.poll(1);
+			keys.get_state(&pressed);
+			assert_single_key_pressed(&pressed, scan_code);
+		}
+
+		// With a sense line, the key matrix stays powered and the
+		// callback signals key presses.
+		InterruptMockKeyMatrix key_matrix;
+		Keys<InterruptMockKeyMatrix> keys(&key_matrix);
+		int callback_count = 0;
+		keys.set_any_key_callback(count_any_key_callback,
+		                          &callback_count);
+		keys.poll(1);
+		keys.suspend();
+		zassert_true(key_matrix.is_enabled(),
+		             "key matrix not powered while suspended");
+		zassert_true(keys.can_wait_for_key(), "cannot wait for key");
+		key_matrix.set_key(row, column);
+		zassert_equal(callback_count, 1, "callback was not called");
+		zassert_true(keys.sense_any_key(), "key not sensed");
+		keys.resume();
+		keys.poll(1);
+		keys.get_state(&pressed);
+		assert_single_key_pressed(&pressed, scan_code);
+	}
+
+	/// Returns a timestamp for benchmarks.
+	///
+	/// On native_posix, the kernel cycle counter is simulated and does not
+	/// advance during computation, so the host's time stamp counter is used
+	/// instead where available.
+	static inline uint64_t benchmark_timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+		return __builtin_ia32_rdtsc();
+#else
+		return k_cycle_get_32();
+#endif
+	}
+
+	/// Previous implementation of `map_rows()` which tests every single
+	/// bit and calls `KeyBitmap::set_bit()`.
+	static void map_rows_per_bit(const uint16_t rows[ROWS],
+	                             KeyBitmap *bitmap) {
+		for (uint8_t i = 0; i < ROWS; i++) {
+			for (uint16_t j = 0; j < 16; j++) {
+				if ((rows[i] & (1 << j)) != 0) {
+					bitmap->set_bit(key_matrix_locations[i][j]);
+				}
+			}
+		}
+	}
+
+	static void key_mapping_benchmark(void) {
+		static const int ITERATIONS = 10000;
+		struct {
+			const char *name;
+			uint16_t rows[ROWS];
+		} inputs[] = {
+			{ "no keys", { 0, 0, 0, 0, 0, 0 } },
+			{ "two keys", { 0, 0, 0x20, 0, 0x4000, 0 } },
+			{ "all keys", { 0xffff, 0xffff, 0xffff,
+			                0xffff, 0xffff, 0xffff } },
+		};
+
+		for (size_t i = 0; i < ARRAY_SIZE(inputs); i++) {
+			// Both implementations have to produce identical results.
+			KeyBitmap expected, actual;
+			map_rows_per_bit(inputs[i].rows, &expected);
+			map_rows(inputs[i].rows, &actual);
+			zassert_true(expected == actual,
+			             "map_rows() differs for %s",
+			             inputs[i].name);
+
+			volatile uint32_t sink = 0;
+			uint64_t start = benchmark_timestamp();
+			for (int j = 0; j < ITERATIONS; j++) {
+				KeyBitmap bitmap;
+				map_rows_per_bit(inputs[i].rows, &bitmap);
+				sink = sink + bitmap.keys[j & 7];
+			}
+			uint64_t per_bit = benchmark_timestamp() - start;
+			start = benchmark_timestamp();
+			for (int j = 0; j < ITERATIONS; j++) {
+				KeyBitmap bitmap;
+				map_rows(inputs[i].rows, &bitmap);
+				sink = sink + bitmap.keys[j & 7];
+			}
+			uint64_t table = benchmark_timestamp() - start;
+			printk("key mapping (%s): per-bit %u, table %u cycles\n",
+			       inputs[i].name,
+			       (unsigned int)(per_bit / ITERATIONS),
+			       (unsigned int)(table / ITERATIONS));
+		}
+
+		// Complete poll() including debouncing, with the key matrix
+		// held busy so that it never enters "any key" mode.
+		MockKeyMatrix key_matrix;
+		key_matrix.set_two_keys(2, 5, 4, 14);
+		Keys<MockKeyMatrix> keys(&key_matrix);
+		uint64_t start = benchmark_timestamp();
+		for (int j = 0; j < ITERATIONS; j++) {
+			keys.poll(1);
+		}
+		uint64_t poll = benchmark_timestamp() - start;
+		printk("poll() with two keys: %u cycles\n",
+		       (unsigned int)(poll / ITERATIONS));
+	}
+
 	static void fn_key_test(void) {
 		// Test pass-through of all keys except for FN.
 		for (int row = 0; row < 6; row++) {
@@ -714,6 +1595,72 @@ namespace tests {
 		            "FN+F1 was not translated");
 	}
 
+	/// Scans until the debouncer reports the change, then publishes the
+	/// translated state like the key scanner and applies the events like
+	/// the keyboard implementations.
+	static bool publish_translated(Keys<MockKeyMatrix> *keys,
+	                               KeyEventQueue *queue,
+	                               KeyBitmap *report_state,
+	                               KeyBitmap *changed) {
+		for (int i = 0; i < 100 && !keys->poll(1); i++) {
+		}
+		KeyBitmap state;
+		keys->get_state(&state);
+		translate_fn_keys(&state);
+		queue->publish(state, 0);
+		return queue->drain(report_state, changed);
+	}
+
+	static void fn_consumer_report_test(void) {
+		static const size_t F10_ROW = 1;
+		static const size_t F10_COLUMN = 5;
+		static const size_t FN_ROW = 5;
+		static const size_t FN_COLUMN = 15;
+		MockKeyMatrix key_matrix;
+		Keys<MockKeyMatrix> keys(&key_matrix);
+		KeyEventQueue queue;
+		KeyBitmap report_state;
+		KeyBitmap changed;
+
+		// The FN key alone does not cause any report.
+		key_matrix.set_key(FN_ROW, FN_COLUMN);
+		zassert_false(publish_translated(&keys,
+		                                 &queue,
+		                                 &report_state,
+		                                 &changed),
+		              "FN key published");
+
+		// FN+F10 only changes the consumer report. The keyboards send
+		// a keyboard report if any other key changed.
+		key_matrix.set_key(F10_ROW, F10_COLUMN);
+		zassert_true(publish_translated(&keys,
+		                                &queue,
+		                                &report_state,
+		                                &changed),
+		             "FN+F10 not published");
+		zassert_equal(changed.consumer_keys(), CONSUMER_KEY_MUTE,
+		              "no consumer report");
+		KeyBitmap keyboard_changed = changed;
+		keyboard_changed.clear_consumer_keys();
+		zassert_true(keyboard_changed.is_empty(), "keyboard report");
+		zassert_false(report_state.bit_is_set(KEY_F10), "F10 pressed");
+
+		// Releasing F10 releases the consumer key again.
+		key_matrix.clear_key(F10_ROW, F10_COLUMN);
+		zassert_true(publish_translated(&keys,
+		                                &queue,
+		                                &report_state,
+		                                &changed),
+		             "release not published");
+		zassert_equal(changed.consumer_keys(), CONSUMER_KEY_MUTE,
+		              "no consumer report");
+		zassert_equal(report_state.consumer_keys(), 0,
+		              "mute still pressed");
+		keyboard_changed = changed;
+		keyboard_changed.clear_consumer_keys();
+		zassert_true(keyboard_changed.is_empty(), "keyboard report");
+	}
+
 	static void numpad_test(void) {
 		// TODO
 	}
@@ -722,9 +1669,17 @@ namespace tests {
 		ztest_test_suite(keys,
 			ztest_unit_test(key_bitmap_test),
 			ztest_unit_test(six_key_set_test),
+			ztest_unit_test(six_key_set_update_test),
 			ztest_unit_test(key_mapping_test),
 			ztest_unit_test(key_debouncing_test),
+			ztest_unit_test(eager_debouncing_test),
+			ztest_unit_test(change_time_test),
+			ztest_unit_test(key_changes_test),
+			ztest_unit_test(any_key_test),
+			ztest_unit_test(suspend_test),
+			ztest_unit_test(key_mapping_benchmark),
 			ztest_unit_test(fn_key_test),
+			ztest_unit_test(fn_consumer_report_test),
 			ztest_unit_test(numpad_test)
 		);
 		ztest_run_test_suite(keys);
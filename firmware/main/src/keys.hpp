@@ -1,6 +1,7 @@
 #ifndef KEYS_HPP_INCLUDED
 #define KEYS_HPP_INCLUDED
 
+#include "debounce.hpp"
 #include "scan_code.hpp"
 
 #include <sys/util.h>
@@ -8,16 +9,46 @@
 #include <stdint.h>
 #include <stddef.h>
 
+class KeyBitmap;
+
+/// Keys which are reported via the HID consumer page instead of the keyboard
+/// page, as most hosts ignore the corresponding keyboard page usages.
+enum ConsumerKey {
+	CONSUMER_KEY_MUTE = 1 << 0,
+	CONSUMER_KEY_VOLUME_UP = 1 << 1,
+	CONSUMER_KEY_VOLUME_DOWN = 1 << 2,
+};
+
 /// Set of a modifier byte and up to 6 pressed scan codes as required for the
 /// HID boot protocol.
+///
+/// The set can either be built from scratch via `KeyBitmap::to_6kro()` or be
+/// maintained incrementally via `update()`. In the latter case, every key keeps
+/// its slot for as long as it is pressed, and new keys are added in the order
+/// in which they are pressed. If more than six keys are pressed, the additional
+/// keys are not reported until a slot becomes free. Then, the waiting key with
+/// the lowest scan code is added.
 class SixKeySet {
 public:
 	SixKeySet() {}
 
+	/// Updates the set after a change of the key state.
+	///
+	/// @param state Current state of all keys.
+	/// @param changed Keys which changed since the last call, i.e., the XOR
+	///                of the previous and the current state.
+	void update(const KeyBitmap &state, const KeyBitmap &changed);
+
 	/// HID boot protocol report - the first byte contains the modifier
 	/// keys, the second byte is reserved and the remaining bytes contain
 	/// the pressed keys.
 	uint8_t data[8] = {0};
+private:
+	bool add_key(uint8_t key);
+	bool contains(uint8_t key);
+
+	/// True if keys are pressed which are not part of the set.
+	bool overflow = false;
 };
 
 /// Bitmap containing the state of all keys indexed by HID scan code.
@@ -47,7 +78,7 @@ public:
 	}
 
 	/// Tests whether a single key is pressed.
-	bool bit_is_set(size_t scan_code) {
+	bool bit_is_set(size_t scan_code) const {
 		uint32_t word = scan_code >> 5;
 		if (word >= ARRAY_SIZE(keys)) {
 			return false;
@@ -60,7 +91,7 @@ public:
 	///
 	/// The position specified by `start` is included by the search. If no
 	/// pressed key is found, the function returns -1.
-	int next_set_bit(unsigned int start) {
+	int next_set_bit(unsigned int start) const {
 		while (start < sizeof(keys) * 8) {
 			uint32_t word = start >> 5;
 			uint32_t bit = start & 0x1f;
@@ -76,6 +107,33 @@ public:
 		return -1;
 	}
 
+	/// Clears all non-HID scan codes (FN key combinations) which must not
+	/// be sent to the host.
+	///
+	/// All internal scan codes are located at the end of the bitmap,
+	/// starting at `FN_KEY`.
+	void clear_internal_keys() {
+		keys[FN_KEY >> 5] &= (1u << (FN_KEY & 0x1f)) - 1;
+		for (size_t i = (FN_KEY >> 5) + 1; i < ARRAY_SIZE(keys); i++) {
+			keys[i] = 0;
+		}
+	}
+
+	/// Returns the pressed consumer keys as a bitmask of `ConsumerKey`
+	/// values.
+	uint8_t consumer_keys() const {
+		return (bit_is_set(KEY_MUTE) ? CONSUMER_KEY_MUTE : 0) |
+		       (bit_is_set(KEY_VOLUME_UP) ? CONSUMER_KEY_VOLUME_UP : 0) |
+		       (bit_is_set(KEY_VOLUME_DOWN) ? CONSUMER_KEY_VOLUME_DOWN : 0);
+	}
+
+	/// Clears all keys which are reported via the consumer page.
+	void clear_consumer_keys() {
+		clear_bit(KEY_MUTE);
+		clear_bit(KEY_VOLUME_UP);
+		clear_bit(KEY_VOLUME_DOWN);
+	}
+
 	SixKeySet to_6kro() {
 		SixKeySet six_keys;
 		// The modifier byte is found at position 0xe0 (KEY_LCTRL) in
@@ -106,6 +164,15 @@ public:
 		return six_keys;
 	}
 
+	/// Returns true if no bit is set.
+	bool is_empty() const {
+		uint32_t any = 0;
+		for (size_t i = 0; i < ARRAY_SIZE(keys); i++) {
+			any |= keys[i];
+		}
+		return any == 0;
+	}
+
 	bool operator==(const KeyBitmap &other) {
 		for (size_t i = 0; i < ARRAY_SIZE(keys); i++) {
 			if (keys[i] != other.keys[i]) {
@@ -121,15 +188,32 @@ public:
 	uint32_t keys[8] = {0};
 };
 
+#ifdef CONFIG_GOBOARD_DEBOUNCE_EAGER
+typedef EagerDebouncer DefaultDebouncer;
+#else
+typedef SymmetricDebouncer DefaultDebouncer;
+#endif
+
 /// Key state collection and debouncing.
 ///
 /// This class collects all keys from the main key matrix and the numpad, and it
-/// implements 5ms switch debouncing for the former.
+/// implements switch debouncing for the former. The debouncing algorithm is
+/// selected via `DebouncerType`, see `SymmetricDebouncer` and
+/// `EagerDebouncer`. By default, the algorithm is selected at build time.
+///
+/// While no key is pressed or being debounced, the key matrix is switched into
+/// an "any key" mode where all rows are selected at once. In this mode,
+/// `poll()` only performs a single transfer to check whether any key has been
+/// pressed, and if the key matrix has a sense line, callers can stop calling
+/// `poll()` altogether until the callback set with `set_any_key_callback()` is
+/// called.
 ///
 /// The output of this class should never be fed directly to the host as it
 /// lacks interpretation of FN key combinations and instead reports a raw
-/// non-standard FN key. Instead, `FunctionKeys` should be used.
-template<class KeyMatrixType> class Keys {
+/// non-standard FN key. Instead, `FunctionKeys` should be used, or the state
+/// has to be passed through `translate_fn_keys()`.
+template<class KeyMatrixType, class DebouncerType = DefaultDebouncer>
+class Keys {
 public:
 	// TODO: Numpad connection.
 	Keys(KeyMatrixType *key_matrix);
@@ -141,25 +225,107 @@ public:
 	/// Polls all keys and applies debouncing.
 	///
 	/// @param interval_ms Milliseconds since the last call to `poll()`.
-	void poll(int interval_ms);
+	/// @param changed If not NULL, receives the keys whose debounced state
+	///                has changed, i.e., pressed and released keys.
+	/// @return True if the state of any key has changed.
+	bool poll(int interval_ms, KeyBitmap *changed = NULL);
+
+	/// Returns the time at which the change reported by the last call to
+	/// `poll()` was first seen in the raw key state.
+	///
+	/// The debouncer can defer a change by several scans (e.g., the release
+	/// window of `EagerDebouncer`), so this time is earlier than the scan
+	/// which reported the change. If multiple keys change while another
+	/// change is being debounced, the time of the oldest change is
+	/// returned.
+	///
+	/// @return Cycle counter value (`k_cycle_get_32()`).
+	uint32_t get_change_time() {
+		return change_time;
+	}
+
+	/// Returns true if no key is pressed or being debounced.
+	///
+	/// In this state, the key matrix is in "any key" mode and the key state
+	/// can only change once a key is pressed.
+	bool is_idle();
+
+	/// Returns true if the key matrix is idle and the callback set via
+	/// `set_any_key_callback()` will be called once a key is pressed.
+	///
+	/// If this function returns true, the caller does not need to call
+	/// `poll()` until the callback has been called.
+	bool can_wait_for_key();
+
+	/// Sets a callback which is called when a key is pressed while the
+	/// key matrix is idle.
+	///
+	/// The callback is called from an interrupt handler. It is only ever
+	/// called if the key matrix has a sense line.
+	void set_any_key_callback(void (*callback)(void *arg), void *arg);
+
+	/// Switches the key matrix into a low-power mode, e.g., while the USB
+	/// host is suspended.
+	///
+	/// All keys are released immediately. If the key matrix has a sense
+	/// line, it stays powered with all rows selected so that the callback
+	/// set with `set_any_key_callback()` is called once a key is pressed.
+	/// Otherwise, the key matrix is switched off and is only powered for the
+	/// duration of each call to `sense_any_key()`.
+	///
+	/// `poll()` must not be called until `resume()` has been called.
+	///
+	/// @param changed If not NULL, receives the keys which were released.
+	void suspend(KeyBitmap *changed = NULL);
+
+	/// Returns true if any key is pressed while the key matrix is in
+	/// low-power mode.
+	///
+	/// No debouncing is applied.
+	bool sense_any_key();
+
+	/// Leaves the low-power mode entered by `suspend()`.
+	void resume();
+
+	/// Returns the debouncer, e.g., to change the debouncing timing at
+	/// runtime.
+	///
+	/// The debouncer must not be modified concurrently to `poll()`.
+	DebouncerType *get_debouncer() {
+		return &debouncer;
+	}
 
 private:
+	void enter_idle_mode();
+	void leave_idle_mode();
+
 	KeyMatrixType *key_matrix;
-	KeyBitmap bitmap_debounced_old;
+	/// True if all rows of the key matrix are selected because no key is
+	/// pressed.
+	bool idle = false;
+	/// True if the interrupt of the key matrix is enabled.
+	bool any_key_interrupt = false;
+	/// True if the key matrix is in low-power mode and switched off.
+	bool powered_down = false;
+	void (*any_key_callback)(void *arg) = NULL;
+	void *any_key_arg = NULL;
 	KeyBitmap bitmap_debounced;
+	/// True if the raw key state has differed from the debounced state
+	/// since `edge_time`.
+	bool edge_pending = false;
+	uint32_t edge_time = 0;
+	uint32_t change_time = 0;
 
-	uint32_t keys_change0[8] = {0};
-	uint32_t keys_change1[8] = {0};
-	uint32_t keys_change2[8] = {0};
-	uint32_t keys_change3[8] = {0};
-	uint32_t keys_change4[8] = {0};
-	uint32_t * const keys_changes[5] = {keys_change0,
-	                                    keys_change1,
-	                                    keys_change2,
-	                                    keys_change3,
-	                                    keys_change4};
+	DebouncerType debouncer;
 };
 
+/// Interprets the FN key combinations in a raw key state.
+///
+/// While the FN key is pressed, some of the F keys are replaced by different
+/// scan codes, e.g., FN+F10 is replaced by `KEY_MUTE`. The FN key itself is
+/// removed.
+void translate_fn_keys(KeyBitmap *state);
+
 /// Wrapper around `Keys` which correctly interprets FN key combinations.
 ///
 /// While the FN key is pressed, some of the F keys are mapped to different
@@ -175,9 +341,14 @@ public:
 	/// Polls all keys.
 	///
 	/// @param interval_ms Milliseconds since the last call to `poll()`.
-	void poll(int interval_ms);
+	/// @param changed If not NULL, receives the keys whose translated state
+	///                has changed.
+	/// @return True if the state of any key has changed.
+	bool poll(int interval_ms, KeyBitmap *changed = NULL);
 private:
 	Keys<KeyMatrixType> keys;
+	/// Translated state after the last call to `poll()`.
+	KeyBitmap state;
 };
 
 #ifdef CONFIG_BOARD_GOBOARD_NRF52840
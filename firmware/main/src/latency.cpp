@@ -0,0 +1,78 @@
+#include "latency.hpp"
+
+void LatencyStatistics::get(LatencySummary *summary, uint32_t frequency) {
+	summary->count = count;
+	if (count == 0) {
+		summary->min_ns = 0;
+		summary->max_ns = 0;
+		summary->mean_ns = 0;
+		return;
+	}
+	summary->min_ns = (uint64_t)min * 1000000000 / frequency;
+	summary->max_ns = (uint64_t)max * 1000000000 / frequency;
+	summary->mean_ns = sum * 1000000000 / frequency / count;
+}
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	static void latency_statistics_test(void) {
+		LatencyStatistics statistics;
+		LatencySummary summary;
+		statistics.get(&summary, 1000000);
+		zassert_equal(summary.count, 0, "wrong count");
+		zassert_equal(summary.max_ns, 0, "wrong maximum");
+
+		statistics.add(2);
+		statistics.add(10);
+		statistics.add(3);
+		statistics.get(&summary, 1000000);
+		zassert_equal(summary.count, 3, "wrong count");
+		zassert_equal(summary.min_ns, 2000, "wrong minimum");
+		zassert_equal(summary.max_ns, 10000, "wrong maximum");
+		zassert_equal(summary.mean_ns, 5000, "wrong mean");
+
+		statistics.reset();
+		statistics.get(&summary, 1000000);
+		zassert_equal(summary.count, 0, "statistics not reset");
+	}
+
+	static void latency_histogram_test(void) {
+		LatencyHistogram histogram;
+		histogram.add(0);
+		histogram.add(1);
+		histogram.add(2);
+		histogram.add(3);
+		histogram.add(4);
+		histogram.add(1000);
+		histogram.add(UINT32_MAX);
+		zassert_equal(histogram.get(0), 1, "wrong bin for 0us");
+		zassert_equal(histogram.get(1), 1, "wrong bin for 1us");
+		zassert_equal(histogram.get(2), 2, "wrong bin for 2-3us");
+		zassert_equal(histogram.get(3), 1, "wrong bin for 4-7us");
+		// 1000us is between 512us and 1023us.
+		zassert_equal(histogram.get(10), 1, "wrong bin for 1000us");
+		zassert_equal(histogram.get(LATENCY_HISTOGRAM_BINS - 1), 1,
+		              "long latency not in the last bin");
+		zassert_equal(LatencyHistogram::bin_start_us(0), 0,
+		              "wrong start of the first bin");
+		zassert_equal(LatencyHistogram::bin_start_us(10), 512,
+		              "wrong bin start");
+
+		histogram.reset();
+		for (size_t i = 0; i < LATENCY_HISTOGRAM_BINS; i++) {
+			zassert_equal(histogram.get(i), 0, "histogram not reset");
+		}
+	}
+
+	static void latency_tests() {
+		ztest_test_suite(latency,
+			ztest_unit_test(latency_statistics_test),
+			ztest_unit_test(latency_histogram_test)
+		);
+		ztest_run_test_suite(latency);
+	}
+	RegisterTests latency_tests_(latency_tests);
+}
+#endif
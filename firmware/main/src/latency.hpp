@@ -0,0 +1,89 @@
+#ifndef LATENCY_HPP_INCLUDED
+#define LATENCY_HPP_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LATENCY_HISTOGRAM_BINS 16
+
+/// Summary of a number of latency measurements.
+struct LatencySummary {
+	/// Number of measurements.
+	uint32_t count;
+	uint32_t min_ns;
+	uint32_t max_ns;
+	uint32_t mean_ns;
+};
+
+/// Minimum, maximum and average of a number of latency measurements.
+///
+/// The measurements are passed in the unit of the clock used for the
+/// measurement and are only converted to nanoseconds by `get()`, so `add()` is
+/// cheap enough to be called from interrupt handlers. The class is not
+/// thread-safe.
+class LatencyStatistics {
+public:
+	LatencyStatistics() {}
+
+	void reset() {
+		count = 0;
+		sum = 0;
+		min = UINT32_MAX;
+		max = 0;
+	}
+
+	void add(uint32_t latency) {
+		count++;
+		sum += latency;
+		min = latency < min ? latency : min;
+		max = latency > max ? latency : max;
+	}
+
+	/// Converts the statistics to nanoseconds.
+	///
+	/// @param frequency Frequency of the clock used for the measurements.
+	void get(LatencySummary *summary, uint32_t frequency);
+private:
+	uint32_t count = 0;
+	uint64_t sum = 0;
+	uint32_t min = UINT32_MAX;
+	uint32_t max = 0;
+};
+
+/// Histogram of latency measurements with logarithmic bins.
+///
+/// Bin 0 counts latencies below 1us, bin n counts latencies from 2^(n-1)us to
+/// 2^n-1us, and the last bin additionally counts all longer latencies. Like
+/// `LatencyStatistics`, the class is not thread-safe.
+class LatencyHistogram {
+public:
+	LatencyHistogram() {}
+
+	void reset() {
+		for (size_t i = 0; i < LATENCY_HISTOGRAM_BINS; i++) {
+			bins[i] = 0;
+		}
+	}
+
+	void add(uint32_t latency_us) {
+		size_t bin = latency_us == 0 ? 0 : 32 - __builtin_clz(latency_us);
+		if (bin >= LATENCY_HISTOGRAM_BINS) {
+			bin = LATENCY_HISTOGRAM_BINS - 1;
+		}
+		bins[bin]++;
+	}
+
+	/// Returns the number of measurements in a bin.
+	uint32_t get(size_t bin) {
+		return bins[bin];
+	}
+
+	/// Returns the shortest latency counted in a bin.
+	static uint32_t bin_start_us(size_t bin) {
+		return bin == 0 ? 0 : 1u << (bin - 1);
+	}
+private:
+	uint32_t bins[LATENCY_HISTOGRAM_BINS] = {0};
+};
+
+#endif
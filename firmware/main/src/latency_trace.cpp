@@ -0,0 +1,90 @@
+#include "latency_trace.hpp"
+
+#ifdef CONFIG_GOBOARD_LATENCY_TRACE
+
+#include "latency.hpp"
+
+#include <init.h>
+#include <kernel.h>
+
+static const char *const stage_names[TRACE_STAGE_COUNT] = {
+	"debounce",
+	"report",
+	"transfer",
+	"total",
+};
+
+static LatencyStatistics statistics[TRACE_STAGE_COUNT];
+static LatencyHistogram histograms[TRACE_STAGE_COUNT];
+
+void latency_trace_record(LatencyTraceStage stage,
+                          uint32_t start_time,
+                          uint32_t end_time) {
+	uint32_t cycles = end_time - start_time;
+	uint32_t latency_us = k_cyc_to_us_floor32(cycles);
+	// The transfer stages are recorded from the USB interrupt handler.
+	unsigned int key = irq_lock();
+	statistics[stage].add(cycles);
+	histograms[stage].add(latency_us);
+	irq_unlock(key);
+}
+
+void latency_trace_print() {
+	for (size_t stage = 0; stage < TRACE_STAGE_COUNT; stage++) {
+		// Copy the data so that printing does not block the interrupt
+		// handlers.
+		unsigned int key = irq_lock();
+		LatencyStatistics stage_statistics = statistics[stage];
+		LatencyHistogram histogram = histograms[stage];
+		irq_unlock(key);
+
+		LatencySummary summary;
+		stage_statistics.get(&summary, sys_clock_hw_cycles_per_sec());
+		printk("latency %s: %u samples, %u-%uns, mean %uns\n",
+		       stage_names[stage],
+		       summary.count,
+		       summary.min_ns,
+		       summary.max_ns,
+		       summary.mean_ns);
+		for (size_t i = 0; i < LATENCY_HISTOGRAM_BINS; i++) {
+			if (histogram.get(i) != 0) {
+				printk("  >=%uus: %u\n",
+				       LatencyHistogram::bin_start_us(i),
+				       histogram.get(i));
+			}
+		}
+	}
+}
+
+void latency_trace_reset() {
+	unsigned int key = irq_lock();
+	for (size_t stage = 0; stage < TRACE_STAGE_COUNT; stage++) {
+		statistics[stage].reset();
+		histograms[stage].reset();
+	}
+	irq_unlock(key);
+}
+
+#if CONFIG_GOBOARD_LATENCY_TRACE_LOG_INTERVAL > 0
+static struct k_work_delayable log_work;
+
+static void on_log_work(struct k_work *work) {
+	(void)work;
+	latency_trace_print();
+	k_work_schedule(&log_work,
+	                K_SECONDS(CONFIG_GOBOARD_LATENCY_TRACE_LOG_INTERVAL));
+}
+
+static int start_latency_trace_log(const struct device *dev) {
+	(void)dev;
+	k_work_init_delayable(&log_work, on_log_work);
+	k_work_schedule(&log_work,
+	                K_SECONDS(CONFIG_GOBOARD_LATENCY_TRACE_LOG_INTERVAL));
+	return 0;
+}
+SYS_INIT(start_latency_trace_log,
+         APPLICATION,
+         CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+#endif
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef LATENCY_TRACE_HPP_INCLUDED
+#define LATENCY_TRACE_HPP_INCLUDED
+
+#ifdef CONFIG_GOBOARD_LATENCY_TRACE
+
+#include <stdint.h>
+
+/// Stages of the path from the key matrix to the host.
+///
+/// All timestamps are taken with `k_cycle_get_32()`.
+enum LatencyTraceStage {
+	/// From the first scan which saw a change in the raw key state to the
+	/// debouncer reporting the change.
+	TRACE_STAGE_DEBOUNCE,
+	/// From the first scan which saw the change to the report being
+	/// written to the endpoint.
+	TRACE_STAGE_REPORT,
+	/// From writing the report to the host fetching it.
+	TRACE_STAGE_TRANSFER,
+	/// From the first scan which saw the change to the host fetching the
+	/// report.
+	TRACE_STAGE_TOTAL,
+	TRACE_STAGE_COUNT
+};
+
+/// Adds a measurement to the statistics and the histogram of a stage.
+///
+/// The function can be called from interrupt handlers.
+void latency_trace_record(LatencyTraceStage stage,
+                          uint32_t start_time,
+                          uint32_t end_time);
+
+/// Prints the statistics and histograms of all stages to the console.
+void latency_trace_print();
+
+/// Discards all measurements.
+void latency_trace_reset();
+
+#endif
+
+#endif
@@ -1,11 +1,33 @@
 #include "leds.hpp"
 
+#include "gpio.hpp"
+
+#define CAPS_LOCK_LED DT_ALIAS(caps_lock_led)
+#define CAPS_LOCK_LABEL DT_GPIO_LABEL(CAPS_LOCK_LED, gpios)
+#define CAPS_LOCK_PIN DT_GPIO_PIN(CAPS_LOCK_LED, gpios)
+#define CAPS_LOCK_FLAGS DT_GPIO_FLAGS(CAPS_LOCK_LED, gpios)
+
+#define SCROLL_LOCK_LED DT_ALIAS(scroll_lock_led)
+#define SCROLL_LOCK_LABEL DT_GPIO_LABEL(SCROLL_LOCK_LED, gpios)
+#define SCROLL_LOCK_PIN DT_GPIO_PIN(SCROLL_LOCK_LED, gpios)
+#define SCROLL_LOCK_FLAGS DT_GPIO_FLAGS(SCROLL_LOCK_LED, gpios)
+
 Leds::Leds() {
-	// TODO
+	caps_lock_gpio = init_output_gpio(CAPS_LOCK_LABEL,
+	                                  CAPS_LOCK_PIN,
+	                                  CAPS_LOCK_FLAGS);
+	scroll_lock_gpio = init_output_gpio(SCROLL_LOCK_LABEL,
+	                                    SCROLL_LOCK_PIN,
+	                                    SCROLL_LOCK_FLAGS);
+	k_work_init(&update, static_on_update);
+	// TODO: Mode LED.
 }
 
 Leds::~Leds() {
-	// TODO
+	struct k_work_sync sync;
+	k_work_cancel_sync(&update, &sync);
+	gpio_pin_set(caps_lock_gpio, CAPS_LOCK_PIN, false);
+	gpio_pin_set(scroll_lock_gpio, SCROLL_LOCK_PIN, false);
 }
 
 void Leds::set_mode(ModeLed mode) {
@@ -13,12 +35,49 @@ void Leds::set_mode(ModeLed mode) {
 	// TODO
 }
 
+void Leds::set_keyboard_leds(uint8_t leds) {
+	atomic_set(&requested, leds);
+	// If the work item is already pending, the GPIOs are updated with the
+	// latest state anyway.
+	k_work_submit(&update);
+}
+
 void Leds::set_caps_lock(bool caps_lock) {
-	ARG_UNUSED(caps_lock);
-	// TODO
+	if (caps_lock) {
+		atomic_or(&requested, KEYBOARD_LED_CAPS_LOCK);
+	} else {
+		atomic_and(&requested, ~KEYBOARD_LED_CAPS_LOCK);
+	}
+	k_work_submit(&update);
 }
 
 void Leds::set_scroll_lock(bool scroll_lock) {
-	ARG_UNUSED(scroll_lock);
-	// TODO
+	if (scroll_lock) {
+		atomic_or(&requested, KEYBOARD_LED_SCROLL_LOCK);
+	} else {
+		atomic_and(&requested, ~KEYBOARD_LED_SCROLL_LOCK);
+	}
+	k_work_submit(&update);
+}
+
+void Leds::static_on_update(struct k_work *work) {
+	Leds *thisptr = CONTAINER_OF(work, Leds, update);
+	thisptr->on_update();
+}
+
+void Leds::on_update() {
+	uint8_t state = atomic_get(&requested);
+	uint8_t changed = state ^ applied;
+	if (changed & KEYBOARD_LED_CAPS_LOCK) {
+		gpio_pin_set(caps_lock_gpio,
+		             CAPS_LOCK_PIN,
+		             (state & KEYBOARD_LED_CAPS_LOCK) != 0);
+	}
+	if (changed & KEYBOARD_LED_SCROLL_LOCK) {
+		gpio_pin_set(scroll_lock_gpio,
+		             SCROLL_LOCK_PIN,
+		             (state & KEYBOARD_LED_SCROLL_LOCK) != 0);
+	}
+	// The keyboard has no num lock, compose or kana LEDs.
+	applied = state;
 }
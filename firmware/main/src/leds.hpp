@@ -2,6 +2,8 @@
 #define LEDS_HPP_INCLUDED
 
 #include <drivers/gpio.h>
+#include <kernel.h>
+#include <sys/atomic.h>
 
 enum ModeLed {
 	MODE_LED_OFF,
@@ -12,17 +14,51 @@ enum ModeLed {
 	MODE_LED_CONNECTED,
 };
 
+/// Keyboard LEDs as encoded in the HID keyboard output report.
+///
+/// The same encoding is used by USB, Bluetooth HIDS and the Logitech Unifying
+/// LED report.
+enum KeyboardLed {
+	KEYBOARD_LED_NUM_LOCK = 1 << 0,
+	KEYBOARD_LED_CAPS_LOCK = 1 << 1,
+	KEYBOARD_LED_SCROLL_LOCK = 1 << 2,
+	KEYBOARD_LED_COMPOSE = 1 << 3,
+	KEYBOARD_LED_KANA = 1 << 4,
+};
+
+/// Mode LED and keyboard LEDs.
+///
+/// The keyboard LEDs can be set from any context, including interrupt handlers
+/// and the USB stack. The GPIOs are only updated later from the system
+/// workqueue, so that LED updates never delay key reports. Multiple updates
+/// before the GPIOs are updated are combined, and only LEDs whose state
+/// actually changed are written.
 class Leds {
 public:
 	Leds();
 	~Leds();
 
 	void set_mode(ModeLed mode);
+
+	/// Sets the state of all keyboard LEDs as received from the host.
+	///
+	/// @param leds Bitmask of `KeyboardLed` values.
+	void set_keyboard_leds(uint8_t leds);
 	void set_caps_lock(bool caps_lock);
 	void set_scroll_lock(bool scroll_lock);
 private:
+	static void static_on_update(struct k_work *work);
+	void on_update();
+
+	const struct device *caps_lock_gpio;
+	const struct device *scroll_lock_gpio;
+
+	/// LED state requested by the host.
+	atomic_t requested = ATOMIC_INIT(0);
+	/// LED state currently shown via the GPIOs.
+	uint8_t applied = 0;
+	struct k_work update;
 };
 
 #endif
 
-
@@ -2,6 +2,7 @@
 #include "bluetooth.hpp"
 #include "exception.hpp"
 #include "key_matrix.hpp"
+#include "key_scanner.hpp"
 #include "keys.hpp"
 #include "leds.hpp"
 #include "mode_switch.hpp"
@@ -60,28 +61,70 @@ bool want_shutdown(PowerSupply<PowerSupplyPins> *power_supply,
 	}
 }
 
+/// Passes the state of charge to keyboard implementations which report it to
+/// the host.
+static void report_battery_charge(BluetoothKeyboard *keyboard,
+                                  PowerSupply<PowerSupplyPins> *power_supply) {
+	keyboard->set_battery_level(power_supply->get_battery_charge());
+}
+
+template<class KeyboardType>
+static void report_battery_charge(KeyboardType *keyboard,
+                                  PowerSupply<PowerSupplyPins> *power_supply) {
+	(void)keyboard;
+	(void)power_supply;
+}
+
+/// Applies FN key combinations which the USB keyboard cannot apply itself.
+static void process_keyboard_requests(UsbKeyboard *keyboard) {
+	if (keyboard->take_poll_interval_request()) {
+		keyboard->select_next_poll_interval();
+	}
+}
+
+template<class KeyboardType>
+static void process_keyboard_requests(KeyboardType *keyboard) {
+	(void)keyboard;
+}
+
 enum PowerAction {
 	SHUTDOWN,
 	REBOOT,
+	/// The mode switch has changed, the keyboard implementation for the new
+	/// mode has to be started.
+	SWITCH_MODE,
 };
 
 template<class KeyboardType>
 PowerAction main_loop(KeyboardType *keyboard,
                       KeyboardMode mode,
+                      KeyScanner *key_scanner,
                       PowerSupply<PowerSupplyPins> *power_supply,
                       ModeSwitch *mode_switch) {
 	// We use the main thread to wait for power supply and mode switch
-	// changes.
+	// changes as well as for FN key combinations which write to flash.
+	report_battery_charge(keyboard, power_supply);
 	while (true) {
 		k_sem_take(&main_loop_event, K_FOREVER);
 		if (want_shutdown(power_supply, mode_switch)) {
 			return SHUTDOWN;
 		}
+#ifdef CONFIG_GOBOARD_DEBOUNCE_EAGER
+		if (key_scanner->take_debounce_request()) {
+			key_scanner->select_next_debounce_timing();
+		}
+#else
+		(void)key_scanner;
+#endif
+		process_keyboard_requests(keyboard);
+		// The power supply only signals changes of the state of charge
+		// which exceed its hysteresis.
+		report_battery_charge(keyboard, power_supply);
 		if (mode_switch->get_mode() != mode) {
-			printk("selected mode changed from %d to %d, resetting...\n",
+			printk("selected mode changed from %d to %d\n",
 			       mode,
 			       mode_switch->get_mode());
-			return REBOOT;
+			return SWITCH_MODE;
 		}
 		if (mode_switch->get_profile() != keyboard->get_profile()) {
 			keyboard->set_profile(mode_switch->get_profile());
@@ -89,6 +132,42 @@ PowerAction main_loop(KeyboardType *keyboard,
 	}
 }
 
+#ifdef CONFIG_GOBOARD_MODE_SWITCH_BENCHMARK
+/// Repeatedly starts and stops all keyboard implementations and prints the
+/// average time of a start/stop cycle.
+static void benchmark_mode_switch(KeyScanner *key_scanner,
+                                  Leds *leds,
+                                  PowerSupply<PowerSupplyPins> *power_supply,
+                                  KeyboardProfile profile) {
+	static const int ITERATIONS = 10;
+	uint32_t usb = 0;
+	uint32_t bluetooth = 0;
+	uint32_t unifying = 0;
+	for (int i = 0; i < ITERATIONS; i++) {
+		uint32_t start = k_cycle_get_32();
+		{
+			UsbKeyboard keyboard(key_scanner, leds, power_supply);
+		}
+		uint32_t usb_end = k_cycle_get_32();
+		{
+			BluetoothKeyboard keyboard(key_scanner, leds, profile);
+		}
+		uint32_t bluetooth_end = k_cycle_get_32();
+		{
+			UnifyingKeyboard keyboard(key_scanner, leds, profile);
+		}
+		uint32_t unifying_end = k_cycle_get_32();
+		usb += usb_end - start;
+		bluetooth += bluetooth_end - usb_end;
+		unifying += unifying_end - bluetooth_end;
+	}
+	printk("mode switch: USB %uus, bluetooth %uus, unifying %uus\n",
+	       k_cyc_to_us_floor32(usb / ITERATIONS),
+	       k_cyc_to_us_floor32(bluetooth / ITERATIONS),
+	       k_cyc_to_us_floor32(unifying / ITERATIONS));
+}
+#endif
+
 /// Main keyboard application.
 ///
 /// The function initializes and runs the keyboard code. When the function
@@ -132,37 +211,67 @@ static PowerAction run_keyboard() {
 	KeyMatrix key_matrix;
 	Keys<KeyMatrix> keys(&key_matrix);
 	Leds leds;
+#ifdef CONFIG_GOBOARD_KEY_MATRIX_BENCHMARK
+	key_matrix.benchmark();
+#endif
+	// The keys are scanned in a separate thread which passes key events to
+	// the keyboard implementation.
+	KeyScanner key_scanner(&keys);
+	key_scanner.set_request_callback(power_supply_mode_switch_handler);
+#ifdef CONFIG_GOBOARD_MODE_SWITCH_BENCHMARK
+	benchmark_mode_switch(&key_scanner,
+	                      &leds,
+	                      &power_supply,
+	                      mode_switch.get_profile());
+#endif
 
 	// Run different initialization and main loop depending on the selected
-	// mode.
-	if (mode_switch.get_mode() == MODE_OFF_USB) {
-		printk("Initializing USB keyboard...\n");
-		UsbKeyboard keyboard(&keys, &leds);
-		return main_loop<UsbKeyboard>(&keyboard,
-		                              MODE_OFF_USB,
-		                              &power_supply,
-		                              &mode_switch);
-	} else if (mode_switch.get_mode() == MODE_BLUETOOTH) {
-		printk("Initializing bluetooth keyboard...\n");
-		BluetoothKeyboard keyboard(&keys, &leds);
-		return main_loop<BluetoothKeyboard>(&keyboard,
-		                                    MODE_BLUETOOTH,
-		                                    &power_supply,
-		                                    &mode_switch);
-	} else if (mode_switch.get_mode() == MODE_UNIFYING) {
-		printk("Initializing unifying keyboard...\n");
-		UnifyingKeyboard keyboard(&keys,
-		                          &leds,
-		                          mode_switch.get_profile());
-		return main_loop<UnifyingKeyboard>(&keyboard,
-		                                   MODE_UNIFYING,
-		                                   &power_supply,
-		                                   &mode_switch);
-	} else {
-		// This must never happen.
-		throw InvalidState("invalid mode");
+	// mode. When the mode changes, the keyboard implementation is destroyed
+	// and the one for the new mode is created without a reboot.
+	while (true) {
+		PowerAction action;
+		if (mode_switch.get_mode() == MODE_OFF_USB) {
+			printk("Initializing USB keyboard...\n");
+			UsbKeyboard keyboard(&key_scanner, &leds, &power_supply);
+			keyboard.set_request_callback(
+					power_supply_mode_switch_handler);
+			action = main_loop<UsbKeyboard>(&keyboard,
+			                                MODE_OFF_USB,
+			                                &key_scanner,
+			                                &power_supply,
+			                                &mode_switch);
+		} else if (mode_switch.get_mode() == MODE_BLUETOOTH) {
+			printk("Initializing bluetooth keyboard...\n");
+			BluetoothKeyboard keyboard(&key_scanner,
+			                           &leds,
+			                           mode_switch.get_profile());
+			action = main_loop<BluetoothKeyboard>(&keyboard,
+			                                      MODE_BLUETOOTH,
+			                                      &key_scanner,
+			                                      &power_supply,
+			                                      &mode_switch);
+		} else if (mode_switch.get_mode() == MODE_UNIFYING) {
+			printk("Initializing unifying keyboard...\n");
+			UnifyingKeyboard keyboard(&key_scanner,
+			                          &leds,
+			                          mode_switch.get_profile());
+			action = main_loop<UnifyingKeyboard>(&keyboard,
+			                                     MODE_UNIFYING,
+			                                     &key_scanner,
+			                                     &power_supply,
+			                                     &mode_switch);
+		} else {
+			// This must never happen.
+			throw InvalidState("invalid mode");
+		}
+		if (action != SWITCH_MODE) {
+			return action;
+		}
+		// The new mode might be "off".
+		if (want_shutdown(&power_supply, &mode_switch)) {
+			return SHUTDOWN;
+		}
 	}
-
 }
 
 void main(void) {
@@ -1,6 +1,7 @@
 #include "mode_switch.hpp"
 
 #include "exception.hpp"
+#include "work_queue.hpp"
 
 #include <hal/nrf_gpio.h>
 
@@ -150,7 +151,9 @@ void ModeSwitch::sw0_gpio_callback(const struct device *port, struct gpio_callba
 	ModeSwitch *ms = CONTAINER_OF(cb, ModeSwitch, sw0_cb_data);
 	// Debounce the switch by waiting for some time before calling the
 	// callback.
-	k_work_schedule(&ms->callback, DEBOUNCE_INTERVAL);
+	k_work_schedule_for_queue(&background_work_q,
+	                          &ms->callback,
+	                          DEBOUNCE_INTERVAL);
 }
 
 void ModeSwitch::sw1_gpio_callback(const struct device *port, struct gpio_callback *cb, uint32_t pins) {
@@ -159,7 +162,9 @@ void ModeSwitch::sw1_gpio_callback(const struct device *port, struct gpio_callba
 	ModeSwitch *ms = CONTAINER_OF(cb, ModeSwitch, sw1_cb_data);
 	// Debounce the switch by waiting for some time before calling the
 	// callback.
-	k_work_schedule(&ms->callback, DEBOUNCE_INTERVAL);
+	k_work_schedule_for_queue(&background_work_q,
+	                          &ms->callback,
+	                          DEBOUNCE_INTERVAL);
 }
 
 void ModeSwitch::static_on_callback(struct k_work *work) {
@@ -38,9 +38,9 @@ public:
 	/// Sets a callback which is called whenever the state of the mode
 	/// switch changes.
 	///
-	/// The callback is called from the system workqueue while preemption is
-	/// disabled. The previous callback will never be called after this
-	/// function returns.
+	/// The callback is called from the background workqueue while
+	/// preemption is disabled. The previous callback will never be called
+	/// after this function returns.
 	void set_callback(void (*change_callback)());
 private:
 	unsigned int get_position();
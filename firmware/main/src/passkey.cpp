@@ -0,0 +1,124 @@
+#include "passkey.hpp"
+
+#include "scan_code.hpp"
+
+#include <sys/util.h>
+
+/// Returns the value of a digit key, or -1 if the key is not a digit.
+static int digit_value(uint8_t key) {
+	// The number row starts with 1, the numpad starts with 1 as well.
+	if (key >= KEY_1 && key <= KEY_9) {
+		return key - KEY_1 + 1;
+	}
+	if (key >= KEY_KP_1 && key <= KEY_KP_9) {
+		return key - KEY_KP_1 + 1;
+	}
+	if (key == KEY_0 || key == KEY_KP_0) {
+		return 0;
+	}
+	return -1;
+}
+
+void PasskeyInput::reset() {
+	passkey = 0;
+	digits = 0;
+}
+
+PasskeyStatus PasskeyInput::press(uint8_t key) {
+	int digit = digit_value(key);
+	if (digit >= 0) {
+		if (digits < PASSKEY_DIGITS) {
+			passkey = passkey * 10 + digit;
+			digits++;
+		}
+	} else if (key == KEY_BACKSPACE) {
+		if (digits > 0) {
+			passkey /= 10;
+			digits--;
+		}
+	} else if (key == KEY_RETURN || key == KEY_KP_ENTER) {
+		if (digits == PASSKEY_DIGITS) {
+			return PASSKEY_ENTERED;
+		}
+	} else if (key == KEY_ESCAPE) {
+		return PASSKEY_CANCELLED;
+	}
+	return PASSKEY_INCOMPLETE;
+}
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	static PasskeyStatus type_keys(PasskeyInput *input,
+	                               const uint8_t *keys,
+	                               size_t count) {
+		PasskeyStatus status = PASSKEY_INCOMPLETE;
+		for (size_t i = 0; i < count; i++) {
+			status = input->press(keys[i]);
+			if (i != count - 1) {
+				zassert_equal(status, PASSKEY_INCOMPLETE,
+				              "passkey finished early at key %d", i);
+			}
+		}
+		return status;
+	}
+
+	static void passkey_entry_test(void) {
+		PasskeyInput input;
+
+		// Leading zeros and numpad digits. Other keys are ignored, and
+		// so is enter before the sixth digit.
+		static const uint8_t keys[] = {
+			KEY_0, KEY_KP_1, KEY_A, KEY_2, KEY_KP_0, KEY_9,
+			KEY_RETURN, KEY_KP_9, KEY_RETURN,
+		};
+		zassert_equal(type_keys(&input, keys, ARRAY_SIZE(keys)),
+		              PASSKEY_ENTERED,
+		              "passkey not entered");
+		zassert_equal(input.get_passkey(), 12099, "wrong passkey");
+
+		// Backspace removes the last digit, further digits are
+		// ignored.
+		input.reset();
+		static const uint8_t corrected[] = {
+			KEY_9, KEY_8, KEY_BACKSPACE, KEY_7, KEY_6, KEY_5,
+			KEY_4, KEY_3, KEY_2, KEY_KP_ENTER,
+		};
+		zassert_equal(type_keys(&input,
+		                        corrected,
+		                        ARRAY_SIZE(corrected)),
+		              PASSKEY_ENTERED,
+		              "passkey not entered");
+		zassert_equal(input.get_passkey(), 976543, "wrong passkey");
+
+		// Backspace on an empty passkey does nothing.
+		input.reset();
+		static const uint8_t empty[] = {
+			KEY_BACKSPACE, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6,
+			KEY_RETURN,
+		};
+		zassert_equal(type_keys(&input, empty, ARRAY_SIZE(empty)),
+		              PASSKEY_ENTERED,
+		              "passkey not entered");
+		zassert_equal(input.get_passkey(), 123456, "wrong passkey");
+
+		// Escape cancels pairing.
+		input.reset();
+		static const uint8_t cancelled[] = { KEY_1, KEY_2, KEY_ESCAPE };
+		zassert_equal(type_keys(&input,
+		                        cancelled,
+		                        ARRAY_SIZE(cancelled)),
+		              PASSKEY_CANCELLED,
+		              "pairing not cancelled");
+	}
+
+	static void passkey_tests() {
+		ztest_test_suite(passkey,
+			ztest_unit_test(passkey_entry_test)
+		);
+		ztest_run_test_suite(passkey);
+	}
+	RegisterTests passkey_tests_(passkey_tests);
+}
+#endif
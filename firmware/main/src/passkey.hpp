@@ -0,0 +1,51 @@
+#ifndef PASSKEY_HPP_INCLUDED
+#define PASSKEY_HPP_INCLUDED
+
+#include <stdint.h>
+
+/// Number of digits of a Bluetooth passkey.
+#define PASSKEY_DIGITS 6
+
+enum PasskeyStatus {
+	/// The user has not finished typing the passkey.
+	PASSKEY_INCOMPLETE,
+	/// The user has typed all digits and pressed enter.
+	PASSKEY_ENTERED,
+	/// The user has pressed escape.
+	PASSKEY_CANCELLED,
+};
+
+/// Collects the passkey typed on the keyboard during pairing.
+///
+/// The keyboard has no display, so it pairs with the "keyboard only" IO
+/// capability: the host displays a six-digit passkey and the user types it on
+/// the keyboard, followed by enter. The digits can be typed on the number row
+/// or on the numpad, backspace removes the last digit, and escape cancels
+/// pairing. Enter is ignored until all six digits have been typed, and further
+/// digits are ignored. The class is not thread-safe.
+class PasskeyInput {
+public:
+	PasskeyInput() {}
+
+	/// Discards all digits typed so far.
+	void reset();
+
+	/// Processes a key press.
+	///
+	/// The keys have to be passed in the order in which they were pressed,
+	/// key releases are not relevant.
+	///
+	/// @param key Scan code of the pressed key.
+	/// @return `PASSKEY_ENTERED` once the passkey is complete.
+	PasskeyStatus press(uint8_t key);
+
+	/// Returns the passkey once `press()` has returned `PASSKEY_ENTERED`.
+	uint32_t get_passkey() {
+		return passkey;
+	}
+private:
+	uint32_t passkey = 0;
+	unsigned int digits = 0;
+};
+
+#endif
@@ -1,5 +1,9 @@
 #include "power_supply.hpp"
 
+#include "work_queue.hpp"
+
+#include <stdlib.h>
+
 #ifdef CONFIG_BOARD_GOBOARD_NRF52840
 // On the real hardware, charge the batteries for 10 seconds at a time.
 #define CHARGING_DURATION K_SECONDS(10)
@@ -15,6 +19,45 @@
 #define CHARGE_END_VOLTAGE 1380
 #define DISCHARGED_VOLTAGE 1100
 
+/// Minimum change of the state of charge (in percent) which is reported.
+#define CHARGE_HYSTERESIS 2
+
+struct DischargeCurvePoint {
+	uint32_t voltage;
+	uint8_t charge;
+};
+
+/// Approximate state of charge of a NiMH cell at rest. The curve is very flat
+/// between 1.2V and 1.3V, so the estimate is coarse.
+static const DischargeCurvePoint discharge_curve[] = {
+	{ DISCHARGED_VOLTAGE, 0 },
+	{ 1150, 5 },
+	{ 1200, 15 },
+	{ 1230, 30 },
+	{ 1250, 50 },
+	{ 1270, 70 },
+	{ 1300, 85 },
+	{ 1350, 95 },
+	{ CHARGE_END_VOLTAGE, 100 },
+};
+
+/// Interpolates the state of charge in percent from the cell voltage in mV.
+static uint8_t voltage_to_charge(uint32_t voltage) {
+	if (voltage <= discharge_curve[0].voltage) {
+		return 0;
+	}
+	for (size_t i = 1; i < ARRAY_SIZE(discharge_curve); i++) {
+		const DischargeCurvePoint &low = discharge_curve[i - 1];
+		const DischargeCurvePoint &high = discharge_curve[i];
+		if (voltage < high.voltage) {
+			return low.charge + (voltage - low.voltage) *
+			       (high.charge - low.charge) /
+			       (high.voltage - low.voltage);
+		}
+	}
+	return 100;
+}
+
 template<class PowerSupplyPinType>
 PowerSupply<PowerSupplyPinType>::PowerSupply(PowerSupplyPinType *pins):
 		pins(pins) {
@@ -55,6 +98,19 @@ uint8_t PowerSupply<PowerSupplyPinType>::get_battery_charge() {
 	return atomic_get(&charge);
 }
 
+template<class PowerSupplyPinType>
+void PowerSupply<PowerSupplyPinType>::pause_charging(bool paused) {
+	atomic_set(&charging_paused, paused);
+	if (paused) {
+		// End the current charging period right away. If we are in the
+		// recovery period, on_charging_ended() only disables the outputs
+		// again and the cycle continues as before.
+		k_work_reschedule_for_queue(&background_work_q,
+		                            &charging_ended,
+		                            K_NO_WAIT);
+	}
+}
+
 template<class PowerSupplyPinType>
 struct CallbackChange {
 	PowerSupply<PowerSupplyPinType> *thisptr;
@@ -65,17 +121,17 @@ struct CallbackChange {
 
 template<class PowerSupplyPinType>
 void PowerSupply<PowerSupplyPinType>::set_callback(void (*change_callback)()) {
-	// The power supply code is executed on the system workqueue. To prevent
-	// race conditions while setting the callback and to wait for any
-	// invocation of the old callback, we execute the callback change on the
-	// system workqueue.
+	// The power supply code is executed on the background workqueue. To
+	// prevent race conditions while setting the callback and to wait for
+	// any invocation of the old callback, we execute the callback change on
+	// the background workqueue.
 	CallbackChange<PowerSupplyPinType> change = {
 		.thisptr = this,
 		.new_callback = change_callback,
 	};
 	k_sem_init(&change.done, 0, 1);
 	k_work_init(&change.work, static_set_callback_work);
-	k_work_submit(&change.work);
+	k_work_submit_to_queue(&background_work_q, &change.work);
 
 	// Wait until the workqueue entry has been executed.
 	// TODO: Do we need the semaphore, or does k_work_flush block while the
@@ -115,7 +171,9 @@ void PowerSupply<PowerSupplyPinType>::on_charging_ended() {
 	pins->configure_discharging(false, false);
 
 	// Start the recovery period.
-	k_work_schedule(&recovery_ended, RECOVERY_DURATION);
+	k_work_schedule_for_queue(&background_work_q,
+	                          &recovery_ended,
+	                          RECOVERY_DURATION);
 }
 
 template<class PowerSupplyPinType>
@@ -142,11 +200,16 @@ void PowerSupply<PowerSupplyPinType>::on_recovery_ended() {
 	printk("battery voltage: %dmV, %dmV\n", low_voltage, high_voltage);
 	printk("usb: %d\n", usb_connected);
 #endif
-	// TODO: Derive the state of charge from the lower voltage.
+	// The battery with the lower voltage is empty first.
+	bool charge_changed = update_charge(MIN(low_voltage, high_voltage));
 
 	// Start charging or balancing.
 	PowerSupplyMode new_mode = POWER_SUPPLY_NORMAL;
-	if (usb_connected) {
+	if (usb_connected && atomic_get(&charging_paused) != 0) {
+		// The USB host is suspended, so we must not draw any significant
+		// current from USB. The batteries are not low either as we are
+		// still connected to USB.
+	} else if (usb_connected) {
 		if (low_voltage < CHARGE_END_VOLTAGE &&
 				high_voltage < CHARGE_END_VOLTAGE) {
 #ifdef CONFIG_BOARD_GOBOARD_NRF52840
@@ -180,15 +243,32 @@ void PowerSupply<PowerSupplyPinType>::on_recovery_ended() {
 	int old_mode = __atomic_exchange_n(&mode, new_mode, __ATOMIC_SEQ_CST);
 	bool usb_changed = usb_was_connected != usb_connected;
 	usb_was_connected = usb_connected;
-	if (old_mode != new_mode || usb_changed) {
-		// TODO: Also check the state of charge.
+	if (old_mode != new_mode || usb_changed || charge_changed) {
 		if (change_callback) {
 			change_callback();
 		}
 	}
 
 	// Start the charging period.
-	k_work_schedule(&charging_ended, CHARGING_DURATION);
+	k_work_schedule_for_queue(&background_work_q,
+	                          &charging_ended,
+	                          CHARGING_DURATION);
+}
+
+template<class PowerSupplyPinType>
+bool PowerSupply<PowerSupplyPinType>::update_charge(uint32_t voltage) {
+	int measured = voltage_to_charge(voltage);
+	int current = atomic_get(&charge);
+	// Small changes are usually just noise, and every change causes a
+	// notification to the host, so they are ignored. Empty and full
+	// batteries are always reported, though.
+	if (charge_measured && measured != 0 && measured != 100 &&
+			abs(measured - current) < CHARGE_HYSTERESIS) {
+		return false;
+	}
+	charge_measured = true;
+	atomic_set(&charge, measured);
+	return measured != current;
 }
 
 #ifdef CONFIG_BOARD_GOBOARD_NRF52840
@@ -370,13 +450,94 @@ namespace tests {
 		}
 	}
 
+	static void paused_charging_test(void) {
+		MockPowerSupplyPins pins;
+		pins.set_input(1100, 1200, true);
+		PowerSupply<MockPowerSupplyPins> ps(&pins);
+		ps.set_callback(power_supply_callback);
+
+		// While paused, neither charging nor balancing must be active
+		// even though USB is connected.
+		ps.pause_charging(true);
+		single_charging_test({ 1100, 1200, true, false, false, false,
+		                       POWER_SUPPLY_NORMAL, true },
+		                     &pins, &ps);
+
+		// Charging resumes with the next cycle.
+		ps.pause_charging(false);
+		single_charging_test({ 1100, 1200, true, true, false, true,
+		                       POWER_SUPPLY_CHARGING, true },
+		                     &pins, &ps);
+	}
+
+	static void wait_for_measurement(MockPowerSupplyPins *pins,
+	                                 uint32_t low,
+	                                 uint32_t high) {
+		atomic_set(&callback_called, 0);
+		pins->set_input(low, high, false);
+		k_sleep(CHARGING_DURATION);
+		k_sleep(RECOVERY_DURATION);
+		k_sleep(CHARGING_DURATION);
+		k_sleep(RECOVERY_DURATION);
+	}
+
 	static void soc_test(void) {
-		// TODO: Test the state-of-charge report.
+		// The first measurement replaces the initial value.
+		MockPowerSupplyPins pins;
+		pins.set_input(1300, 1250, false);
+		PowerSupply<MockPowerSupplyPins> ps(&pins);
+		ps.set_callback(power_supply_callback);
+		zassert_equal(ps.get_battery_charge(), 50,
+		              "wrong charge for 1250mV");
+
+		// Noise does not cause any updates.
+		wait_for_measurement(&pins, 1251, 1300);
+		zassert_equal(ps.get_battery_charge(), 50, "noise not filtered");
+		zassert_equal(atomic_get(&callback_called), 0,
+		              "callback called for noise");
+		wait_for_measurement(&pins, 1300, 1249);
+		zassert_equal(ps.get_battery_charge(), 50, "noise not filtered");
+		zassert_equal(atomic_get(&callback_called), 0,
+		              "callback called for noise");
+
+		// Larger changes are reported.
+		wait_for_measurement(&pins, 1300, 1240);
+		zassert_equal(ps.get_battery_charge(), 40,
+		              "wrong charge for 1240mV");
+		zassert_equal(atomic_get(&callback_called), 1,
+		              "callback not called");
+		wait_for_measurement(&pins, 1400, 1400);
+		zassert_equal(ps.get_battery_charge(), 100,
+		              "wrong charge for 1400mV");
+		wait_for_measurement(&pins, 1150, 1160);
+		zassert_equal(ps.get_battery_charge(), 5,
+		              "wrong charge for 1150mV");
+		wait_for_measurement(&pins, 1050, 1160);
+		zassert_equal(ps.get_battery_charge(), 0,
+		              "wrong charge for 1050mV");
+
+		// Empty and full batteries are reported even if the change is
+		// smaller than the hysteresis.
+		wait_for_measurement(&pins, 1130, 1160);
+		wait_for_measurement(&pins, 1111, 1160);
+		zassert_equal(ps.get_battery_charge(), 1,
+		              "wrong charge for 1111mV");
+		wait_for_measurement(&pins, 1100, 1160);
+		zassert_equal(ps.get_battery_charge(), 0,
+		              "empty battery not reported");
+		wait_for_measurement(&pins, 1350, 1400);
+		wait_for_measurement(&pins, 1375, 1400);
+		zassert_equal(ps.get_battery_charge(), 99,
+		              "wrong charge for 1375mV");
+		wait_for_measurement(&pins, 1380, 1400);
+		zassert_equal(ps.get_battery_charge(), 100,
+		              "full battery not reported");
 	}
 
 	void power_supply_tests() {
 		ztest_test_suite(power_supply,
 			ztest_unit_test(charging_test),
+			ztest_unit_test(paused_charging_test),
 			ztest_unit_test(soc_test)
 		);
 		ztest_run_test_suite(power_supply);
@@ -23,7 +23,8 @@ enum PowerSupplyMode {
 /// The power supply code performs a number of tasks:
 ///
 /// - It periodically measures the battery voltages. The lower voltage is
-///   used to calculate the remaining.
+///   used to calculate the remaining charge. Changes of less than two percent
+///   are ignored so that noise does not cause a stream of updates.
 /// - If USB is connected, the code charges the batteries inbetween voltage
 ///   measurements if both batteries are below a safe maximum voltage. After
 ///   each charging period, the code waits for some time without charging to let
@@ -36,7 +37,7 @@ public:
 	PowerSupply(PowerSupplyPinType *pins);
 	/// Destructor. Similar to `set_callback()`, the destructor waits for
 	/// any current callback invocation and must therefore not be called
-	/// from the system workqueue.
+	/// from the background workqueue.
 	~PowerSupply();
 
 	/// Returns the current mode of the power supply.
@@ -49,23 +50,31 @@ public:
 	///
 	/// This function must not be called from within interrupt handlers.
 	bool has_usb_connection(void) {
-		// The power supply loop calls the same function from the system
-		// workqueue thread, so we need to disable preemption to prevent
-		// race conditions.
+		// The power supply loop calls the same function from the
+		// background workqueue thread, so we need to disable preemption
+		// to prevent race conditions.
 		k_sched_lock();
 		bool connected = pins->has_usb_connection();
 		k_sched_unlock();
 		return connected;
 	}
 
+	/// Pauses or resumes charging and balancing of the batteries.
+	///
+	/// While the USB host is suspended, the keyboard must not draw more than
+	/// 2.5mA from the bus, so charging is stopped immediately when paused.
+	/// Charging is resumed with the next voltage measurement. This function
+	/// can be called from interrupt handlers.
+	void pause_charging(bool paused);
+
 	// Sets a callback which is called whenever the state of the power
 	// supply (mode or charge percentage) changes.
 	//
-	// The callback is called from the system workqueue. If the system
-	// workqueue is currently executing the old callback, the call blocks
-	// until the callback has returned. The function therefore must never be
-	// called from the system workqueue as that situation would result in a
-	// deadlock.
+	// The callback is called from the background workqueue (see
+	// `background_work_q`). If the background workqueue is currently
+	// executing the old callback, the call blocks until the callback has
+	// returned. The function therefore must never be called from the
+	// background workqueue as that situation would result in a deadlock.
 	void set_callback(void (*change_callback)());
 private:
 	static void static_set_callback_work(struct k_work *work);
@@ -74,17 +83,18 @@ private:
 	void on_charging_ended();
 	static void static_on_recovery_ended(struct k_work *work);
 	void on_recovery_ended();
-
+	bool update_charge(uint32_t voltage);
 
 	PowerSupplyPinType *pins;
 	/// Callback which is called whenever mode, state of charge, or USB
 	/// connection state change.
 	///
-	/// The variable is only accessed from the system workqueue, therefore
-	/// no mutex is required to access it.
+	/// The variable is only accessed from the background workqueue,
+	/// therefore no mutex is required to access it.
 	void (*change_callback)() = NULL;
 
 	atomic_t stop = ATOMIC_INIT(0);
+	atomic_t charging_paused = ATOMIC_INIT(0);
 	/// Workqueue entry which is executed after the charging period.
 	/// At this point, charging shall be stopped and the recovery period
 	/// should be initiated by submitting `recovery_ended`.
@@ -103,6 +113,9 @@ private:
 	// the compiler does not do anything stupid.
 	atomic_t mode = ATOMIC_INIT(POWER_SUPPLY_NORMAL);
 	atomic_t charge = ATOMIC_INIT(100);
+	/// False until the charge has been derived from the first voltage
+	/// measurement.
+	bool charge_measured = false;
 
 	// We need to memorize the USB connection status so that we can invoke
 	// the callback when it changes.
@@ -1,5 +1,6 @@
 #include "power_supply_pins.hpp"
 #include "exception.hpp"
+#include "gpio.hpp"
 
 #include <drivers/adc.h>
 
@@ -182,19 +183,3 @@ bool PowerSupplyPins::has_usb_connection(void) {
 	}
 	return status;
 }
-
-const struct device *PowerSupplyPins::init_output_gpio(const char *label,
-                                                       gpio_pin_t pin,
-                                                       gpio_flags_t flags) {
-	const struct device *gpio = device_get_binding(label);
-	if (gpio == NULL) {
-		throw InitializationFailed("GPIO not found");
-	}
-	if (gpio_pin_configure(gpio, pin,
-	                       GPIO_OUTPUT_INACTIVE | flags) != 0) {
-		throw InitializationFailed("gpio_pin_configure failed");
-	}
-
-	return gpio;
-}
-
@@ -0,0 +1,252 @@
+#include "reconnect.hpp"
+
+#include <sys/util.h>
+
+/// The controller stops high duty cycle directed advertising after 1.28s and
+/// reports the timeout. If the report is lost, the reconnector switches to
+/// undirected advertising on its own after this time.
+#define DIRECTED_TIMEOUT_MS 1500
+
+static bool time_reached(uint32_t now, uint32_t time) {
+	return (int32_t)(now - time) >= 0;
+}
+
+template<class AdvertiserType>
+Reconnector<AdvertiserType>::Reconnector(AdvertiserType *advertiser,
+                                         uint32_t fast_timeout_ms,
+                                         uint32_t slow_timeout_ms):
+		advertiser(advertiser),
+		fast_timeout_ms(fast_timeout_ms),
+		slow_timeout_ms(slow_timeout_ms) {
+}
+
+template<class AdvertiserType>
+void Reconnector<AdvertiserType>::start(const bt_addr_le_t *peer,
+                                        uint32_t now) {
+	stop();
+	if (peer != NULL) {
+		if (advertiser->start_directed(peer) == 0) {
+			state = ADVERTISING_DIRECTED;
+			deadline = now + DIRECTED_TIMEOUT_MS;
+			return;
+		}
+		// The host is not known to the controller, so another host has
+		// to be able to connect.
+	}
+	enter(ADVERTISING_FAST, now);
+}
+
+template<class AdvertiserType>
+void Reconnector<AdvertiserType>::stop() {
+	if (state != ADVERTISING_OFF) {
+		advertiser->stop();
+		state = ADVERTISING_OFF;
+	}
+}
+
+template<class AdvertiserType>
+void Reconnector<AdvertiserType>::on_directed_timeout(uint32_t now) {
+	// The timeout might have been handled by update() already.
+	if (state == ADVERTISING_DIRECTED) {
+		enter(ADVERTISING_FAST, now);
+	}
+}
+
+template<class AdvertiserType>
+void Reconnector<AdvertiserType>::update(uint32_t now) {
+	if (state == ADVERTISING_OFF || !time_reached(now, deadline)) {
+		return;
+	}
+	switch (state) {
+	case ADVERTISING_DIRECTED:
+		enter(ADVERTISING_FAST, now);
+		break;
+	case ADVERTISING_FAST:
+		enter(ADVERTISING_SLOW, now);
+		break;
+	default:
+		stop();
+		break;
+	}
+}
+
+template<class AdvertiserType>
+int32_t Reconnector<AdvertiserType>::next_update(uint32_t now) {
+	if (state == ADVERTISING_OFF) {
+		return -1;
+	}
+	return MAX((int32_t)(deadline - now), 0);
+}
+
+template<class AdvertiserType>
+void Reconnector<AdvertiserType>::enter(AdvertisingState next, uint32_t now) {
+	stop();
+	bool fast = next == ADVERTISING_FAST;
+	if (advertiser->start_undirected(fast) != 0) {
+		return;
+	}
+	state = next;
+	deadline = now + (fast ? fast_timeout_ms : slow_timeout_ms);
+}
+
+#ifdef CONFIG_BOARD_GOBOARD_NRF52840
+#include "advertiser.hpp"
+template class Reconnector<BluetoothAdvertiser>;
+#endif
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+#include <errno.h>
+namespace tests {
+	enum MockAdvertising {
+		MOCK_ADVERTISING_OFF,
+		MOCK_ADVERTISING_DIRECTED,
+		MOCK_ADVERTISING_FAST,
+		MOCK_ADVERTISING_SLOW,
+	};
+
+	class MockAdvertiser {
+	public:
+		int start_directed(const bt_addr_le_t *peer) {
+			zassert_equal(advertising, MOCK_ADVERTISING_OFF,
+			              "advertising not stopped");
+			if (directed_fails) {
+				return -EINVAL;
+			}
+			advertising = MOCK_ADVERTISING_DIRECTED;
+			this->peer = *peer;
+			return 0;
+		}
+
+		int start_undirected(bool fast) {
+			zassert_equal(advertising, MOCK_ADVERTISING_OFF,
+			              "advertising not stopped");
+			advertising = fast ? MOCK_ADVERTISING_FAST
+			                   : MOCK_ADVERTISING_SLOW;
+			return 0;
+		}
+
+		void stop() {
+			advertising = MOCK_ADVERTISING_OFF;
+		}
+
+		/// Simulates a connection, which stops advertising.
+		void connect() {
+			advertising = MOCK_ADVERTISING_OFF;
+		}
+
+		MockAdvertising advertising = MOCK_ADVERTISING_OFF;
+		bt_addr_le_t peer;
+		bool directed_fails = false;
+	};
+
+	static const uint32_t test_fast_timeout = 30000;
+	static const uint32_t test_slow_timeout = 180000;
+	static const bt_addr_le_t test_peer = {
+		.type = 0,
+		.a = {{1, 2, 3, 4, 5, 6}},
+	};
+
+	static void reconnect_directed_test(void) {
+		MockAdvertiser advertiser;
+		Reconnector<MockAdvertiser> reconnector(&advertiser,
+		                                        test_fast_timeout,
+		                                        test_slow_timeout);
+		zassert_equal(reconnector.next_update(0), -1,
+		              "update required while off");
+
+		// The last host is addressed first.
+		reconnector.start(&test_peer, 1000);
+		zassert_equal(advertiser.advertising, MOCK_ADVERTISING_DIRECTED,
+		              "no directed advertising");
+		zassert_equal(bt_addr_le_cmp(&advertiser.peer, &test_peer), 0,
+		              "wrong peer");
+		zassert_equal(reconnector.get_state(), ADVERTISING_DIRECTED,
+		              "wrong state");
+
+		// Fast undirected advertising once the controller has given up.
+		advertiser.stop();
+		reconnector.on_directed_timeout(2280);
+		zassert_equal(advertiser.advertising, MOCK_ADVERTISING_FAST,
+		              "no fast advertising");
+		zassert_equal(reconnector.next_update(2280), test_fast_timeout,
+		              "wrong fast timeout");
+		// The safety timeout of directed advertising is ignored.
+		reconnector.update(2500);
+		zassert_equal(reconnector.get_state(), ADVERTISING_FAST,
+		              "fast advertising ended early");
+		reconnector.on_directed_timeout(2600);
+		zassert_equal(reconnector.get_state(), ADVERTISING_FAST,
+		              "duplicate timeout not ignored");
+
+		// Slow advertising after the fast timeout, and no advertising
+		// after the slow timeout.
+		reconnector.update(2280 + test_fast_timeout);
+		zassert_equal(advertiser.advertising, MOCK_ADVERTISING_SLOW,
+		              "no slow advertising");
+		zassert_equal(reconnector.next_update(2280 + test_fast_timeout),
+		              test_slow_timeout,
+		              "wrong slow timeout");
+		reconnector.update(2280 + test_fast_timeout + test_slow_timeout);
+		zassert_equal(advertiser.advertising, MOCK_ADVERTISING_OFF,
+		              "advertising not stopped");
+		zassert_equal(reconnector.get_state(), ADVERTISING_OFF,
+		              "wrong state");
+		zassert_equal(reconnector.next_update(300000), -1,
+		              "update required while off");
+
+		// A key press starts over.
+		reconnector.start(&test_peer, 400000);
+		zassert_equal(advertiser.advertising, MOCK_ADVERTISING_DIRECTED,
+		              "no directed advertising");
+	}
+
+	static void reconnect_undirected_test(void) {
+		MockAdvertiser advertiser;
+		Reconnector<MockAdvertiser> reconnector(&advertiser,
+		                                        test_fast_timeout,
+		                                        test_slow_timeout);
+
+		// Without a bonded host, fast advertising starts immediately.
+		reconnector.start(NULL, 0);
+		zassert_equal(advertiser.advertising, MOCK_ADVERTISING_FAST,
+		              "no fast advertising");
+
+		// If the controller rejects directed advertising, e.g., because
+		// of an unknown address, fast advertising is used as well.
+		advertiser.directed_fails = true;
+		reconnector.start(&test_peer, 100);
+		zassert_equal(advertiser.advertising, MOCK_ADVERTISING_FAST,
+		              "no fast advertising");
+		zassert_equal(reconnector.next_update(100), test_fast_timeout,
+		              "timeout not restarted");
+		advertiser.directed_fails = false;
+
+		// If the timeout report of the controller is lost, undirected
+		// advertising starts on its own.
+		reconnector.start(&test_peer, 1000);
+		zassert_equal(reconnector.next_update(1000), 1500,
+		              "wrong directed timeout");
+		advertiser.stop();
+		reconnector.update(2500);
+		zassert_equal(advertiser.advertising, MOCK_ADVERTISING_FAST,
+		              "no fast advertising");
+
+		// Stopping after a connection.
+		advertiser.connect();
+		reconnector.stop();
+		zassert_equal(reconnector.get_state(), ADVERTISING_OFF,
+		              "wrong state");
+	}
+
+	void reconnect_tests() {
+		ztest_test_suite(reconnect,
+			ztest_unit_test(reconnect_directed_test),
+			ztest_unit_test(reconnect_undirected_test)
+		);
+		ztest_run_test_suite(reconnect);
+	}
+	RegisterTests reconnect_tests_(reconnect_tests);
+}
+#endif
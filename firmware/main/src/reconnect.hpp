@@ -0,0 +1,84 @@
+#ifndef RECONNECT_HPP_INCLUDED
+#define RECONNECT_HPP_INCLUDED
+
+#include <bluetooth/addr.h>
+
+#include <stdint.h>
+
+enum AdvertisingState {
+	/// Not advertising.
+	ADVERTISING_OFF,
+	/// High duty cycle directed advertising towards the last host.
+	ADVERTISING_DIRECTED,
+	/// Undirected advertising with a short interval.
+	ADVERTISING_FAST,
+	/// Undirected advertising with a long interval.
+	ADVERTISING_SLOW,
+};
+
+/// Decides how the keyboard advertises while it waits for a host.
+///
+/// After a reboot or wakeup, the host which was connected last is usually still
+/// scanning for the keyboard. High duty cycle directed advertising lets this
+/// host reconnect within a few milliseconds, whereas undirected advertising
+/// takes at least one advertising interval. Directed advertising is stopped by
+/// the controller after 1.28s, after which the keyboard falls back to fast
+/// undirected advertising so that other hosts can connect as well. After the
+/// fast timeout, the advertising interval is increased to save power, and after
+/// the slow timeout, advertising is stopped completely until `start()` is
+/// called again, e.g., after the next key press.
+///
+/// The advertiser type has to provide the following functions, which return 0
+/// on success:
+///
+///     int start_directed(const bt_addr_le_t *peer);
+///     int start_undirected(bool fast);
+///     void stop();
+///
+/// All times are in milliseconds as returned by `k_uptime_get_32()`. The class
+/// is not thread-safe.
+template<class AdvertiserType>
+class Reconnector {
+public:
+	Reconnector(AdvertiserType *advertiser,
+	            uint32_t fast_timeout_ms,
+	            uint32_t slow_timeout_ms);
+
+	/// Restarts advertising from the beginning.
+	///
+	/// @param peer Host which shall reconnect, or NULL to start with
+	/// undirected advertising.
+	void start(const bt_addr_le_t *peer, uint32_t now);
+	/// Stops advertising, e.g., because all profiles are connected.
+	void stop();
+	/// Notifies the reconnector that the controller has stopped directed
+	/// advertising without a connection.
+	void on_directed_timeout(uint32_t now);
+	/// Switches to the next state if the timeout of the current state has
+	/// passed.
+	void update(uint32_t now);
+	/// Returns the time until `update()` has to be called again, or -1 if
+	/// advertising has been stopped.
+	int32_t next_update(uint32_t now);
+
+	AdvertisingState get_state() {
+		return state;
+	}
+private:
+	void enter(AdvertisingState next, uint32_t now);
+
+	AdvertiserType *advertiser;
+	uint32_t fast_timeout_ms;
+	uint32_t slow_timeout_ms;
+
+	AdvertisingState state = ADVERTISING_OFF;
+	/// Time at which the current state ends.
+	uint32_t deadline = 0;
+};
+
+#ifdef CONFIG_BOARD_GOBOARD_NRF52840
+class BluetoothAdvertiser;
+extern template class Reconnector<BluetoothAdvertiser>;
+#endif
+
+#endif
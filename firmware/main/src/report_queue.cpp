@@ -0,0 +1,191 @@
+#include "report_queue.hpp"
+
+#include <sys/util.h>
+
+static_assert(REPORT_QUEUE_SIZE >= 3,
+              "the report queue needs to hold at least three states");
+
+bool ReportQueue::push(const ReportState &state) {
+	// The oldest state might be being sent, so only later states are
+	// merged.
+	if (count >= 2 && can_merge(entry(count - 2), entry(count - 1), state)) {
+		entry(count - 1) = state;
+		coalesced++;
+		return true;
+	}
+	if (count == REPORT_QUEUE_SIZE) {
+		return false;
+	}
+	entry(count) = state;
+	count++;
+	max_count = MAX(max_count, count);
+	return true;
+}
+
+bool ReportQueue::peek(ReportState *state) {
+	if (count == 0) {
+		return false;
+	}
+	*state = entry(0);
+	return true;
+}
+
+void ReportQueue::pop() {
+	if (count == 0) {
+		return;
+	}
+	first = (first + 1) % REPORT_QUEUE_SIZE;
+	count--;
+}
+
+void ReportQueue::drop() {
+	if (count == 0) {
+		return;
+	}
+	pop();
+	dropped++;
+}
+
+bool ReportQueue::can_merge(const ReportState &before,
+                            const ReportState &after,
+                            const ReportState &next) {
+	// Every key which changed from `before` to `after` has to keep the new
+	// state in `next`, otherwise the host would never see the change.
+	uint8_t modifiers = before.keyboard[0] ^ after.keyboard[0];
+	if (((after.keyboard[0] ^ next.keyboard[0]) & modifiers) != 0) {
+		return false;
+	}
+	uint8_t consumer = before.consumer ^ after.consumer;
+	if (((after.consumer ^ next.consumer) & consumer) != 0) {
+		return false;
+	}
+	for (size_t i = 2; i < sizeof(after.keyboard); i++) {
+		uint8_t key = after.keyboard[i];
+		if (key != 0 && !contains_key(before, key) &&
+				!contains_key(next, key)) {
+			return false;
+		}
+		key = before.keyboard[i];
+		if (key != 0 && !contains_key(after, key) &&
+				contains_key(next, key)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ReportQueue::contains_key(const ReportState &state, uint8_t key) {
+	for (size_t i = 2; i < sizeof(state.keyboard); i++) {
+		if (state.keyboard[i] == key) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "keys.hpp"
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	static ReportState make_state(uint8_t modifiers,
+	                              uint8_t key1,
+	                              uint8_t key2,
+	                              uint8_t consumer) {
+		ReportState state = {{modifiers, 0, key1, key2, 0, 0, 0, 0},
+		                     consumer};
+		return state;
+	}
+
+	static void expect_state(ReportQueue *queue,
+	                         const ReportState &expected) {
+		ReportState state;
+		zassert_true(queue->peek(&state), "queue empty");
+		zassert_mem_equal(&state, &expected, sizeof(state),
+		                  "wrong state");
+		queue->pop();
+	}
+
+	static void report_queue_coalesce_test(void) {
+		ReportQueue queue;
+		ReportState state;
+		zassert_false(queue.peek(&state), "empty queue returned state");
+
+		// The oldest state is never modified.
+		zassert_true(queue.push(make_state(0, KEY_A, 0, 0)), "full");
+		zassert_true(queue.push(make_state(0, KEY_A, KEY_B, 0)), "full");
+		zassert_equal(queue.size(), 2, "oldest state merged");
+
+		// Further presses are merged into the newest state.
+		zassert_true(queue.push(make_state(KEY_MOD_LSHIFT, KEY_A, KEY_B, 0)),
+		             "full");
+		zassert_true(queue.push(make_state(KEY_MOD_LSHIFT,
+		                                   KEY_A,
+		                                   KEY_B,
+		                                   CONSUMER_KEY_MUTE)),
+		             "full");
+		zassert_equal(queue.size(), 2, "states not merged");
+		zassert_equal(queue.coalesced_count(), 2, "wrong counter");
+
+		// Releasing A does not revert any change of the newest state.
+		zassert_true(queue.push(make_state(KEY_MOD_LSHIFT,
+		                                   0,
+		                                   KEY_B,
+		                                   CONSUMER_KEY_MUTE)),
+		             "full");
+		zassert_equal(queue.size(), 2, "states not merged");
+
+		expect_state(&queue, make_state(0, KEY_A, 0, 0));
+		expect_state(&queue, make_state(KEY_MOD_LSHIFT,
+		                                0,
+		                                KEY_B,
+		                                CONSUMER_KEY_MUTE));
+		zassert_false(queue.peek(&state), "unexpected state");
+		zassert_equal(queue.max_size(), 2, "wrong maximum size");
+	}
+
+	static void report_queue_transition_test(void) {
+		// A quick press must not be merged into no change, neither for
+		// normal keys nor for modifiers or consumer keys.
+		static const ReportState presses[] = {
+			make_state(0, KEY_A, KEY_B, 0),
+			make_state(KEY_MOD_LCTRL, KEY_A, 0, 0),
+			make_state(0, KEY_A, 0, CONSUMER_KEY_MUTE),
+		};
+		for (size_t i = 0; i < ARRAY_SIZE(presses); i++) {
+			ReportQueue queue;
+			queue.push(make_state(0, KEY_A, 0, 0));
+			queue.push(presses[i]);
+			queue.push(make_state(0, KEY_A, 0, 0));
+			zassert_equal(queue.size(), 3, "key press merged");
+			zassert_equal(queue.coalesced_count(), 0, "wrong counter");
+		}
+
+		// Once the queue is full, the caller has to wait.
+		ReportQueue queue;
+		for (size_t i = 0; i < REPORT_QUEUE_SIZE; i++) {
+			zassert_true(queue.push(make_state(0, i % 2 ? KEY_A : 0, 0, 0)),
+			             "full");
+		}
+		zassert_equal(queue.size(), REPORT_QUEUE_SIZE, "states merged");
+		zassert_false(queue.push(make_state(0, KEY_C, 0, 0)),
+		              "push to full queue");
+
+		// Dropped states are counted.
+		queue.drop();
+		queue.pop();
+		zassert_equal(queue.dropped_count(), 1, "wrong counter");
+		zassert_equal(queue.size(), REPORT_QUEUE_SIZE - 2, "wrong size");
+		zassert_true(queue.push(make_state(0, KEY_C, 0, 0)), "full");
+	}
+
+	void report_queue_tests() {
+		ztest_test_suite(report_queue,
+			ztest_unit_test(report_queue_coalesce_test),
+			ztest_unit_test(report_queue_transition_test)
+		);
+		ztest_run_test_suite(report_queue);
+	}
+	RegisterTests report_queue_tests_(report_queue_tests);
+}
+#endif
@@ -0,0 +1,89 @@
+#ifndef REPORT_QUEUE_HPP_INCLUDED
+#define REPORT_QUEUE_HPP_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define REPORT_QUEUE_SIZE CONFIG_GOBOARD_BT_REPORT_QUEUE_SIZE
+
+/// Content of all input reports at one point in time.
+struct ReportState {
+	/// 6KRO keyboard report in boot protocol format.
+	uint8_t keyboard[8];
+	/// Consumer key bitmap.
+	uint8_t consumer;
+};
+
+/// Bounded queue of report states between the key events and the host.
+///
+/// If the host does not acknowledge the reports fast enough, the queue fills
+/// up. Instead of sending every intermediate state later, a new state replaces
+/// the newest queued state if the host does not miss any transition that way,
+/// e.g., when a second key is pressed while the first one is still held. If
+/// replacing the newest state would hide a key press or release (a key which
+/// is pressed and released again), the new state is appended instead. If the
+/// queue is full, `push()` fails and the caller has to stop processing key
+/// events until the host has caught up, so that no transition is ever lost and
+/// the RAM usage stays fixed.
+///
+/// The oldest state is only removed once it has been sent, so it is never
+/// modified. The class is not thread-safe.
+class ReportQueue {
+public:
+	ReportQueue() {}
+
+	/// Adds a new state to the queue or merges it with the newest state.
+	///
+	/// @return False if the queue is full.
+	bool push(const ReportState &state);
+
+	/// Returns the oldest state without removing it.
+	///
+	/// @return False if the queue is empty.
+	bool peek(ReportState *state);
+
+	/// Removes the oldest state after it has been sent.
+	void pop();
+
+	/// Removes the oldest state if it could not be sent, e.g., because the
+	/// host is not connected.
+	void drop();
+
+	size_t size() {
+		return count;
+	}
+
+	/// Largest number of states which were queued at the same time.
+	size_t max_size() {
+		return max_count;
+	}
+
+	/// Number of states which were merged into another queued state.
+	uint32_t coalesced_count() {
+		return coalesced;
+	}
+
+	/// Number of states which were removed without being sent.
+	uint32_t dropped_count() {
+		return dropped;
+	}
+private:
+	ReportState &entry(size_t index) {
+		return entries[(first + index) % REPORT_QUEUE_SIZE];
+	}
+
+	static bool can_merge(const ReportState &before,
+	                      const ReportState &after,
+	                      const ReportState &next);
+	static bool contains_key(const ReportState &state, uint8_t key);
+
+	ReportState entries[REPORT_QUEUE_SIZE];
+	size_t first = 0;
+	size_t count = 0;
+
+	size_t max_count = 0;
+	uint32_t coalesced = 0;
+	uint32_t dropped = 0;
+};
+
+#endif
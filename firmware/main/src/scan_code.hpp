@@ -164,6 +164,8 @@ enum ScanCode {
 	FN_KEY_UNIFYING = 0xf3,
 	FN_KEY_UNPAIR_ALL = 0xf4,
 	FN_KEY_TOGGLE_GAME_MODE = 0xf5, // Disable Windows keys.
+	FN_KEY_DEBOUNCE = 0xf6, // Select the next debouncing timing.
+	FN_KEY_USB_POLL_INTERVAL = 0xf7, // Select the next USB polling interval.
 };
 #endif
 
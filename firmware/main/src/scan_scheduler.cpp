@@ -0,0 +1,177 @@
+#include "scan_scheduler.hpp"
+
+#include "exception.hpp"
+
+#include <kernel.h>
+
+#include <errno.h>
+
+#define SCAN_TIMER DT_ALIAS(scan_timer)
+#define SCAN_TIMER_LABEL DT_LABEL(SCAN_TIMER)
+
+ScanScheduler::ScanScheduler() {
+	counter = device_get_binding(SCAN_TIMER_LABEL);
+	if (counter == NULL) {
+		throw InitializationFailed("scan timer not found");
+	}
+}
+
+ScanScheduler::~ScanScheduler() {
+	stop();
+}
+
+void ScanScheduler::start(unsigned int rate_hz,
+                          void (*callback)(void *arg),
+                          void *arg) {
+	if (rate_hz == 0 || rate_hz > SCAN_RATE_MAX_HZ) {
+		throw InvalidState("invalid scan rate");
+	}
+	stop();
+
+	this->callback = callback;
+	callback_arg = arg;
+	statistics.reset();
+
+	// The counter is reset to 0 whenever it reaches the top value, so the
+	// period does not accumulate any error from interrupt latency.
+	uint32_t ticks = counter_us_to_ticks(counter, 1000000 / rate_hz);
+	struct counter_top_cfg top_cfg;
+	top_cfg.ticks = ticks - 1;
+	top_cfg.callback = static_on_top;
+	top_cfg.user_data = this;
+	top_cfg.flags = 0;
+	int err = counter_set_top_value(counter, &top_cfg);
+	if (err == -ENOTSUP) {
+		use_alarm = true;
+		period_ticks = ticks;
+	} else if (err != 0) {
+		throw HardwareError("failed to set the scan timer period");
+	} else {
+		use_alarm = false;
+	}
+	running = true;
+	if (counter_start(counter) != 0) {
+		running = false;
+		throw HardwareError("failed to start the scan timer");
+	}
+	if (use_alarm) {
+		uint32_t now;
+		if (counter_get_value(counter, &now) != 0) {
+			stop();
+			throw HardwareError("failed to read the scan timer");
+		}
+		next_alarm = now;
+		unsigned int key = irq_lock();
+		err = set_next_alarm();
+		irq_unlock(key);
+		if (err != 0) {
+			stop();
+			throw HardwareError("failed to set the scan timer alarm");
+		}
+	}
+}
+
+void ScanScheduler::stop() {
+	unsigned int key = irq_lock();
+	running = false;
+	if (use_alarm) {
+		counter_cancel_channel_alarm(counter, 0);
+	}
+	irq_unlock(key);
+	counter_stop(counter);
+}
+
+int ScanScheduler::set_next_alarm() {
+	// The deadline is advanced by exactly one period so that the latency of
+	// the interrupt does not shift the following ticks.
+	uint64_t wrap = (uint64_t)counter_get_top_value(counter) + 1;
+	next_alarm = ((uint64_t)next_alarm + period_ticks) % wrap;
+	struct counter_alarm_cfg alarm_cfg;
+	alarm_cfg.callback = static_on_alarm;
+	alarm_cfg.ticks = next_alarm;
+	alarm_cfg.user_data = this;
+	alarm_cfg.flags = COUNTER_ALARM_CFG_ABSOLUTE |
+	                  COUNTER_ALARM_CFG_EXPIRE_WHEN_LATE;
+	int err = counter_set_channel_alarm(counter, 0, &alarm_cfg);
+	// A late alarm expires immediately.
+	return err == -ETIME ? 0 : err;
+}
+
+void ScanScheduler::get_jitter(LatencySummary *jitter) {
+	unsigned int key = irq_lock();
+	LatencyStatistics copy = statistics;
+	irq_unlock(key);
+	copy.get(jitter, counter_get_frequency(counter));
+}
+
+void ScanScheduler::static_on_top(const struct device *dev, void *user_data) {
+	ScanScheduler *thisptr = (ScanScheduler *)user_data;
+	// The counter value is the time since the timer event.
+	uint32_t latency;
+	if (counter_get_value(dev, &latency) == 0) {
+		thisptr->statistics.add(latency);
+	}
+	thisptr->callback(thisptr->callback_arg);
+}
+
+void ScanScheduler::static_on_alarm(const struct device *dev,
+                                    uint8_t chan_id,
+                                    uint32_t ticks,
+                                    void *user_data) {
+	ARG_UNUSED(chan_id);
+	ARG_UNUSED(ticks);
+	ScanScheduler *thisptr = (ScanScheduler *)user_data;
+	if (!thisptr->running) {
+		return;
+	}
+	// The latency is the time since the deadline of the alarm.
+	uint32_t now;
+	if (counter_get_value(dev, &now) == 0) {
+		uint64_t wrap = (uint64_t)counter_get_top_value(dev) + 1;
+		uint32_t deadline = thisptr->next_alarm;
+		thisptr->statistics.add(((uint64_t)now + wrap - deadline) % wrap);
+	}
+	thisptr->set_next_alarm();
+	thisptr->callback(thisptr->callback_arg);
+}
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	static void count_tick(void *arg) {
+		(*(volatile uint32_t *)arg)++;
+	}
+
+	static void scan_scheduler_test(void) {
+		// native_posix uses a simulated counter, so the number of ticks
+		// has to match the elapsed time.
+		static const unsigned int RATES[] = {250, 1000, 8000};
+		ScanScheduler scheduler;
+		for (size_t i = 0; i < ARRAY_SIZE(RATES); i++) {
+			volatile uint32_t ticks = 0;
+			scheduler.start(RATES[i], count_tick, (void *)&ticks);
+			k_sleep(K_MSEC(100));
+			scheduler.stop();
+			uint32_t expected = RATES[i] / 10;
+			zassert_within(ticks, expected, expected / 20 + 1,
+			               "wrong number of ticks");
+
+			LatencySummary jitter;
+			scheduler.get_jitter(&jitter);
+			zassert_equal(jitter.count, ticks, "ticks not counted");
+			zassert_true(jitter.max_ns <
+			             1000000000 / RATES[i],
+			             "latency longer than the period");
+		}
+	}
+
+	static void scan_scheduler_tests() {
+		ztest_test_suite(scan_scheduler,
+			ztest_unit_test(scan_scheduler_test)
+		);
+		ztest_run_test_suite(scan_scheduler);
+	}
+	RegisterTests scan_scheduler_tests_(scan_scheduler_tests);
+}
+#endif
@@ -0,0 +1,74 @@
+#ifndef SCAN_SCHEDULER_HPP_INCLUDED
+#define SCAN_SCHEDULER_HPP_INCLUDED
+
+#include "latency.hpp"
+
+#include <device.h>
+#include <drivers/counter.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SCAN_RATE_MAX_HZ 8000
+
+/// Periodic scan tick source backed by a hardware timer.
+///
+/// Unlike kernel timeouts, the ticks are generated by a free-running timer
+/// which is reset by hardware at the end of every period, so the tick rate does
+/// not depend on the system tick or on the latency of any workqueue. On the
+/// keyboard, the `scan-timer` alias selects an nRF TIMER instance, on
+/// native_posix the simulated counter is used.
+///
+/// Counters which do not support changing the top value (such as the simulated
+/// counter on native_posix) are left running freely instead, and an absolute
+/// alarm is re-armed one period after the previous deadline on every tick, so
+/// the period does not accumulate any error from interrupt latency either.
+///
+/// The scheduler measures the latency between the timer event and the
+/// callback, i.e., the jitter of the scan ticks.
+class ScanScheduler {
+public:
+	ScanScheduler();
+	~ScanScheduler();
+
+	/// Starts generating ticks and resets the latency statistics.
+	///
+	/// If the scheduler is already running, the rate is changed.
+	///
+	/// @param rate_hz Tick rate, at most `SCAN_RATE_MAX_HZ`.
+	/// @param callback Function called in interrupt context on every tick.
+	void start(unsigned int rate_hz,
+	           void (*callback)(void *arg),
+	           void *arg);
+
+	/// Stops generating ticks.
+	void stop();
+
+	/// Returns the latency statistics since the last call to `start()`.
+	void get_jitter(LatencySummary *jitter);
+private:
+	static void static_on_top(const struct device *dev, void *user_data);
+	static void static_on_alarm(const struct device *dev,
+	                            uint8_t chan_id,
+	                            uint32_t ticks,
+	                            void *user_data);
+	int set_next_alarm();
+
+	const struct device *counter;
+
+	/// True if the ticks are generated by re-arming an alarm instead of
+	/// via the top value.
+	bool use_alarm = false;
+	/// Period in counter ticks when `use_alarm` is set.
+	uint32_t period_ticks = 0;
+	/// Counter value of the next tick when `use_alarm` is set.
+	uint32_t next_alarm = 0;
+	volatile bool running = false;
+
+	void (*callback)(void *arg) = NULL;
+	void *callback_arg = NULL;
+
+	LatencyStatistics statistics;
+};
+
+#endif
@@ -10,6 +10,12 @@
 #define STACK_SIZE 1024
 #define PRIORITY -1
 
+#define SCAN_IDLE_RATE_HZ 100
+
+/// Time the receiver needs to prepare the response to a pairing request, which
+/// is fetched as an ACK payload.
+#define PAIRING_RESPONSE_DELAY K_MSEC(10)
+
 static const uint8_t PAIRING_ADDRESS[5] = {0x75, 0xa5, 0xdc, 0x0a, 0xbb};
 static const uint8_t DEVICE_WPID[2] = {0x40, 0x03}; // K270
 
@@ -55,6 +61,10 @@ enum ReportType {
 	REPORT_KEEP_ALIVE = 0x40,
 };
 
+/// Report types sent by the keyboard, as announced during pairing.
+static constexpr uint32_t DEVICE_REPORT_TYPES = 1 << REPORT_KEYBOARD;
+static const char DEVICE_NAME[] = "goboard";
+
 enum PairingMarker {
 	PAIRING_MARKER_PHASE_1 = 0xe1,
 	PAIRING_MARKER_PHASE_2 = 0xe2,
@@ -236,15 +246,17 @@ SETTINGS_STATIC_HANDLER_DEFINE(beta,
                                unifying_settings_commit,
                                unifying_settings_export);
 
-UnifyingKeyboard::UnifyingKeyboard(Keys<KeyMatrix> *keys,
+UnifyingKeyboard::UnifyingKeyboard(KeyScanner *scanner,
                                    Leds *leds,
 				   KeyboardProfile profile):
-		keys(keys), leds(leds), profile(profile),
-		actual_profile(profile) {
+		scanner(scanner), leds(leds), profile(profile),
+		actual_profile(profile), radio(&esb) {
 	k_sched_lock();
-	if (instance == NULL) {
-		instance = this;
+	if (instance != NULL) {
+		k_sched_unlock();
+		throw InvalidState("only one unifying keyboard can exist");
 	}
+	instance = this;
 	k_sched_unlock();
 
 	for (int i = 0; i < 2; i++) {
@@ -259,6 +271,7 @@ UnifyingKeyboard::UnifyingKeyboard(Keys<KeyMatrix> *keys,
 			                            (void*)&device_info[i],
 			                            sizeof(device_info[i]));
 			if (ret) {
+				instance = NULL;
 				throw InitializationFailed("cannot save unifying device info");
 			}
 		}
@@ -272,11 +285,12 @@ UnifyingKeyboard::UnifyingKeyboard(Keys<KeyMatrix> *keys,
 		state = UNIFYING_IDLE;
 	}
 
-	// Initialize the radio.
-	// TODO
-
 	// To simplify control flow, the keyboard runs a separate thread.
 	k_sem_init(&wakeup, 0, 1);
+	// The thread sleeps until it receives key events or until it has to
+	// send the next packet.
+	scanner->set_rate(CONFIG_GOBOARD_SCAN_RATE_HZ, SCAN_IDLE_RATE_HZ);
+	scanner->set_event_callback(static_on_key_events, this);
 	tid = k_thread_create(&thread, unifying_stack,
 	                      K_THREAD_STACK_SIZEOF(unifying_stack),
 	                      static_thread_entry,
@@ -291,6 +305,9 @@ UnifyingKeyboard::~UnifyingKeyboard() {
 	radio.shutdown();
 	k_sem_give(&wakeup);
 	k_thread_join(&thread, K_FOREVER);
+	scanner->set_event_callback(NULL, NULL);
+	// The LED state belongs to the receiver.
+	leds->set_keyboard_leds(0);
 
 	instance = NULL;
 }
@@ -309,6 +326,11 @@ void UnifyingKeyboard::set_profile(KeyboardProfile profile) {
 	k_sem_give(&wakeup);
 }
 
+void UnifyingKeyboard::static_on_key_events(void *arg) {
+	UnifyingKeyboard *thisptr = (UnifyingKeyboard *)arg;
+	k_sem_give(&thisptr->wakeup);
+}
+
 void UnifyingKeyboard::static_thread_entry(void *arg1, void *arg2, void *arg3) {
 	instance->thread_entry(arg1, arg2, arg3);
 }
@@ -318,7 +340,9 @@ void UnifyingKeyboard::thread_entry(void *arg1, void *arg2, void *arg3) {
 	ARG_UNUSED(arg2);
 	ARG_UNUSED(arg3);
 
-	while (true) {
+	// The thread has to terminate when stopped so that the keyboard can be
+	// destroyed.
+	while (state != UNIFYING_STOPPING) {
 		switch (state) {
 		case UNIFYING_IDLE:
 			state = idle();
@@ -335,20 +359,24 @@ void UnifyingKeyboard::thread_entry(void *arg1, void *arg2, void *arg3) {
 		case UNIFYING_STOPPING:
 			break;
 		}
+		if (stop) {
+			state = UNIFYING_STOPPING;
+		}
 	}
 }
 
 UnifyingState UnifyingKeyboard::idle() {
 	leds->set_mode(MODE_LED_DISCONNECTED);
 	while (true) {
-		// Poll the keyboard once every 50ms.
+		// There is nothing else to do in this state, so we sleep until
+		// a key is pressed.
 		UnifyingState next_state;
-		KeyBitmap key_bitmap;
-		if (poll_keyboard(50, &next_state, &key_bitmap)) {
+		bool keys_changed;
+		if (poll_keyboard(-1, &next_state, &keys_changed)) {
 			return next_state;
 		}
 
-		if (process_fn_keys(&key_bitmap, &next_state)) {
+		if (keys_changed && process_fn_keys(&next_state)) {
 			return next_state;
 		}
 	}
@@ -366,34 +394,64 @@ UnifyingState UnifyingKeyboard::idle() {
 UnifyingState UnifyingKeyboard::pairing() {
 	leds->set_mode(MODE_LED_PAIRING);
 	// Try to pair the keyboard once, and then transition to connected or
-	// idle.
+	// idle. Each phase consists of a request and a short packet which
+	// fetches the response of the receiver as an ACK payload.
+	int profile_idx = profile_index(actual_profile);
+	radio.set_address(PAIRING_ADDRESS);
+	radio.set_channels(UNIFYING_CHANNELS_PAIRING);
+
+	// Phase 1: The receiver assigns an address to the keyboard.
 	struct esb_payload request = pairing_request_1();
 	bool success = radio.send_packet(&request, NULL);
 	CHECK_STOP_SUCCESS();
+	k_sleep(PAIRING_RESPONSE_DELAY);
 	request = pairing_request_response_1();
 	struct esb_payload response;
 	success = radio.send_packet(&request, &response);
 	CHECK_STOP_SUCCESS();
-	// TODO: Apply the assigned address.
+	if (!parse_pairing_response_1(&response)) {
+		return UNIFYING_IDLE;
+	}
 	request = pairing_accept_address();
 	success = radio.send_packet(&request, NULL);
 	CHECK_STOP_SUCCESS();
+	// All further packets are sent to the address assigned by the
+	// receiver.
+	radio.set_address(pairing_info[profile_idx].device_address);
+
+	// Phase 2: Both sides exchange the nonces for the link encryption key.
+	sys_rand_get(pairing_info[profile_idx].pairing_device_nonce, 4);
 	request = pairing_request_2();
 	success = radio.send_packet(&request, NULL);
 	CHECK_STOP_SUCCESS();
+	k_sleep(PAIRING_RESPONSE_DELAY);
 	request = pairing_request_response_2();
 	success = radio.send_packet(&request, &response);
 	CHECK_STOP_SUCCESS();
-	// TODO: Derive the key.
+	if (!parse_pairing_response_2(&response)) {
+		return UNIFYING_IDLE;
+	}
+
+	// Phase 3: The keyboard sends its name, and the receiver confirms
+	// pairing.
 	request = pairing_request_3();
 	success = radio.send_packet(&request, NULL);
 	CHECK_STOP_SUCCESS();
+	k_sleep(PAIRING_RESPONSE_DELAY);
 	request = pairing_request_response_3();
 	success = radio.send_packet(&request, &response);
 	CHECK_STOP_SUCCESS();
+	if (!parse_pairing_response_3(&response)) {
+		return UNIFYING_IDLE;
+	}
+	request = pairing_complete();
+	success = radio.send_packet(&request, NULL);
+	CHECK_STOP_SUCCESS();
 
-	// TODO
-	return UNIFYING_STOPPING;
+	// The receiver leaves the pairing channels once pairing is complete.
+	radio.set_channels(UNIFYING_CHANNELS_NORMAL);
+	save_pairing_info(actual_profile);
+	return UNIFYING_CONNECTED;
 }
 
 UnifyingState UnifyingKeyboard::reconnecting() {
@@ -401,14 +459,14 @@ UnifyingState UnifyingKeyboard::reconnecting() {
 	static const int KEY_INTERVAL = 50;
 	int reconnect_counter = 0;
 	while (true) {
-		// Poll the keyboard once every 50ms.
+		// Check the keyboard at least once every 50ms.
 		UnifyingState next_state;
-		KeyBitmap key_bitmap;
-		if (poll_keyboard(KEY_INTERVAL, &next_state, &key_bitmap)) {
+		bool keys_changed;
+		if (poll_keyboard(KEY_INTERVAL, &next_state, &keys_changed)) {
 			return next_state;
 		}
 
-		if (process_fn_keys(&key_bitmap, &next_state)) {
+		if (keys_changed && process_fn_keys(&next_state)) {
 			return next_state;
 		}
 
@@ -424,25 +482,28 @@ UnifyingState UnifyingKeyboard::reconnecting() {
 UnifyingState UnifyingKeyboard::connected() {
 	leds->set_mode(MODE_LED_CONNECTED);
 	while (true) {
-		// Poll the keyboard once every 10ms.
+		// Check the keyboard at least once every 10ms.
 		UnifyingState next_state;
-		KeyBitmap key_bitmap;
-		if (poll_keyboard(10, &next_state, &key_bitmap)) {
+		bool keys_changed;
+		if (poll_keyboard(10, &next_state, &keys_changed)) {
 			return next_state;
 		}
 
 		// If the pressed keys changed, send a keyboard report. This
 		// should be done before evaluating any FN keys to allow the
-		// keyboard to reset all previously pressed keys.
+		// keyboard to reset all previously pressed keys. key_changes
+		// contains the keys which have to be added to or removed from
+		// the previous report.
 		// TODO
 
 		// Else, send a keepalive packet.
 		// TODO
 
-		// If we received anything from the host, process the packets.
+		// If we received anything from the host, process the packets
+		// via process_host_packet().
 		// TODO
 
-		if (process_fn_keys(&key_bitmap, &next_state)) {
+		if (keys_changed && process_fn_keys(&next_state)) {
 			return next_state;
 		}
 
@@ -454,41 +515,47 @@ UnifyingState UnifyingKeyboard::connected() {
 
 bool UnifyingKeyboard::poll_keyboard(int timeout,
                                      UnifyingState *next_state,
-                                     KeyBitmap *key_bitmap) {
-	if (k_sem_take(&wakeup, K_MSEC(timeout)) != 0) {
-		// Timeout.
-		return false;
+                                     bool *keys_changed) {
+	k_timeout_t wait = timeout < 0 ? K_FOREVER : K_MSEC(timeout);
+	// If events were left in the queue by the last call, there is no need
+	// to wait.
+	KeyEvent event;
+	if (scanner->get_events()->peek(&event)) {
+		wait = K_NO_WAIT;
 	}
-	if (stop) {
-		*next_state = UNIFYING_STOPPING;
-		return true;
-	}
-	// If the profile was changed, select the appropriate state.
-	k_sched_lock();
-	bool profile_changed = false;
-	if (profile != actual_profile) {
-		profile_changed = true;
-		actual_profile = profile;
-	}
-	k_sched_unlock();
+	if (k_sem_take(&wakeup, wait) == 0) {
+		// We were woken up early, check whether we were asked to stop
+		// or to change the profile.
+		if (stop) {
+			*next_state = UNIFYING_STOPPING;
+			return true;
+		}
+		// If the profile was changed, select the appropriate state.
+		k_sched_lock();
+		bool profile_changed = false;
+		if (profile != actual_profile) {
+			profile_changed = true;
+			actual_profile = profile;
+		}
+		k_sched_unlock();
 
-	if (profile_changed) {
-		// TODO
-		*next_state = state;
-		return true;
+		if (profile_changed) {
+			// TODO
+			*next_state = state;
+			return true;
+		}
 	}
 
-	keys->poll(timeout);
-	keys->get_state(key_bitmap);
+	*keys_changed = scanner->get_events()->drain(&key_bitmap,
+	                                             &key_changes);
 
 	return false;
 }
 
-bool UnifyingKeyboard::process_fn_keys(KeyBitmap *key_bitmap,
-                                       UnifyingState *next_state) {
+bool UnifyingKeyboard::process_fn_keys(UnifyingState *next_state) {
 	// If the FN combination for bluetooth was pressed, trigger a mode
 	// change.
-	if (key_bitmap->bit_is_set(FN_KEY_BLUETOOTH)) {
+	if (key_bitmap.bit_is_set(FN_KEY_BLUETOOTH)) {
 		// TODO: Notify the main thread.
 		*next_state = UNIFYING_STOPPING;
 		return true;
@@ -496,12 +563,12 @@ bool UnifyingKeyboard::process_fn_keys(KeyBitmap *key_bitmap,
 
 	// If the FN combination for pairing or removal of all pairing
 	// information was pressed, change the state.
-	if (key_bitmap->bit_is_set(FN_KEY_PAIR)) {
+	if (key_bitmap.bit_is_set(FN_KEY_PAIR)) {
 		forget_pairing_info(actual_profile);
 		*next_state = UNIFYING_PAIRING;
 		return true;
 	}
-	if (key_bitmap->bit_is_set(FN_KEY_UNPAIR_ALL)) {
+	if (key_bitmap.bit_is_set(FN_KEY_UNPAIR_ALL)) {
 		forget_pairing_info(actual_profile);
 		*next_state = UNIFYING_IDLE;
 		return true;
@@ -509,6 +576,33 @@ bool UnifyingKeyboard::process_fn_keys(KeyBitmap *key_bitmap,
 	return false;
 }
 
+void UnifyingKeyboard::process_host_packet(const struct esb_payload *packet) {
+	if (packet->length < 3) {
+		return;
+	}
+	switch (packet->data[1] & 0x1f) {
+	case REPORT_LED:
+		// The LED report uses the same encoding as the HID output
+		// report.
+		leds->set_keyboard_leds(packet->data[2]);
+		break;
+	default:
+		break;
+	}
+}
+
+void UnifyingKeyboard::save_pairing_info(KeyboardProfile profile) {
+	int profile_idx = profile_index(profile);
+	pairing_info[profile_idx].valid = true;
+	derive_device_key(profile_idx);
+	int ret = settings_save_one(PAIRING_INFO_SETTING[profile_idx],
+				    (void*)&pairing_info[profile_idx],
+				    sizeof(pairing_info[profile_idx]));
+	if (ret) {
+		throw HardwareError("cannot save unifying pairing info");
+	}
+}
+
 void UnifyingKeyboard::forget_pairing_info(KeyboardProfile profile) {
 	int profile_idx = profile_index(profile);
 	pairing_info[profile_idx].valid = false;
@@ -571,30 +665,182 @@ struct esb_payload UnifyingKeyboard::pairing_request_response_1() {
 	return packet;
 }
 
-struct esb_payload UnifyingKeyboard::pairing_accept_address() {
-	// TODO
-	assert(false && "Not yet implemented!");
+bool UnifyingKeyboard::parse_pairing_response_1(
+		const struct esb_payload *packet) {
+	if (packet->length != 22) {
+		return false;
+	}
+	if (packet->data[0] != PAIRING_MARKER_PHASE_1 ||
+			packet->data[1] != REPORT_PAIRING ||
+			packet->data[2] != 1) {
+		return false;
+	}
+	uint8_t data[22];
+	memcpy(data, packet->data, 22);
+	if (calculate_checksum(data, 21) != data[21]) {
+		return false;
+	}
+	UnifyingPairingInfo *info = &pairing_info[profile_index(actual_profile)];
+	// The address is transmitted most significant byte first, whereas the
+	// prefix is the least significant byte.
+	for (int i = 0; i < 5; i++) {
+		info->device_address[i] = data[7 - i];
+	}
+	info->dongle_wpid[0] = data[9];
+	info->dongle_wpid[1] = data[10];
+	return true;
 }
 
+struct esb_payload UnifyingKeyboard::pairing_accept_address() {
+	// The packet is identical to the one which fetched the response and
+	// probably only gives the receiver time to switch to the new address.
+	return pairing_request_response_1();
+}
 
 struct esb_payload UnifyingKeyboard::pairing_request_2() {
-	// TODO
-	assert(false && "Not yet implemented!");
+	UnifyingDeviceInfo *device = &device_info[profile_index(actual_profile)];
+	UnifyingPairingInfo *info = &pairing_info[profile_index(actual_profile)];
+	struct esb_payload packet = ESB_CREATE_PAYLOAD(
+		// Pipe
+		0,
+		// Contents
+		PAIRING_MARKER_PHASE_2,
+		REPORT_PAIRING | REPORT_KEEP_ALIVE,
+		2,
+		info->pairing_device_nonce[0],
+		info->pairing_device_nonce[1],
+		info->pairing_device_nonce[2],
+		info->pairing_device_nonce[3],
+		device->device_serial[0],
+		device->device_serial[1],
+		device->device_serial[2],
+		device->device_serial[3],
+		// Supported report types, little endian.
+		DEVICE_REPORT_TYPES & 0xff,
+		(DEVICE_REPORT_TYPES >> 8) & 0xff,
+		(DEVICE_REPORT_TYPES >> 16) & 0xff,
+		DEVICE_REPORT_TYPES >> 24,
+		POWER_SWITCH_EDGE_OF_TOP_RIGHT_CORNER,
+		0x0,
+		0x0,
+		0x0,
+		0x0,
+		0x0,
+		0x0 // Checksum
+	);
+	assert(packet.length == 22);
+	packet.data[21] = calculate_checksum(packet.data, 21);
+	return packet;
 }
 
 struct esb_payload UnifyingKeyboard::pairing_request_response_2() {
-	// TODO
-	assert(false && "Not yet implemented!");
+	UnifyingDeviceInfo *device = &device_info[profile_index(actual_profile)];
+	struct esb_payload packet = ESB_CREATE_PAYLOAD(
+		// Pipe
+		0,
+		// Contents
+		PAIRING_MARKER_PHASE_2,
+		REPORT_KEEP_ALIVE,
+		2,
+		device->pseudo_device_address[0],
+		0x0 // Checksum
+	);
+	assert(packet.length == 5);
+	packet.data[4] = calculate_checksum(packet.data, 4);
+	return packet;
+}
+
+bool UnifyingKeyboard::parse_pairing_response_2(
+		const struct esb_payload *packet) {
+	if (packet->length != 22) {
+		return false;
+	}
+	if (packet->data[0] != PAIRING_MARKER_PHASE_2 ||
+			packet->data[1] != REPORT_PAIRING ||
+			packet->data[2] != 2) {
+		return false;
+	}
+	uint8_t data[22];
+	memcpy(data, packet->data, 22);
+	if (calculate_checksum(data, 21) != data[21]) {
+		return false;
+	}
+	UnifyingPairingInfo *info = &pairing_info[profile_index(actual_profile)];
+	memcpy(info->pairing_dongle_nonce, &data[3], 4);
+	return true;
 }
 
 struct esb_payload UnifyingKeyboard::pairing_request_3() {
-	// TODO
-	assert(false && "Not yet implemented!");
+	struct esb_payload packet = ESB_CREATE_PAYLOAD(
+		// Pipe
+		0,
+		// Contents
+		PAIRING_MARKER_PHASE_3,
+		REPORT_PAIRING | REPORT_KEEP_ALIVE,
+		3,
+		1, // Number of packets containing the name.
+		sizeof(DEVICE_NAME) - 1,
+		0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+		0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+		0x0 // Checksum
+	);
+	assert(packet.length == 22);
+	static_assert(sizeof(DEVICE_NAME) - 1 <= 16, "device name too long");
+	memcpy(&packet.data[5], DEVICE_NAME, sizeof(DEVICE_NAME) - 1);
+	packet.data[21] = calculate_checksum(packet.data, 21);
+	return packet;
 }
 
 struct esb_payload UnifyingKeyboard::pairing_request_response_3() {
-	// TODO
-	assert(false && "Not yet implemented!");
+	struct esb_payload packet = ESB_CREATE_PAYLOAD(
+		// Pipe
+		0,
+		// Contents
+		PAIRING_MARKER_PHASE_3,
+		REPORT_KEEP_ALIVE,
+		3,
+		1,
+		0x0 // Checksum
+	);
+	assert(packet.length == 5);
+	packet.data[4] = calculate_checksum(packet.data, 4);
+	return packet;
+}
+
+bool UnifyingKeyboard::parse_pairing_response_3(
+		const struct esb_payload *packet) {
+	if (packet->length != 10) {
+		return false;
+	}
+	if (packet->data[0] != PAIRING_MARKER_PHASE_3 ||
+			packet->data[1] != REPORT_SET_KEEP_ALIVE ||
+			packet->data[2] != 6) {
+		return false;
+	}
+	uint8_t data[10];
+	memcpy(data, packet->data, 10);
+	return calculate_checksum(data, 9) == data[9];
+}
+
+struct esb_payload UnifyingKeyboard::pairing_complete() {
+	struct esb_payload packet = ESB_CREATE_PAYLOAD(
+		// Pipe
+		0,
+		// Contents
+		PAIRING_MARKER_PHASE_2,
+		REPORT_SET_KEEP_ALIVE | REPORT_KEEP_ALIVE,
+		6,
+		1,
+		0x0,
+		0x0,
+		0x0,
+		0x0,
+		0x0,
+		0x0 // Checksum
+	);
+	assert(packet.length == 10);
+	packet.data[9] = calculate_checksum(packet.data, 9);
+	return packet;
 }
 
 uint8_t UnifyingKeyboard::calculate_checksum(uint8_t *buffer, size_t length) {
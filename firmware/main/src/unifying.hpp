@@ -2,9 +2,10 @@
 #define UNIFYING_HPP_INCLUDED
 
 #include "mode_switch.hpp"
-#include "key_matrix.hpp"
+#include "key_scanner.hpp"
 #include "keys.hpp"
 #include "unifying_radio.hpp"
+#include "unifying_radio_esb.hpp"
 
 #include <kernel.h>
 
@@ -21,7 +22,7 @@ enum UnifyingState {
 /// Logitech Unifying keyboard implementation.
 class UnifyingKeyboard {
 public:
-	UnifyingKeyboard(Keys<KeyMatrix> *keys,
+	UnifyingKeyboard(KeyScanner *scanner,
 	                 Leds *leds,
 	                 KeyboardProfile profile);
 	~UnifyingKeyboard();
@@ -29,6 +30,7 @@ public:
 	KeyboardProfile get_profile();
 	void set_profile(KeyboardProfile profile);
 private:
+	static void static_on_key_events(void *arg);
 	static void static_thread_entry(void *arg1, void *arg2, void *arg3);
 	void thread_entry(void *arg1, void *arg2, void *arg3);
 
@@ -39,23 +41,39 @@ private:
 
 	bool poll_keyboard(int timeout,
 	                   UnifyingState *next_state,
-	                   KeyBitmap *key_bitmap);
-	bool process_fn_keys(KeyBitmap *key_bitmap, UnifyingState *next_state);
-
+	                   bool *keys_changed);
+	bool process_fn_keys(UnifyingState *next_state);
+	/// Processes a packet received from the receiver as an ACK payload.
+	void process_host_packet(const struct esb_payload *packet);
+
+	/// Marks the pairing information as valid, derives the link encryption
+	/// key and stores the information in the settings.
+	void save_pairing_info(KeyboardProfile profile);
 	void forget_pairing_info(KeyboardProfile profile);
 
 	struct esb_payload pairing_request_1();
 	struct esb_payload pairing_request_response_1();
+	/// Stores the address and WPID assigned by the receiver.
+	///
+	/// @return False if the packet is not a valid pairing response.
+	bool parse_pairing_response_1(const struct esb_payload *packet);
 	struct esb_payload pairing_accept_address();
 	struct esb_payload pairing_request_2();
 	struct esb_payload pairing_request_response_2();
+	/// Stores the nonce of the receiver.
+	///
+	/// @return False if the packet is not a valid pairing response.
+	bool parse_pairing_response_2(const struct esb_payload *packet);
 	struct esb_payload pairing_request_3();
 	struct esb_payload pairing_request_response_3();
+	/// @return False if the packet is not a valid pairing response.
+	bool parse_pairing_response_3(const struct esb_payload *packet);
+	struct esb_payload pairing_complete();
 
 	// TODO: This function probably should take an esb_payload instead!
 	static uint8_t calculate_checksum(uint8_t *buffer, size_t length);
 
-	Keys<KeyMatrix> *keys;
+	KeyScanner *scanner;
 	Leds *leds;
 
 	/// Profile as seen from the main thread (i.e., as returned by
@@ -65,6 +83,10 @@ private:
 
 	/// Semaphore to interrupt sleeping in the thread.
 	k_sem wakeup;
+	/// Key state after the key events received so far.
+	KeyBitmap key_bitmap;
+	/// Keys which changed during the last call to `poll_keyboard()`.
+	KeyBitmap key_changes;
 	/// Profile used by the thread.
 	KeyboardProfile actual_profile;
 
@@ -74,7 +96,8 @@ private:
 	
 	UnifyingState state;
 
-	UnifyingRadio radio;
+	UnifyingRadioEsb esb;
+	UnifyingRadio<UnifyingRadioEsb> radio;
 
 	// There can only be one instance of the unifying keyboard, and the
 	// callbacks need a pointer to it.
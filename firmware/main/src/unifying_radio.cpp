@@ -1,5 +1,7 @@
 #include "unifying_radio.hpp"
 
+#include <sys/util.h>
+
 static const uint8_t PAIRING_CHANNELS[] = {
 	62, 8, 35, 65, 14, 41, 71, 17, 44, 74, 5
 };
@@ -9,15 +11,238 @@ static const uint8_t NORMAL_CHANNELS[] = {
 	65, 68, 71, 74, 77
 };
 
-UnifyingRadio::UnifyingRadio() {
-	// TODO
+struct ChannelSet {
+	const uint8_t *channels;
+	size_t count;
+};
+
+static const ChannelSet CHANNEL_SETS[UNIFYING_CHANNELS_COUNT] = {
+	{ PAIRING_CHANNELS, ARRAY_SIZE(PAIRING_CHANNELS) },
+	{ NORMAL_CHANNELS, ARRAY_SIZE(NORMAL_CHANNELS) },
+};
+
+/// Number of times all channels are tried before a packet is dropped.
+#define FAILOVER_LOOP_COUNT 2
+
+template<class EsbType>
+UnifyingRadio<EsbType>::UnifyingRadio(EsbType *esb): esb(esb) {
+}
+
+template<class EsbType>
+void UnifyingRadio<EsbType>::set_address(const uint8_t *address) {
+	esb->set_address(address);
 }
 
-UnifyingRadio::~UnifyingRadio() {
-	// TODO
+template<class EsbType>
+void UnifyingRadio<EsbType>::set_channels(UnifyingChannels channels) {
+	this->channels = channels;
 }
 
-void UnifyingRadio::shutdown() {
-	// TODO
+template<class EsbType>
+bool UnifyingRadio<EsbType>::send_packet(const Payload *send,
+                                         Payload *ack_payload) {
+	if (atomic_get(&stop) != 0 || !esb->request_clock()) {
+		return false;
+	}
+	const ChannelSet &set = CHANNEL_SETS[channels];
+	size_t start = current_channel[channels];
+	bool sent = false;
+	for (size_t i = 0; i < set.count * FAILOVER_LOOP_COUNT; i++) {
+		if (atomic_get(&stop) != 0) {
+			break;
+		}
+		size_t index = (start + i) % set.count;
+		esb->set_channel(set.channels[index]);
+		if (esb->transmit(send, ack_payload)) {
+			current_channel[channels] = index;
+			sent = true;
+			break;
+		}
+	}
+	// If the packet was not sent, the receiver is probably out of range or
+	// turned off, so the next packet starts on the last working channel
+	// again.
+	esb->release_clock();
+	return sent;
 }
 
+template<class EsbType>
+void UnifyingRadio<EsbType>::shutdown() {
+	atomic_set(&stop, 1);
+	esb->abort();
+}
+
+#ifdef CONFIG_BOARD_GOBOARD_NRF52840
+#include "unifying_radio_esb.hpp"
+template class UnifyingRadio<UnifyingRadioEsb>;
+#endif
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+#include <string.h>
+namespace tests {
+	/// Artificial ESB layer for tests, which only acknowledges packets
+	/// on a single channel.
+	class MockEsb {
+	public:
+		struct Payload {
+			uint8_t length;
+			uint8_t data[32];
+		};
+
+		void set_address(const uint8_t *address) {
+			memcpy(this->address, address, sizeof(this->address));
+		}
+
+		void set_channel(uint8_t channel) {
+			this->channel = channel;
+		}
+
+		bool request_clock() {
+			zassert_false(clock_running, "clock requested twice");
+			if (clock_broken) {
+				return false;
+			}
+			clock_running = true;
+			return true;
+		}
+
+		void release_clock() {
+			zassert_true(clock_running, "clock not requested");
+			clock_running = false;
+		}
+
+		bool transmit(const Payload *packet, Payload *ack_payload) {
+			zassert_false(aborted, "transmitting after abort");
+			zassert_true(clock_running, "transmitting without clock");
+			transmissions++;
+			last_packet = *packet;
+			if (channel != good_channel) {
+				return false;
+			}
+			if (ack_payload != NULL) {
+				*ack_payload = ack;
+			}
+			return true;
+		}
+
+		void abort() {
+			aborted = true;
+		}
+
+		uint8_t address[5] = {0};
+		uint8_t channel = 0;
+		/// Channel on which the receiver listens.
+		uint8_t good_channel = 0;
+		/// Payload returned with the ACK.
+		Payload ack = {0, {0}};
+		bool aborted = false;
+		bool clock_running = false;
+		/// If true, the crystal oscillator fails to start.
+		bool clock_broken = false;
+
+		size_t transmissions = 0;
+		Payload last_packet = {0, {0}};
+	};
+
+	static void unifying_radio_failover_test(void) {
+		MockEsb esb;
+		UnifyingRadio<MockEsb> radio(&esb);
+		MockEsb::Payload packet = {3, {1, 2, 3}};
+		MockEsb::Payload ack;
+
+		// The radio hops through the channels until the receiver
+		// answers.
+		esb.good_channel = 20;
+		esb.ack = {2, {0xaa, 0xbb}};
+		zassert_true(radio.send_packet(&packet, &ack), "packet not sent");
+		zassert_equal(esb.transmissions, 6, "wrong number of attempts");
+		zassert_equal(esb.last_packet.length, 3, "wrong packet");
+		zassert_equal(ack.length, 2, "wrong ACK payload");
+		zassert_equal(ack.data[1], 0xbb, "wrong ACK payload");
+
+		// The last working channel is used first.
+		esb.transmissions = 0;
+		zassert_true(radio.send_packet(&packet, NULL), "packet not sent");
+		zassert_equal(esb.transmissions, 1, "last channel not used");
+
+		// Hopping continues after the last working channel.
+		esb.good_channel = 5;
+		esb.transmissions = 0;
+		zassert_true(radio.send_packet(&packet, NULL), "packet not sent");
+		zassert_equal(esb.transmissions, 21, "wrong number of attempts");
+
+		// If the receiver is gone, all channels are tried twice.
+		esb.good_channel = 0;
+		esb.transmissions = 0;
+		zassert_false(radio.send_packet(&packet, NULL),
+		              "packet sent without receiver");
+		zassert_equal(esb.transmissions, 50, "wrong number of attempts");
+		zassert_equal(esb.channel, 77, "wrong last channel");
+		zassert_false(esb.clock_running, "clock not released");
+	}
+
+	static void unifying_radio_clock_test(void) {
+		MockEsb esb;
+		UnifyingRadio<MockEsb> radio(&esb);
+		MockEsb::Payload packet = {1, {0}};
+
+		// The crystal oscillator only runs while a packet is sent.
+		esb.good_channel = 5;
+		zassert_true(radio.send_packet(&packet, NULL), "packet not sent");
+		zassert_false(esb.clock_running, "clock not released");
+
+		// Without the clock, nothing is sent.
+		esb.clock_broken = true;
+		esb.transmissions = 0;
+		zassert_false(radio.send_packet(&packet, NULL),
+		              "packet sent without clock");
+		zassert_equal(esb.transmissions, 0, "packet sent without clock");
+	}
+
+	static void unifying_radio_channels_test(void) {
+		MockEsb esb;
+		UnifyingRadio<MockEsb> radio(&esb);
+		MockEsb::Payload packet = {1, {0}};
+
+		// Each channel set remembers its own channel.
+		radio.set_channels(UNIFYING_CHANNELS_PAIRING);
+		esb.good_channel = 35;
+		zassert_true(radio.send_packet(&packet, NULL), "packet not sent");
+		zassert_equal(esb.transmissions, 3, "wrong number of attempts");
+		radio.set_channels(UNIFYING_CHANNELS_NORMAL);
+		esb.good_channel = 8;
+		esb.transmissions = 0;
+		zassert_true(radio.send_packet(&packet, NULL), "packet not sent");
+		zassert_equal(esb.transmissions, 2, "wrong number of attempts");
+		radio.set_channels(UNIFYING_CHANNELS_PAIRING);
+		esb.good_channel = 35;
+		esb.transmissions = 0;
+		zassert_true(radio.send_packet(&packet, NULL), "packet not sent");
+		zassert_equal(esb.transmissions, 1, "last channel not used");
+
+		static const uint8_t address[5] = {0x75, 0xa5, 0xdc, 0x0a, 0xbb};
+		radio.set_address(address);
+		zassert_mem_equal(esb.address, address, 5, "wrong address");
+
+		// After shutdown, nothing is sent anymore.
+		radio.shutdown();
+		zassert_true(esb.aborted, "transmission not aborted");
+		esb.transmissions = 0;
+		zassert_false(radio.send_packet(&packet, NULL),
+		              "packet sent after shutdown");
+		zassert_equal(esb.transmissions, 0, "packet sent after shutdown");
+	}
+
+	void unifying_radio_tests() {
+		ztest_test_suite(unifying_radio,
+			ztest_unit_test(unifying_radio_failover_test),
+			ztest_unit_test(unifying_radio_channels_test),
+			ztest_unit_test(unifying_radio_clock_test)
+		);
+		ztest_run_test_suite(unifying_radio);
+	}
+	RegisterTests unifying_radio_tests_(unifying_radio_tests);
+}
+#endif
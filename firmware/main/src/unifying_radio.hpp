@@ -1,25 +1,89 @@
 #ifndef UNIFYING_RADIO_HPP_INCLUDED
 #define UNIFYING_RADIO_HPP_INCLUDED
 
-#include "esb.h"
+#include <sys/atomic.h>
 
 #include <stdint.h>
 #include <stddef.h>
 
+/// Channel sets used by Unifying receivers.
+enum UnifyingChannels {
+	/// Channels on which a receiver listens for pairing requests.
+	UNIFYING_CHANNELS_PAIRING,
+	/// Channels used by a receiver after pairing.
+	UNIFYING_CHANNELS_NORMAL,
+	UNIFYING_CHANNELS_COUNT
+};
+
+/// Synchronous packet transmission to a Unifying receiver.
+///
+/// The receiver switches channels when it encounters interference, so if a
+/// packet is not acknowledged, the radio tries the next channel of the current
+/// channel set until the packet has been sent or all channels have been tried
+/// twice. The radio stays on the last channel which worked, as the receiver
+/// usually is still listening on that channel, so that a packet normally only
+/// requires a single transmission.
+///
+/// The crystal oscillator draws a significant current, so it is only requested
+/// while a packet is sent, and not while the keyboard waits for key presses.
+///
+/// The ESB type has to provide the following functions:
+///
+///     typedef ... Payload;
+///     void set_address(const uint8_t *address);
+///     void set_channel(uint8_t channel);
+///     /// Starts the crystal oscillator required by the radio and waits
+///     /// until it is running. Returns false on failure.
+///     bool request_clock();
+///     /// Allows the crystal oscillator to be stopped again.
+///     void release_clock();
+///     /// Sends a packet and waits for the ACK.
+///     bool transmit(const Payload *packet, Payload *ack_payload);
+///     /// Makes the current and all future calls to `transmit()` fail.
+///     void abort();
+///
+/// Only one thread may send packets at a time.
+template<class EsbType>
 class UnifyingRadio {
 public:
-	UnifyingRadio();
-	~UnifyingRadio();
+	typedef typename EsbType::Payload Payload;
+
+	UnifyingRadio(EsbType *esb);
+
+	/// Sets the 5-byte address of the receiver, least significant byte
+	/// (the prefix) first.
+	void set_address(const uint8_t *address);
 
-	bool send_packet(const struct esb_payload *send,
-	                 struct esb_payload *ack_payload);
+	/// Selects the channel set. The last working channel of each set is
+	/// remembered.
+	void set_channels(UnifyingChannels channels);
+
+	/// Sends a packet and waits until it has been acknowledged.
+	///
+	/// @param send Packet to send.
+	/// @param ack_payload If not NULL, receives the payload of the ACK.
+	/// The length is 0 if the ACK did not contain a payload.
+	/// @return False if the packet was not acknowledged on any channel or
+	/// if `shutdown()` has been called.
+	bool send_packet(const Payload *send, Payload *ack_payload);
 
 	/// Causes all current and future operations to fail immediately.
 	void shutdown();
 private:
+	EsbType *esb;
+
+	UnifyingChannels channels = UNIFYING_CHANNELS_NORMAL;
+	/// Index of the last working channel for each channel set.
+	size_t current_channel[UNIFYING_CHANNELS_COUNT] = {0};
 
-	const uint8_t *channels = NULL;
+	atomic_t stop = ATOMIC_INIT(0);
 };
 
+#ifdef CONFIG_BOARD_GOBOARD_NRF52840
+// The payload type is taken from the ESB type, so it cannot be declared
+// incomplete here.
+#include "unifying_radio_esb.hpp"
+extern template class UnifyingRadio<UnifyingRadioEsb>;
 #endif
 
+#endif
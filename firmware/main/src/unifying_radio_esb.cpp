@@ -0,0 +1,157 @@
+#include "unifying_radio_esb.hpp"
+
+#include "exception.hpp"
+
+#include <drivers/clock_control.h>
+#include <drivers/clock_control/nrf_clock_control.h>
+#include <string.h>
+
+/// Number of retransmissions on the same channel. The receiver probably
+/// listens on a different channel if the packet is lost twice, so the radio
+/// switches to the next channel quickly instead.
+#define RETRANSMIT_COUNT 1
+#define RETRANSMIT_DELAY_US 250
+
+/// Upper bound for a transmission including the retransmission, used in case
+/// the event is lost.
+#define TX_TIMEOUT K_MSEC(10)
+
+/// Upper bound for the startup of the crystal oscillator.
+#define CLOCK_TIMEOUT K_MSEC(10)
+
+UnifyingRadioEsb::UnifyingRadioEsb() {
+	k_sem_init(&tx_done, 0, 1);
+	k_sem_init(&clock_started, 0, 1);
+	clock_manager = z_nrf_clock_control_get_onoff(
+		CLOCK_CONTROL_NRF_SUBSYS_HF);
+	if (clock_manager == NULL) {
+		throw InitializationFailed("HF clock manager not found");
+	}
+	instance = this;
+
+	struct esb_config config = ESB_DEFAULT_CONFIG;
+	config.protocol = ESB_PROTOCOL_ESB_DPL;
+	config.mode = ESB_MODE_PTX;
+	config.event_handler = static_on_event;
+	config.bitrate = ESB_BITRATE_2MBPS;
+	config.crc = ESB_CRC_16BIT;
+	config.tx_output_power = ESB_TX_POWER_8DBM;
+	config.retransmit_delay = RETRANSMIT_DELAY_US;
+	config.retransmit_count = RETRANSMIT_COUNT;
+	config.tx_mode = ESB_TXMODE_AUTO;
+	config.selective_auto_ack = false;
+	if (esb_init(&config) != 0 || esb_set_address_length(5) != 0) {
+		instance = NULL;
+		throw InitializationFailed("failed to initialize ESB");
+	}
+}
+
+UnifyingRadioEsb::~UnifyingRadioEsb() {
+	esb_disable();
+	instance = NULL;
+}
+
+bool UnifyingRadioEsb::request_clock() {
+	k_sem_reset(&clock_started);
+	// The generic callback type has no parameters in C++, the actual type
+	// is onoff_client_callback.
+	sys_notify_init_callback(
+		&clock_client.notify,
+		(sys_notify_generic_callback)static_on_clock_started);
+	if (onoff_request(clock_manager, &clock_client) < 0) {
+		return false;
+	}
+	// The crystal oscillator starts within a few hundred microseconds.
+	if (k_sem_take(&clock_started, CLOCK_TIMEOUT) != 0) {
+		onoff_cancel_or_release(clock_manager, &clock_client);
+		return false;
+	}
+	if (atomic_get(&clock_result) < 0) {
+		return false;
+	}
+	return true;
+}
+
+void UnifyingRadioEsb::release_clock() {
+	onoff_release(clock_manager);
+}
+
+void UnifyingRadioEsb::set_address(const uint8_t *address) {
+	// The first byte is the prefix of pipe 0, the remaining bytes are the
+	// base address.
+	uint8_t prefixes[1] = { address[0] };
+	esb_set_base_address_0(&address[1]);
+	esb_set_prefixes(prefixes, ARRAY_SIZE(prefixes));
+}
+
+void UnifyingRadioEsb::set_channel(uint8_t channel) {
+	esb_set_rf_channel(channel);
+}
+
+bool UnifyingRadioEsb::transmit(const Payload *packet, Payload *ack_payload) {
+	if (atomic_get(&aborted) != 0) {
+		return false;
+	}
+	k_sem_reset(&tx_done);
+	atomic_set(&tx_success, 0);
+	if (esb_write_payload(packet) != 0) {
+		esb_flush_tx();
+		return false;
+	}
+	if (k_sem_take(&tx_done, TX_TIMEOUT) != 0 ||
+			atomic_get(&aborted) != 0 ||
+			atomic_get(&tx_success) == 0) {
+		// The packet must not be sent again on the next channel by the
+		// driver.
+		esb_flush_tx();
+		return false;
+	}
+
+	// The driver stores the ACK payload in the RX FIFO in the same
+	// interrupt which signals the TX_SUCCESS event.
+	if (ack_payload != NULL) {
+		if (esb_read_rx_payload(ack_payload) != 0) {
+			ack_payload->length = 0;
+		}
+	}
+	esb_flush_rx();
+	return true;
+}
+
+void UnifyingRadioEsb::abort() {
+	atomic_set(&aborted, 1);
+	k_sem_give(&tx_done);
+}
+
+void UnifyingRadioEsb::static_on_clock_started(struct onoff_manager *manager,
+                                               struct onoff_client *client,
+                                               uint32_t state,
+                                               int result) {
+	ARG_UNUSED(manager);
+	ARG_UNUSED(state);
+	UnifyingRadioEsb *thisptr = CONTAINER_OF(client,
+	                                         UnifyingRadioEsb,
+	                                         clock_client);
+	atomic_set(&thisptr->clock_result, result);
+	k_sem_give(&thisptr->clock_started);
+}
+
+void UnifyingRadioEsb::static_on_event(const struct esb_evt *event) {
+	if (instance == NULL) {
+		return;
+	}
+	switch (event->evt_id) {
+	case ESB_EVENT_TX_SUCCESS:
+		atomic_set(&instance->tx_success, 1);
+		k_sem_give(&instance->tx_done);
+		break;
+	case ESB_EVENT_TX_FAILED:
+		k_sem_give(&instance->tx_done);
+		break;
+	case ESB_EVENT_RX_RECEIVED:
+		// ACK payloads are read once the transmission has finished.
+		break;
+	}
+}
+
+UnifyingRadioEsb *UnifyingRadioEsb::instance = NULL;
@@ -0,0 +1,52 @@
+#ifndef UNIFYING_RADIO_ESB_HPP_INCLUDED
+#define UNIFYING_RADIO_ESB_HPP_INCLUDED
+
+#include <esb.h>
+#include <kernel.h>
+#include <sys/atomic.h>
+#include <sys/onoff.h>
+
+#include <stdint.h>
+
+/// Hardware-specific part of the Unifying radio code, see `UnifyingRadio`.
+///
+/// The ESB driver is asynchronous. This class turns it into the synchronous
+/// interface which `UnifyingRadio` expects. Only one instance can exist at a
+/// time as the ESB event handler does not receive a context pointer.
+class UnifyingRadioEsb {
+public:
+	typedef struct esb_payload Payload;
+
+	UnifyingRadioEsb();
+	~UnifyingRadioEsb();
+
+	void set_address(const uint8_t *address);
+	void set_channel(uint8_t channel);
+	bool request_clock();
+	void release_clock();
+	bool transmit(const Payload *packet, Payload *ack_payload);
+	void abort();
+private:
+	static void static_on_event(const struct esb_evt *event);
+	static void static_on_clock_started(struct onoff_manager *manager,
+	                                    struct onoff_client *client,
+	                                    uint32_t state,
+	                                    int result);
+
+	/// Clock manager of the high-frequency clock.
+	struct onoff_manager *clock_manager;
+	struct onoff_client clock_client;
+	/// Signalled once the crystal oscillator is running.
+	struct k_sem clock_started;
+	atomic_t clock_result = ATOMIC_INIT(0);
+
+	/// Signalled by the event handler once a transmission has finished.
+	struct k_sem tx_done;
+	/// True if the last transmission was acknowledged.
+	atomic_t tx_success = ATOMIC_INIT(0);
+	atomic_t aborted = ATOMIC_INIT(0);
+
+	static UnifyingRadioEsb *instance;
+};
+
+#endif
@@ -1,58 +1,184 @@
 #include "usb.hpp"
 
 #include "exception.hpp"
-#include "scan_code.hpp"
+#include "latency_trace.hpp"
+#include "leds.hpp"
+#include "usb_descriptor.hpp"
+#include "work_queue.hpp"
 
-#define POLL_SUSPENDED_INTERVAL_MS 10
-#define POLL_SUSPENDED_INTERVAL K_MSEC(POLL_SUSPENDED_INTERVAL_MS)
+#include <settings/settings.h>
+#include <string.h>
 
-// TODO: This code is really overcomplicated, the USB stack can just be
-// configured to use the system workqueue.
+#define LATENCY_LOG_INTERVAL_MS 10000
 
-// TODO: Proper NKRO descriptor.
-static const uint8_t hid_report_descriptor[] = HID_KEYBOARD_REPORT_DESC();
+// Report type in the high byte of wValue of a SET_REPORT request.
+#define REPORT_TYPE_OUTPUT 0x02
 
-// TODO: Keyboard LED support.
-// TODO: Multimedia keys.
+#define REPORT_ID_KEYBOARD 1
+#define REPORT_ID_CONSUMER 2
 
-UsbKeyboard::UsbKeyboard(Keys<KeyMatrix> *keys, Leds *leds): keys(keys), leds(leds) {
-	k_sched_lock();
-	if (instance == NULL) {
-		instance = this;
-	} else {
-		// TODO: Error handling?
+// In report protocol, the keyboard sends the complete KeyBitmap, i.e., one bit
+// per scan code. The modifier keys are part of the bitmap at 0xe0-0xe7. The
+// consumer keys (mute and volume) are sent in a separate report, so that the
+// keyboard report does not change when they are pressed. In boot protocol, the
+// host ignores this descriptor and expects 6KRO reports without report ID.
+static const uint8_t hid_report_descriptor[] = {
+	HID_GI_USAGE_PAGE, USAGE_GEN_DESKTOP,
+	HID_LI_USAGE, USAGE_GEN_DESKTOP_KEYBOARD,
+	HID_MI_COLLECTION, COLLECTION_APPLICATION,
+		// Report ID
+		0x85, REPORT_ID_KEYBOARD,
+		HID_GI_USAGE_PAGE, USAGE_GEN_DESKTOP_KEYPAD,
+		// Usage Minimum (0)
+		0x19, 0x00,
+		// Usage Maximum (255)
+		0x2a, 0xff, 0x00,
+		HID_GI_LOGICAL_MIN(1), 0,
+		HID_GI_LOGICAL_MAX(1), 1,
+		HID_GI_REPORT_SIZE, 1,
+		// Report Count (256)
+		0x96, 0x00, 0x01,
+		// Input (Data, Variable, Absolute)
+		HID_MI_INPUT, 0x02,
+		// LED output report, identical to the boot protocol.
+		HID_GI_USAGE_PAGE, 0x08, // LEDs
+		// Usage Minimum (Num Lock)
+		0x19, 0x01,
+		// Usage Maximum (Kana)
+		0x29, 0x05,
+		HID_GI_REPORT_SIZE, 1,
+		HID_GI_REPORT_COUNT, 5,
+		// Output (Data, Variable, Absolute)
+		HID_MI_OUTPUT, 0x02,
+		HID_GI_REPORT_SIZE, 3,
+		HID_GI_REPORT_COUNT, 1,
+		// Output (Constant) - padding
+		HID_MI_OUTPUT, 0x01,
+	HID_MI_COLLECTION_END,
+
+	HID_GI_USAGE_PAGE, 0x0c, // Consumer
+	HID_LI_USAGE, 0x01, // Consumer Control
+	HID_MI_COLLECTION, COLLECTION_APPLICATION,
+		// Report ID
+		0x85, REPORT_ID_CONSUMER,
+		HID_GI_LOGICAL_MIN(1), 0,
+		HID_GI_LOGICAL_MAX(1), 1,
+		HID_GI_REPORT_SIZE, 1,
+		HID_GI_REPORT_COUNT, 3,
+		// The order has to match ConsumerKey.
+		HID_LI_USAGE, 0xe2, // Mute
+		HID_LI_USAGE, 0xe9, // Volume Increment
+		HID_LI_USAGE, 0xea, // Volume Decrement
+		// Input (Data, Variable, Absolute)
+		HID_MI_INPUT, 0x02,
+		HID_GI_REPORT_SIZE, 5,
+		HID_GI_REPORT_COUNT, 1,
+		// Input (Constant) - padding
+		HID_MI_INPUT, 0x01,
+	HID_MI_COLLECTION_END,
+};
+
+// Descriptors of all USB classes as placed by the linker. The USB stack sends
+// them to the host as-is.
+extern "C" uint8_t __usb_descriptor_start[];
+extern "C" uint8_t __usb_descriptor_end[];
+
+static const char *const POLL_INTERVAL_SETTING = "usb/poll_interval";
+
+static_assert(usb_poll_interval_valid(CONFIG_GOBOARD_USB_POLL_INTERVAL_MS),
+              "invalid default USB polling interval");
+
+static uint8_t poll_interval_ms = CONFIG_GOBOARD_USB_POLL_INTERVAL_MS;
+
+static int usb_settings_set(const char *name,
+                            size_t len,
+                            settings_read_cb read_cb,
+                            void *cb_arg) {
+	const char *next;
+	if (!settings_name_steq(name, "poll_interval", &next) || next) {
+		return -ENOENT;
 	}
-	k_sched_unlock();
+	uint8_t value;
+	if (len != sizeof(value)) {
+		return -EINVAL;
+	}
+	int ret = read_cb(cb_arg, &value, sizeof(value));
+	if (ret < 0) {
+		return ret;
+	}
+	// Ignore invalid values, e.g., from a different firmware version.
+	if (usb_poll_interval_valid(value)) {
+		poll_interval_ms = value;
+	}
+	return 0;
+}
+
+static int usb_settings_export(int (*cb)(const char *name,
+                                         const void *value,
+                                         size_t val_len)) {
+	return cb(POLL_INTERVAL_SETTING,
+	          &poll_interval_ms,
+	          sizeof(poll_interval_ms));
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(usb_settings,
+                               "usb",
+                               NULL,
+                               usb_settings_set,
+                               NULL,
+                               usb_settings_export);
+
+// The bitmap words are sent as-is, which requires the byte order to match the
+// bit order of the report.
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error NKRO reports require a little-endian CPU.
+#endif
 
-	k_work_init_delayable(&poll_suspended, static_on_poll_suspended);
-	k_work_init(&sof, static_on_sof);
+UsbKeyboard::UsbKeyboard(KeyScanner *scanner,
+                         Leds *leds,
+                         PowerSupply<PowerSupplyPins> *power_supply):
+		scanner(scanner),
+		leds(leds),
+		power_supply(power_supply),
+		lifecycle(scanner, power_supply, static_on_wakeup, this),
+		registration(this, scanner, static_on_report_work) {
+	k_work_init(&wakeup_work, static_on_wakeup_work);
+#ifdef CONFIG_GOBOARD_USB_LATENCY_LOG
+	next_latency_log = k_uptime_get() + LATENCY_LOG_INTERVAL_MS;
+#endif
 
-	// Initialize USB.
+	// Initialize USB. The HID class cannot be unregistered, so it is only
+	// registered once and stays registered while the device is disabled.
 	hid_dev = device_get_binding("HID_0");
 	if (hid_dev == NULL) {
 		throw InitializationFailed("USB HID device not found");
 	}
-	usb_hid_register_device(hid_dev,
-	                        hid_report_descriptor,
-	                        sizeof(hid_report_descriptor),
-	                        &ops);
-	usb_hid_init(hid_dev);
+	if (!hid_registered) {
+		usb_hid_register_device(hid_dev,
+		                        hid_report_descriptor,
+		                        sizeof(hid_report_descriptor),
+		                        &ops);
+		usb_hid_init(hid_dev);
+		hid_registered = true;
+	}
+	apply_poll_interval();
 	int ret = usb_enable(status_cb);
 	if (ret != 0) {
-		// TODO: Unregister device?
 		throw InitializationFailed("failed to enable USB");
 	}
 }
 
 UsbKeyboard::~UsbKeyboard() {
-	// Stop the workqueue entries and make sure that they are not restarted.
-	// TODO
-
-	// Disable USB again.
+	// After the device has been disabled, no USB callback can submit the
+	// workqueue entries again. The report work is cancelled by the
+	// registration once the scanner callback has been removed.
 	usb_disable();
-	// TODO: Document that this class cannot be called again as USB HID is
-	// still initialized.
-	instance = NULL;
+	struct k_work_sync sync;
+	k_work_cancel_sync(&wakeup_work, &sync);
+
+	lifecycle.disconnect();
+	// The LED state belongs to the host.
+	leds->set_keyboard_leds(0);
 }
 
 KeyboardProfile UsbKeyboard::get_profile() {
@@ -64,111 +190,344 @@ void UsbKeyboard::set_profile(KeyboardProfile profile) {
 	(void)profile;
 }
 
+void UsbKeyboard::get_latency(LatencySummary *latency) {
+	unsigned int key = irq_lock();
+	LatencyStatistics copy = latency_statistics;
+	irq_unlock(key);
+	copy.get(latency, sys_clock_hw_cycles_per_sec());
+}
+
+unsigned int UsbKeyboard::get_poll_interval() {
+	return poll_interval_ms;
+}
+
+void UsbKeyboard::set_poll_interval(unsigned int interval_ms) {
+	if (!usb_poll_interval_valid(interval_ms)) {
+		throw InvalidState("invalid USB polling interval");
+	}
+	if (interval_ms == poll_interval_ms) {
+		return;
+	}
+	poll_interval_ms = interval_ms;
+	int ret = settings_save_one(POLL_INTERVAL_SETTING,
+	                            &poll_interval_ms,
+	                            sizeof(poll_interval_ms));
+	if (ret) {
+		throw HardwareError("cannot save USB polling interval");
+	}
+
+	// The host only reads the interval during enumeration. After the device
+	// has been disabled, no USB callback can submit the report work again,
+	// but the work might still be writing to the endpoint and has to finish
+	// before the device is enabled again.
+	usb_disable();
+	registration.cancel();
+	lifecycle.disconnect();
+	atomic_set(&report_in_flight, 0);
+	apply_poll_interval();
+	if (usb_enable(status_cb) != 0) {
+		throw HardwareError("failed to enable USB");
+	}
+}
+
+void UsbKeyboard::set_request_callback(void (*callback)()) {
+	k_sched_lock();
+	request_callback = callback;
+	k_sched_unlock();
+}
+
+bool UsbKeyboard::take_poll_interval_request() {
+	return atomic_cas(&poll_interval_requested, 1, 0);
+}
+
+void UsbKeyboard::select_next_poll_interval() {
+	unsigned int interval_ms = poll_interval_ms * 2;
+	if (interval_ms > 8) {
+		interval_ms = 1;
+	}
+	printk("USB polling interval: %ums\n", interval_ms);
+	set_poll_interval(interval_ms);
+}
+
+void UsbKeyboard::apply_poll_interval() {
+	usb_set_hid_poll_interval(__usb_descriptor_start,
+	                          __usb_descriptor_end - __usb_descriptor_start,
+	                          poll_interval_ms);
+	// Scanning faster than the host fetches reports only costs power. The
+	// scanner measures the time between scans with the cycle counter and
+	// passes it to the debouncer, so the debouncing timing does not depend
+	// on the rate.
+	unsigned int rate_hz = CONFIG_GOBOARD_SCAN_RATE_HZ / poll_interval_ms;
+	scanner->set_rate(rate_hz, rate_hz);
+}
+
 void UsbKeyboard::status_cb(enum usb_dc_status_code status,
                             const uint8_t *param) {
 	ARG_UNUSED(param);
 
+	UsbKeyboard *instance = Registration::get();
 	switch (status) {
 	case USB_DC_CONFIGURED:
-		instance->connected = true;
+		instance->lifecycle.configure();
+		// Reports written before are lost.
+		atomic_set(&instance->report_in_flight, 0);
+		instance->registration.submit();
 		break;
 	case USB_DC_DISCONNECTED:
-		instance->connected = false;
+		instance->lifecycle.disconnect();
+		atomic_set(&instance->report_in_flight, 0);
 		break;
 	case USB_DC_SUSPEND:
-		// While the device is suspended, we want to periodically poll
-		// the key matrix to check whether we should wake the system up.
-		// TODO: We should stop charging the batteries here?
-		atomic_set(&instance->suspended, 1);
-		k_work_schedule(&instance->poll_suspended,
-		                POLL_SUSPENDED_INTERVAL);
+		instance->lifecycle.suspend();
+		instance->registration.submit();
 		break;
 	case USB_DC_RESUME:
-		// We have to stop the work started on USB_DC_SUSPEND.
-		atomic_set(&instance->suspended, 0);
-		break;
-	case USB_DC_SOF:
-		if (instance->connected) {
-			// If we are connected, we want to poll the key matrix
-			// once per SOF, i.e. every millisecond.
-			k_work_submit(&instance->sof);
-		}
+		instance->lifecycle.resume();
+		// Send any change which happened while suspended.
+		instance->registration.submit();
 		break;
 	default:
 		break;
 	}
 }
 
-void UsbKeyboard::static_on_sof(struct k_work *work) {
-	UsbKeyboard *thisptr = CONTAINER_OF(work, UsbKeyboard, sof);
-	thisptr->on_sof();
+void UsbKeyboard::static_on_wakeup(void *arg) {
+	// Called from the scan thread, which must not block.
+	UsbKeyboard *thisptr = (UsbKeyboard *)arg;
+	k_work_submit_to_queue(&keyboard_work_q, &thisptr->wakeup_work);
+}
+
+void UsbKeyboard::static_on_wakeup_work(struct k_work *work) {
+	UsbKeyboard *thisptr = CONTAINER_OF(work, UsbKeyboard, wakeup_work);
+	if (thisptr->lifecycle.is_suspended()) {
+		// Fails if the host has not enabled remote wakeup, in which
+		// case we simply stay suspended.
+		usb_wakeup_request();
+	}
 }
 
-void UsbKeyboard::on_sof() {
-	// We always assume that this code is called once per SOF, i.e. once per
-	// millisecond. If the code is not called for some time, the only
-	// negative sideeffect is that the latency caused by debouncing is
-	// increased.
+void UsbKeyboard::static_on_report_work(struct k_work *work) {
+	Registration::from_work(work)->on_report_work();
+}
+
+void UsbKeyboard::on_report_work() {
+	if (lifecycle.is_suspended()) {
+		process_suspended_events();
+		return;
+	}
+
+#ifdef CONFIG_GOBOARD_USB_LATENCY_LOG
+	if (k_uptime_get() >= next_latency_log) {
+		LatencySummary latency;
+		get_latency(&latency);
+		printk("scan-to-wire latency: %u reports, %u-%uns, mean %uns\n",
+		       latency.count,
+		       latency.min_ns,
+		       latency.max_ns,
+		       latency.mean_ns);
+		next_latency_log = k_uptime_get() + LATENCY_LOG_INTERVAL_MS;
+	}
+#endif
 
-	keys->poll(1);
+	// The endpoint buffer can only hold one report. Once the host has
+	// fetched it, on_int_in_ready() triggers this function again.
+	if (atomic_get(&report_in_flight) != 0) {
+		return;
+	}
 
-	// Check for newly pressed/released keys.
-	KeyBitmap key_bitmap;
-	keys->get_state(&key_bitmap);
-	if (key_bitmap == prev_key_bitmap) {
+	// The keys are scanned by the key scanner thread, we only fetch the
+	// changes. If the host does not fetch the reports quickly enough, the
+	// events are queued and sent one report at a time.
+	if (!keyboard_report_pending && !consumer_report_pending) {
+		KeyBitmap changed;
+		if (!scanner->get_events()->drain(&key_bitmap,
+		                                  &changed,
+		                                  &report_time)) {
+			return;
+		}
+		apply_changes(changed);
+		report_measured = true;
+	}
+	if (!lifecycle.is_connected()) {
 		return;
 	}
-	prev_key_bitmap = key_bitmap;
 
-	// Send a keyboard report.
-	if (boot_protocol) {
-		SixKeySet six_keys = key_bitmap.to_6kro();
-		hid_int_ep_write(hid_dev,
-		                 six_keys.data,
-		                 sizeof(six_keys.data),
-		                 NULL);
+	// Write the report into the endpoint buffer right away instead of
+	// waiting for the next SOF, so that the next IN token from the host
+	// picks it up. If both reports have changed, the consumer report is
+	// sent once the keyboard report has been fetched.
+	uint8_t report[1 + sizeof(key_bitmap.keys)];
+	size_t report_length;
+	if (keyboard_report_pending) {
+		if (boot_protocol) {
+			memcpy(report, six_keys.data, sizeof(six_keys.data));
+			report_length = sizeof(six_keys.data);
+		} else {
+			// The NKRO report is the bitmap itself, only the FN key
+			// combinations and the consumer keys have to be
+			// removed.
+			KeyBitmap keys = key_bitmap;
+			keys.clear_internal_keys();
+			keys.clear_consumer_keys();
+			report[0] = REPORT_ID_KEYBOARD;
+			memcpy(&report[1], keys.keys, sizeof(keys.keys));
+			report_length = 1 + sizeof(keys.keys);
+		}
+	} else {
+		if (boot_protocol) {
+			// Boot protocol does not support consumer keys. The report
+			// can only be pending if the host switched the protocol
+			// after the changes were applied, so the next events
+			// have to be processed instead.
+			consumer_report_pending = false;
+			registration.submit();
+			return;
+		}
+		report[0] = REPORT_ID_CONSUMER;
+		report[1] = key_bitmap.consumer_keys();
+		report_length = 2;
+	}
+
+	atomic_set(&report_in_flight, 1);
+	in_flight_time = report_time;
+	in_flight_measured = report_measured;
+#ifdef CONFIG_GOBOARD_LATENCY_TRACE
+	in_flight_write_time = k_cycle_get_32();
+	if (report_measured) {
+		latency_trace_record(TRACE_STAGE_REPORT,
+		                     report_time,
+		                     in_flight_write_time);
+	}
+#endif
+	if (hid_int_ep_write(hid_dev, report, report_length, NULL) == 0) {
+		if (keyboard_report_pending) {
+			keyboard_report_pending = false;
+		} else {
+			consumer_report_pending = false;
+		}
 	} else {
-		// TODO: Proper NKRO
-		SixKeySet six_keys = key_bitmap.to_6kro();
-		hid_int_ep_write(hid_dev,
-		                 six_keys.data,
-		                 sizeof(six_keys.data),
-		                 NULL);
+		// The report is sent once the next event arrives or the device
+		// is configured again.
+		atomic_set(&report_in_flight, 0);
 	}
 }
 
-void UsbKeyboard::static_on_poll_suspended(struct k_work *work) {
-	UsbKeyboard *thisptr = CONTAINER_OF(k_work_delayable_from_work(work),
-	                                    UsbKeyboard,
-	                                    poll_suspended);
-	thisptr->on_poll_suspended();
+void UsbKeyboard::apply_changes(const KeyBitmap &changed) {
+	// Only changes of the regular keys cause a keyboard report, and
+	// changes of the consumer keys only cause a consumer report.
+	KeyBitmap keyboard_state = key_bitmap;
+	keyboard_state.clear_consumer_keys();
+	KeyBitmap keyboard_changed = changed;
+	keyboard_changed.clear_consumer_keys();
+	if (!keyboard_changed.is_empty()) {
+		six_keys.update(keyboard_state, keyboard_changed);
+		keyboard_report_pending = true;
+	}
+	// Boot protocol does not support consumer keys, and a pending consumer
+	// report would not cause any report to be sent.
+	if (changed.consumer_keys() != 0 && !boot_protocol) {
+		consumer_report_pending = true;
+	}
+	// Re-attaching the device blocks, so the main thread has to change the
+	// polling interval.
+	if (changed.bit_is_set(FN_KEY_USB_POLL_INTERVAL) &&
+	    key_bitmap.bit_is_set(FN_KEY_USB_POLL_INTERVAL)) {
+		atomic_set(&poll_interval_requested, 1);
+		k_sched_lock();
+		if (request_callback != NULL) {
+			request_callback();
+		}
+		k_sched_unlock();
+	}
 }
 
-void UsbKeyboard::on_poll_suspended() {
-	if (atomic_get(&suspended) == 0) {
-		return;
+void UsbKeyboard::process_suspended_events() {
+	// The boot protocol report is maintained incrementally, so it must not
+	// miss any change while the device is suspended. The key scanner
+	// releases all keys when it is suspended, and the changes are sent as a
+	// single report once the device is resumed. The latency of that report
+	// is not meaningful.
+	KeyBitmap changed;
+	while (scanner->get_events()->drain(&key_bitmap, &changed)) {
+		apply_changes(changed);
+		report_measured = false;
 	}
+}
 
-	keys->poll(POLL_SUSPENDED_INTERVAL_MS);
-	KeyBitmap key_bitmap;
-	keys->get_state(&key_bitmap);
-	if (key_bitmap.bit_is_set(KEY_ESCAPE)) {
-		usb_wakeup_request();
+void UsbKeyboard::on_int_in_ready(const struct device *dev) {
+	ARG_UNUSED(dev);
+
+	// The host has fetched the report from the endpoint buffer.
+	UsbKeyboard *thisptr = Registration::get();
+	if (thisptr->in_flight_measured) {
+		uint32_t now = k_cycle_get_32();
+		thisptr->latency_statistics.add(now - thisptr->in_flight_time);
+#ifdef CONFIG_GOBOARD_LATENCY_TRACE
+		latency_trace_record(TRACE_STAGE_TRANSFER,
+		                     thisptr->in_flight_write_time,
+		                     now);
+		latency_trace_record(TRACE_STAGE_TOTAL,
+		                     thisptr->in_flight_time,
+		                     now);
+#endif
+	}
+	atomic_set(&thisptr->report_in_flight, 0);
+	thisptr->registration.submit();
+}
+
+int UsbKeyboard::on_set_report(const struct device *dev,
+                               struct usb_setup_packet *setup,
+                               int32_t *len,
+                               uint8_t **data) {
+	ARG_UNUSED(dev);
+
+	// The only output report is the LED report, both in boot and in report
+	// protocol. In report protocol, it is preceded by the report ID.
+	uint8_t report_type = setup->wValue >> 8;
+	if (report_type != REPORT_TYPE_OUTPUT) {
+		return -ENOTSUP;
+	}
+	UsbKeyboard *instance = Registration::get();
+	if (instance->boot_protocol && *len >= 1) {
+		instance->leds->set_keyboard_leds((*data)[0]);
+	} else if (*len >= 2 && (*data)[0] == REPORT_ID_KEYBOARD) {
+		instance->leds->set_keyboard_leds((*data)[1]);
+	} else {
+		return -ENOTSUP;
 	}
+	return 0;
+}
 
-	k_work_schedule(&poll_suspended, POLL_SUSPENDED_INTERVAL);
+#ifdef CONFIG_ENABLE_HID_INT_OUT_EP
+void UsbKeyboard::on_int_out_ready(const struct device *dev) {
+	uint8_t report[2];
+	uint32_t read = 0;
+	if (hid_int_ep_read(dev, report, sizeof(report), &read) != 0) {
+		return;
+	}
+	UsbKeyboard *instance = Registration::get();
+	if (instance->boot_protocol && read >= 1) {
+		instance->leds->set_keyboard_leds(report[0]);
+	} else if (read >= 2 && report[0] == REPORT_ID_KEYBOARD) {
+		instance->leds->set_keyboard_leds(report[1]);
+	}
 }
+#endif
 
 void UsbKeyboard::on_protocol_change(const struct device *dev,
                                      uint8_t protocol) {
 	ARG_UNUSED(dev);
 
 	// TODO: Do we need to clear any output buffer?
-	instance->boot_protocol = protocol == HID_PROTOCOL_BOOT;
+	Registration::get()->boot_protocol = protocol == HID_PROTOCOL_BOOT;
 }
 
-UsbKeyboard *UsbKeyboard::instance = NULL;
+bool UsbKeyboard::hid_registered = false;
 const struct hid_ops UsbKeyboard::ops = {
-	 .protocol_change = on_protocol_change,
+	.set_report = on_set_report,
+	.protocol_change = on_protocol_change,
+	.int_in_ready = on_int_in_ready,
+#ifdef CONFIG_ENABLE_HID_INT_OUT_EP
+	.int_out_ready = on_int_out_ready,
+#endif
 };
-
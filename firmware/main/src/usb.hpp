@@ -2,53 +2,155 @@
 #define USB_HPP_INCLUDED
 
 #include "mode_switch.hpp"
-#include "key_matrix.hpp"
+#include "key_scanner.hpp"
+#include "keyboard_registration.hpp"
 #include "keys.hpp"
+#include "latency.hpp"
+#include "power_supply.hpp"
+#include "usb_lifecycle.hpp"
 
 #include <usb/usb_device.h>
 #include <usb/class/usb_hid.h>
 
 class Leds;
+class PowerSupplyPins;
 
 /// USB HID keyboard implementation.
+///
+/// Reports are written to the interrupt endpoint as soon as the key scanner
+/// publishes a change, so the next IN token from the host picks them up. The
+/// class measures the latency from the scan which first saw a change, i.e.,
+/// including the debouncing delay, to the completion of the IN transfer
+/// containing the report ("scan-to-wire latency"). The measurement uses the
+/// kernel cycle counter, so its resolution is limited by the system clock.
+///
+/// While the host is suspended, the key matrix is switched into low-power mode
+/// and charging is paused to stay within the suspend current limit. Any key
+/// press requests a remote wakeup.
+///
+/// The keyboard can be destroyed and constructed again at any time, e.g., when
+/// the keyboard mode is switched. Only one instance can exist at a time.
 class UsbKeyboard {
 public:
-	UsbKeyboard(Keys<KeyMatrix> *keys, Leds *leds);
+	UsbKeyboard(KeyScanner *scanner,
+	            Leds *leds,
+	            PowerSupply<PowerSupplyPins> *power_supply);
 	~UsbKeyboard();
 
 	KeyboardProfile get_profile();
 	void set_profile(KeyboardProfile profile);
+
+	/// Returns the scan-to-wire latency of all reports sent so far.
+	void get_latency(LatencySummary *latency);
+
+	/// Returns the polling interval of the HID endpoint in milliseconds.
+	unsigned int get_poll_interval();
+
+	/// Changes the polling interval of the HID endpoint and stores it in the
+	/// settings.
+	///
+	/// The key scan rate is adapted accordingly. The device is re-attached
+	/// so that the host enumerates it again with the new interval, so the
+	/// function must not be called from USB callbacks or from the keyboard
+	/// workqueue.
+	///
+	/// @param interval_ms Polling interval, must be 1, 2, 4 or 8ms.
+	void set_poll_interval(unsigned int interval_ms);
+
+	/// Sets a callback which is called whenever FN+F7 has been pressed.
+	///
+	/// The callback is called from the keyboard workqueue and must not
+	/// block. The caller is expected to call
+	/// `select_next_poll_interval()` once `take_poll_interval_request()`
+	/// returns true.
+	void set_request_callback(void (*callback)());
+
+	/// Returns true once after FN+F7 has been pressed.
+	bool take_poll_interval_request();
+
+	/// Switches to the next polling interval (1, 2, 4, 8ms, then 1ms
+	/// again). See `set_poll_interval()`.
+	void select_next_poll_interval();
 private:
 	static void status_cb(usb_dc_status_code status, const uint8_t *param);
-
-	static void static_on_sof(struct k_work *work);
-	void on_sof();
-
-	static void static_on_poll_suspended(struct k_work *work);
-	void on_poll_suspended();
-
+	void apply_poll_interval();
+
+	static void static_on_wakeup(void *arg);
+	static void static_on_wakeup_work(struct k_work *work);
+
+	static void static_on_report_work(struct k_work *work);
+	void on_report_work();
+	void apply_changes(const KeyBitmap &changed);
+	void process_suspended_events();
+
+	static void on_int_in_ready(const struct device *dev);
+	static int on_set_report(const struct device *dev,
+	                         struct usb_setup_packet *setup,
+	                         int32_t *len,
+	                         uint8_t **data);
+#ifdef CONFIG_ENABLE_HID_INT_OUT_EP
+	static void on_int_out_ready(const struct device *dev);
+#endif
 	static void on_protocol_change(const struct device *dev, uint8_t protocol);
 
-	struct k_work sof;
-	struct k_work_delayable poll_suspended;
+	struct k_work wakeup_work;
 
-	Keys<KeyMatrix> *keys;
+	KeyScanner *scanner;
 	Leds *leds;
+	PowerSupply<PowerSupplyPins> *power_supply;
 
 	const struct device *hid_dev;
 
-	bool connected = false;
-	atomic_t suspended = ATOMIC_INIT(0);
+	UsbLifecycle<KeyScanner, PowerSupply<PowerSupplyPins>> lifecycle;
 
 	bool boot_protocol = false;
-	KeyBitmap prev_key_bitmap;
+	/// Key state as seen by the host.
+	KeyBitmap key_bitmap;
+	/// Boot protocol report. The report is maintained even in report
+	/// protocol so that the host can switch protocols at any time.
+	SixKeySet six_keys;
+	/// True if the current state of the regular keys has not been written
+	/// to the endpoint yet.
+	bool keyboard_report_pending = false;
+	/// True if the current state of the consumer keys has not been written
+	/// to the endpoint yet.
+	bool consumer_report_pending = false;
+	/// True if a report has been written to the endpoint but has not been
+	/// fetched by the host yet.
+	atomic_t report_in_flight = ATOMIC_INIT(0);
+	/// True if FN+F7 has been pressed and `take_poll_interval_request()`
+	/// has not been called since.
+	atomic_t poll_interval_requested = ATOMIC_INIT(0);
+	void (*request_callback)() = NULL;
+
+	/// Scan time of the oldest change contained in the pending reports.
+	uint32_t report_time = 0;
+	/// False if the pending reports contain changes from while the device
+	/// was suspended.
+	bool report_measured = false;
+	uint32_t in_flight_time = 0;
+	bool in_flight_measured = false;
+	LatencyStatistics latency_statistics;
+#ifdef CONFIG_GOBOARD_LATENCY_TRACE
+	/// Time at which the report was written to the endpoint buffer.
+	uint32_t in_flight_write_time = 0;
+#endif
+#ifdef CONFIG_GOBOARD_USB_LATENCY_LOG
+	int64_t next_latency_log;
+#endif
 
-	// There can only be one instance of the USB keyboard, and the USB callbacks
-	// need a pointer to it.
-	static UsbKeyboard *instance;
+	typedef KeyboardRegistration<UsbKeyboard, KeyScanner> Registration;
+	/// Only one USB keyboard can exist, and the USB callbacks get the
+	/// instance from the registration. Declared last, so that the scanner
+	/// callback is removed and the report work is cancelled before any
+	/// other member is destroyed.
+	Registration registration;
+
+	/// True if the HID class has been registered with the USB stack. This
+	/// is only done once as it cannot be undone.
+	static bool hid_registered;
 
 	static const struct hid_ops ops;
 };
 
 #endif
-
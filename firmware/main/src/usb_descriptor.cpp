@@ -0,0 +1,118 @@
+#include "usb_descriptor.hpp"
+
+#define DESCRIPTOR_INTERFACE 0x04
+#define DESCRIPTOR_ENDPOINT 0x05
+
+#define INTERFACE_CLASS_HID 0x03
+
+#define ENDPOINT_DIRECTION_IN 0x80
+#define ENDPOINT_TRANSFER_TYPE_MASK 0x03
+#define ENDPOINT_TRANSFER_TYPE_INTERRUPT 0x03
+
+int usb_set_hid_poll_interval(uint8_t *descriptors,
+                              size_t length,
+                              uint8_t interval_ms) {
+	int modified = 0;
+	bool hid_interface = false;
+	size_t offset = 0;
+	// Every descriptor starts with bLength and bDescriptorType.
+	while (offset + 2 <= length) {
+		uint8_t *descriptor = &descriptors[offset];
+		uint8_t descriptor_length = descriptor[0];
+		if (descriptor_length < 2 || offset + descriptor_length > length) {
+			// Terminator or corrupted descriptor.
+			break;
+		}
+		switch (descriptor[1]) {
+		case DESCRIPTOR_INTERFACE:
+			// The endpoints of an interface follow its interface
+			// descriptor.
+			hid_interface = descriptor_length >= 9 &&
+			                descriptor[5] == INTERFACE_CLASS_HID;
+			break;
+		case DESCRIPTOR_ENDPOINT:
+			if (hid_interface &&
+			    descriptor_length >= 7 &&
+			    (descriptor[2] & ENDPOINT_DIRECTION_IN) != 0 &&
+			    (descriptor[3] & ENDPOINT_TRANSFER_TYPE_MASK) ==
+			    ENDPOINT_TRANSFER_TYPE_INTERRUPT) {
+				descriptor[6] = interval_ms;
+				modified++;
+			}
+			break;
+		default:
+			break;
+		}
+		offset += descriptor_length;
+	}
+	return modified;
+}
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	static void usb_poll_interval_test(void) {
+		uint8_t descriptors[] = {
+			// Device
+			18, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+			0x09, 0x12, 0x01, 0x00, 0x00, 0x01, 0x01, 0x02,
+			0x03, 0x01,
+			// Configuration
+			9, 0x02, 66, 0x00, 0x02, 0x01, 0x00, 0xa0, 50,
+			// Interface 0 (HID)
+			9, 0x04, 0x00, 0x00, 0x02, 0x03, 0x01, 0x01, 0x00,
+			// HID
+			9, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x40, 0x00,
+			// Endpoint 1 IN (interrupt)
+			7, 0x05, 0x81, 0x03, 0x40, 0x00, 0x09,
+			// Endpoint 1 OUT (interrupt)
+			7, 0x05, 0x01, 0x03, 0x40, 0x00, 0x09,
+			// Interface 1 (vendor-specific)
+			9, 0x04, 0x01, 0x00, 0x02, 0xff, 0x00, 0x00, 0x00,
+			// Endpoint 2 IN (interrupt)
+			7, 0x05, 0x82, 0x03, 0x40, 0x00, 0x09,
+			// Endpoint 3 IN (bulk)
+			7, 0x05, 0x83, 0x02, 0x40, 0x00, 0x00,
+			// Terminator
+			0, 0,
+		};
+		static const size_t HID_IN_INTERVAL = 18 + 9 + 9 + 9 + 6;
+		static const size_t HID_OUT_INTERVAL = HID_IN_INTERVAL + 7;
+		static const size_t VENDOR_IN_INTERVAL = HID_OUT_INTERVAL + 9 + 7;
+
+		int modified = usb_set_hid_poll_interval(descriptors,
+		                                         sizeof(descriptors),
+		                                         4);
+		zassert_equal(modified, 1, "wrong number of endpoints");
+		zassert_equal(descriptors[HID_IN_INTERVAL], 4,
+		              "interval not modified");
+		zassert_equal(descriptors[HID_OUT_INTERVAL], 9,
+		              "OUT endpoint modified");
+		zassert_equal(descriptors[VENDOR_IN_INTERVAL], 9,
+		              "non-HID endpoint modified");
+
+		// Truncated descriptors must not be accessed beyond the end.
+		modified = usb_set_hid_poll_interval(descriptors,
+		                                     HID_IN_INTERVAL,
+		                                     8);
+		zassert_equal(modified, 0, "truncated endpoint modified");
+		zassert_equal(descriptors[HID_IN_INTERVAL], 4,
+		              "truncated endpoint modified");
+
+		zassert_true(usb_poll_interval_valid(1), "1ms invalid");
+		zassert_true(usb_poll_interval_valid(8), "8ms invalid");
+		zassert_false(usb_poll_interval_valid(0), "0ms valid");
+		zassert_false(usb_poll_interval_valid(3), "3ms valid");
+		zassert_false(usb_poll_interval_valid(16), "16ms valid");
+	}
+
+	static void usb_descriptor_tests() {
+		ztest_test_suite(usb_descriptor,
+			ztest_unit_test(usb_poll_interval_test)
+		);
+		ztest_run_test_suite(usb_descriptor);
+	}
+	RegisterTests usb_descriptor_tests_(usb_descriptor_tests);
+}
+#endif
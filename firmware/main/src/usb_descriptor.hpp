@@ -0,0 +1,32 @@
+#ifndef USB_DESCRIPTOR_HPP_INCLUDED
+#define USB_DESCRIPTOR_HPP_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Returns true if the HID endpoint polling interval is supported.
+///
+/// The interval is restricted to 1, 2, 4 and 8ms so that the scan rate can be
+/// derived by dividing the configured scan rate.
+static inline constexpr bool usb_poll_interval_valid(unsigned int interval_ms) {
+	return interval_ms == 1 || interval_ms == 2 ||
+	       interval_ms == 4 || interval_ms == 8;
+}
+
+/// Changes the polling interval (`bInterval`) of all interrupt IN endpoints of
+/// HID interfaces.
+///
+/// The function walks a sequence of standard USB descriptors as sent to the
+/// host in response to GET_DESCRIPTOR(Configuration). For full-speed devices,
+/// the interval is specified in milliseconds. The host only reads the new
+/// value during enumeration, so the device has to be re-attached afterwards.
+///
+/// @param descriptors Sequence of descriptors.
+/// @param length Size of the sequence in bytes.
+/// @param interval_ms New polling interval.
+/// @return Number of modified endpoints.
+int usb_set_hid_poll_interval(uint8_t *descriptors,
+                              size_t length,
+                              uint8_t interval_ms);
+
+#endif
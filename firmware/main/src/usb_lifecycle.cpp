@@ -0,0 +1,208 @@
+#include "usb_lifecycle.hpp"
+
+template<class ScannerType, class PowerSupplyType>
+UsbLifecycle<ScannerType, PowerSupplyType>::UsbLifecycle(
+		ScannerType *scanner,
+		PowerSupplyType *power_supply,
+		void (*wakeup_callback)(void *arg),
+		void *wakeup_arg):
+		scanner(scanner),
+		power_supply(power_supply),
+		wakeup_callback(wakeup_callback),
+		wakeup_arg(wakeup_arg) {
+}
+
+template<class ScannerType, class PowerSupplyType>
+void UsbLifecycle<ScannerType, PowerSupplyType>::configure() {
+	atomic_set(&connected, 1);
+}
+
+template<class ScannerType, class PowerSupplyType>
+void UsbLifecycle<ScannerType, PowerSupplyType>::disconnect() {
+	atomic_set(&connected, 0);
+	leave_suspend();
+}
+
+template<class ScannerType, class PowerSupplyType>
+void UsbLifecycle<ScannerType, PowerSupplyType>::suspend() {
+	if (atomic_set(&suspended, 1) != 0) {
+		return;
+	}
+	power_supply->pause_charging(true);
+	scanner->suspend(wakeup_callback, wakeup_arg);
+}
+
+template<class ScannerType, class PowerSupplyType>
+void UsbLifecycle<ScannerType, PowerSupplyType>::resume() {
+	leave_suspend();
+}
+
+template<class ScannerType, class PowerSupplyType>
+void UsbLifecycle<ScannerType, PowerSupplyType>::leave_suspend() {
+	if (atomic_set(&suspended, 0) == 0) {
+		return;
+	}
+	scanner->resume();
+	power_supply->pause_charging(false);
+}
+
+#ifdef CONFIG_BOARD_GOBOARD_NRF52840
+#include "key_scanner.hpp"
+#include "power_supply.hpp"
+#include "power_supply_pins.hpp"
+template class UsbLifecycle<KeyScanner, PowerSupply<PowerSupplyPins>>;
+#endif
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	class MockScanner {
+	public:
+		void suspend(void (*wakeup_callback)(void *arg), void *arg) {
+			zassert_false(suspended, "scanner suspended twice");
+			suspended = true;
+			this->wakeup_callback = wakeup_callback;
+			wakeup_arg = arg;
+		}
+
+		void resume() {
+			zassert_true(suspended, "scanner not suspended");
+			suspended = false;
+		}
+
+		/// Simulates a key press while suspended.
+		void press_key() {
+			if (suspended) {
+				wakeup_callback(wakeup_arg);
+			}
+		}
+
+		bool suspended = false;
+		void (*wakeup_callback)(void *arg) = NULL;
+		void *wakeup_arg = NULL;
+	};
+
+	class MockPowerSupply {
+	public:
+		void pause_charging(bool paused) {
+			charging_paused = paused;
+		}
+
+		bool charging_paused = false;
+	};
+
+	typedef UsbLifecycle<MockScanner, MockPowerSupply> TestLifecycle;
+
+	static void count_wakeup(void *arg) {
+		(*(unsigned int *)arg)++;
+	}
+
+	static void usb_suspend_resume_test(void) {
+		MockScanner scanner;
+		MockPowerSupply power_supply;
+		unsigned int wakeups = 0;
+		TestLifecycle lifecycle(&scanner,
+		                        &power_supply,
+		                        count_wakeup,
+		                        &wakeups);
+		zassert_false(lifecycle.is_connected(), "connected initially");
+
+		lifecycle.configure();
+		zassert_true(lifecycle.is_connected(), "not connected");
+		scanner.press_key();
+		zassert_equal(wakeups, 0, "wakeup while not suspended");
+
+		// The key matrix and charging are switched off while suspended,
+		// and a key press wakes the host.
+		lifecycle.suspend();
+		zassert_true(lifecycle.is_suspended(), "not suspended");
+		zassert_true(lifecycle.is_connected(), "suspend disconnected");
+		zassert_true(scanner.suspended, "scanner not suspended");
+		zassert_true(power_supply.charging_paused, "charging not paused");
+		scanner.press_key();
+		zassert_equal(wakeups, 1, "no wakeup");
+
+		// The host may suspend the bus again without a resume.
+		lifecycle.suspend();
+		zassert_true(scanner.suspended, "scanner not suspended");
+
+		lifecycle.resume();
+		zassert_false(lifecycle.is_suspended(), "still suspended");
+		zassert_false(scanner.suspended, "scanner not resumed");
+		zassert_false(power_supply.charging_paused,
+		              "charging still paused");
+		scanner.press_key();
+		zassert_equal(wakeups, 1, "wakeup after resume");
+
+		// A resume without suspend (e.g., after a bus reset) does not
+		// change anything.
+		lifecycle.resume();
+		zassert_false(scanner.suspended, "scanner suspended");
+		zassert_true(lifecycle.is_connected(), "resume disconnected");
+	}
+
+	static void usb_disconnect_test(void) {
+		MockScanner scanner;
+		MockPowerSupply power_supply;
+		unsigned int wakeups = 0;
+		TestLifecycle lifecycle(&scanner,
+		                        &power_supply,
+		                        count_wakeup,
+		                        &wakeups);
+		lifecycle.configure();
+		lifecycle.suspend();
+
+		// A disconnect during suspend is not followed by a resume.
+		lifecycle.disconnect();
+		zassert_false(lifecycle.is_connected(), "still connected");
+		zassert_false(lifecycle.is_suspended(), "still suspended");
+		zassert_false(scanner.suspended, "scanner not resumed");
+		zassert_false(power_supply.charging_paused,
+		              "charging still paused");
+
+		// Disconnecting twice (e.g., disabling the device after the
+		// cable was removed) is harmless.
+		lifecycle.disconnect();
+		zassert_false(lifecycle.is_connected(), "connected");
+	}
+
+	static void usb_reconfigure_test(void) {
+		MockScanner scanner;
+		MockPowerSupply power_supply;
+		unsigned int wakeups = 0;
+		TestLifecycle lifecycle(&scanner,
+		                        &power_supply,
+		                        count_wakeup,
+		                        &wakeups);
+		lifecycle.configure();
+		lifecycle.suspend();
+
+		// Changing the polling interval disables the device while the
+		// host is suspended, and the host enumerates it again.
+		lifecycle.disconnect();
+		zassert_false(scanner.suspended, "scanner not resumed");
+		lifecycle.configure();
+		zassert_true(lifecycle.is_connected(), "not connected");
+		zassert_false(lifecycle.is_suspended(), "suspended");
+		zassert_false(power_supply.charging_paused, "charging paused");
+
+		// The new configuration can be suspended and resumed as usual.
+		lifecycle.suspend();
+		scanner.press_key();
+		zassert_equal(wakeups, 1, "no wakeup");
+		lifecycle.resume();
+		zassert_false(scanner.suspended, "scanner not resumed");
+	}
+
+	static void usb_lifecycle_tests() {
+		ztest_test_suite(usb_lifecycle,
+			ztest_unit_test(usb_suspend_resume_test),
+			ztest_unit_test(usb_disconnect_test),
+			ztest_unit_test(usb_reconfigure_test)
+		);
+		ztest_run_test_suite(usb_lifecycle);
+	}
+	RegisterTests usb_lifecycle_tests_(usb_lifecycle_tests);
+}
+#endif
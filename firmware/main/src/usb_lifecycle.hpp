@@ -0,0 +1,64 @@
+#ifndef USB_LIFECYCLE_HPP_INCLUDED
+#define USB_LIFECYCLE_HPP_INCLUDED
+
+#include <sys/atomic.h>
+
+/// Connection state of the USB keyboard.
+///
+/// The USB stack reports when the host configures, suspends, resumes or
+/// disconnects the device. While the host is suspended, the device must not
+/// draw more than 2.5mA, so the key matrix is switched into low-power mode and
+/// charging is paused. Any key press then calls the wakeup callback, which
+/// requests a remote wakeup.
+///
+/// A disconnect during suspend is not followed by a resume, so disconnecting
+/// (or disabling the device to change the descriptors) always leaves suspend
+/// mode.
+///
+/// The scanner type has to provide the functions `suspend()` and `resume()` of
+/// `KeyScanner`, the power supply type the function `pause_charging()` of
+/// `PowerSupply`. The transitions are called from the USB callbacks, whereas
+/// the state can be read from any thread.
+template<class ScannerType, class PowerSupplyType>
+class UsbLifecycle {
+public:
+	UsbLifecycle(ScannerType *scanner,
+	             PowerSupplyType *power_supply,
+	             void (*wakeup_callback)(void *arg),
+	             void *wakeup_arg);
+
+	/// The host has configured the device.
+	void configure();
+	/// The device has been disconnected or disabled.
+	void disconnect();
+	/// The host has suspended the bus.
+	void suspend();
+	/// The host has resumed the bus.
+	void resume();
+
+	bool is_connected() {
+		return atomic_get(&connected) != 0;
+	}
+	bool is_suspended() {
+		return atomic_get(&suspended) != 0;
+	}
+private:
+	void leave_suspend();
+
+	ScannerType *scanner;
+	PowerSupplyType *power_supply;
+	void (*wakeup_callback)(void *arg);
+	void *wakeup_arg;
+
+	atomic_t connected = ATOMIC_INIT(0);
+	atomic_t suspended = ATOMIC_INIT(0);
+};
+
+#ifdef CONFIG_BOARD_GOBOARD_NRF52840
+class KeyScanner;
+class PowerSupplyPins;
+template<class PowerSupplyPinType> class PowerSupply;
+extern template class UsbLifecycle<KeyScanner, PowerSupply<PowerSupplyPins>>;
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+#include "work_queue.hpp"
+
+#include <init.h>
+
+K_THREAD_STACK_DEFINE(keyboard_work_q_stack,
+                      CONFIG_GOBOARD_KEYBOARD_WORKQUEUE_STACK_SIZE);
+
+K_THREAD_STACK_DEFINE(background_work_q_stack,
+                      CONFIG_GOBOARD_BACKGROUND_WORKQUEUE_STACK_SIZE);
+
+BUILD_ASSERT(CONFIG_SYSTEM_WORKQUEUE_PRIORITY < 0,
+             "the Bluetooth code requires a cooperative system workqueue");
+BUILD_ASSERT(CONFIG_GOBOARD_BACKGROUND_WORKQUEUE_PRIORITY >= 0,
+             "the background workqueue must be preemptible");
+
+struct k_work_q keyboard_work_q;
+struct k_work_q background_work_q;
+
+static int start_work_queues(const struct device *dev) {
+	(void)dev;
+	struct k_work_queue_config keyboard_config = {
+		.name = "keyboard_workq",
+		.no_yield = false,
+	};
+	k_work_queue_start(&keyboard_work_q,
+	                   keyboard_work_q_stack,
+	                   K_THREAD_STACK_SIZEOF(keyboard_work_q_stack),
+	                   CONFIG_GOBOARD_KEYBOARD_WORKQUEUE_PRIORITY,
+	                   &keyboard_config);
+	struct k_work_queue_config background_config = {
+		.name = "background_workq",
+		.no_yield = false,
+	};
+	k_work_queue_start(&background_work_q,
+	                   background_work_q_stack,
+	                   K_THREAD_STACK_SIZEOF(background_work_q_stack),
+	                   CONFIG_GOBOARD_BACKGROUND_WORKQUEUE_PRIORITY,
+	                   &background_config);
+	return 0;
+}
+SYS_INIT(start_work_queues,
+         APPLICATION,
+         CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+
+#ifndef CONFIG_BOARD_GOBOARD_NRF52840
+#include "tests.hpp"
+#include <ztest.h>
+namespace tests {
+	static volatile bool slow_work_running = false;
+	static volatile bool keyboard_work_done = false;
+	static volatile bool keyboard_work_during_slow_work = false;
+	static int64_t keyboard_work_submit_time = 0;
+	static int64_t keyboard_work_time = 0;
+	static struct k_work keyboard_work;
+	static struct k_timer keyboard_timer;
+
+	static void keyboard_timer_handler(struct k_timer *timer) {
+		(void)timer;
+		// Submitted from an interrupt like the USB and radio code.
+		keyboard_work_submit_time = k_uptime_get();
+		k_work_submit_to_queue(&keyboard_work_q, &keyboard_work);
+	}
+
+	static void slow_work_handler(struct k_work *work) {
+		(void)work;
+		// Occupies the CPU without ever yielding, so the keyboard work
+		// can only run if it preempts this work item.
+		slow_work_running = true;
+		k_timer_start(&keyboard_timer, K_MSEC(1), K_NO_WAIT);
+		k_busy_wait(50000);
+		slow_work_running = false;
+	}
+
+	static void keyboard_work_handler(struct k_work *work) {
+		(void)work;
+		keyboard_work_during_slow_work = slow_work_running;
+		keyboard_work_time = k_uptime_get();
+		keyboard_work_done = true;
+	}
+
+	static void keyboard_work_starvation_test(void) {
+		struct k_work slow_work;
+		k_work_init(&slow_work, slow_work_handler);
+		k_work_init(&keyboard_work, keyboard_work_handler);
+		k_timer_init(&keyboard_timer, keyboard_timer_handler, NULL);
+
+		// Occupy the background workqueue like the power supply code.
+		// The keyboard work is submitted while the slow work is
+		// running.
+		k_work_submit_to_queue(&background_work_q, &slow_work);
+		struct k_work_sync sync;
+		k_work_flush(&slow_work, &sync);
+		zassert_false(slow_work_running, "slow work not finished");
+
+		// Work on the keyboard queue must be executed immediately.
+		zassert_true(keyboard_work_done, "keyboard work starved");
+		zassert_true(keyboard_work_during_slow_work,
+		             "keyboard work waited for the background workqueue");
+		zassert_true(keyboard_work_time - keyboard_work_submit_time <= 1,
+		             "keyboard work delayed");
+	}
+
+	static void work_queue_tests() {
+		ztest_test_suite(work_queue,
+			ztest_unit_test(keyboard_work_starvation_test)
+		);
+		ztest_run_test_suite(work_queue);
+	}
+	RegisterTests work_queue_tests_(work_queue_tests);
+}
+#endif
@@ -0,0 +1,23 @@
+#ifndef WORK_QUEUE_HPP_INCLUDED
+#define WORK_QUEUE_HPP_INCLUDED
+
+#include <kernel.h>
+
+/// Work queue for latency-critical keyboard I/O.
+///
+/// Work items which send key reports are submitted to this queue instead of
+/// the system workqueue, so they never wait for unrelated work. The queue is
+/// started during system initialization.
+extern struct k_work_q keyboard_work_q;
+
+/// Work queue for slow work such as the power supply and mode switch code.
+///
+/// The power supply code performs blocking ADC measurements. The system
+/// workqueue has to stay cooperative as the Bluetooth stack and the Bluetooth
+/// keyboard rely on it, so such work is executed on this queue instead. The
+/// queue has a low, preemptible priority, so the keyboard workqueue and all
+/// other cooperative threads preempt it even while a work item is running. The
+/// queue is started during system initialization.
+extern struct k_work_q background_work_q;
+
+#endif